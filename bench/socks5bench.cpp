@@ -0,0 +1,461 @@
+﻿#include <cstdio>
+#include <cstring>
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <asio.hpp>
+#include "socks5_defines.hpp"
+
+using asio::ip::tcp;
+using asio::ip::udp;
+using asio::awaitable;
+using asio::co_spawn;
+using asio::detached;
+using clock_type = std::chrono::steady_clock;
+
+// Modes of socks5bench_sink, selected by the first byte of a TCP connection.
+constexpr uint8_t mode_echo = 'e';
+constexpr uint8_t mode_sink = 's';
+constexpr uint8_t mode_generate = 'g';
+
+struct bench_options
+{
+	tcp::endpoint proxy{ asio::ip::make_address("127.0.0.1"), 1080 };
+	tcp::endpoint target{ asio::ip::make_address("127.0.0.1"), 19100 };
+	std::string username;
+	std::string password;
+	std::string scenario = "all";
+	std::string label;
+	size_t connections = 64;
+	size_t threads = 1;
+	size_t chunk_size = 16 * 1024;
+	size_t datagram_size = 512;
+	size_t udp_window = 32;
+	std::chrono::seconds duration{ 5 };
+};
+
+bench_options options;
+
+// Results shared by the workers of one scenario. Counters are atomic because
+// the io_context may run on several threads; latencies are merged at the end.
+struct bench_result
+{
+	std::atomic<uint64_t> operations{};
+	std::atomic<uint64_t> bytes{};
+	std::atomic<uint64_t> errors{};
+	std::mutex latency_mutex;
+	std::vector<uint32_t> latencies_us;
+};
+
+// Opens a connection to the proxy and performs the SOCKS5 handshake.
+// For UDP Associate, `bound` receives the relay endpoint from the reply.
+awaitable<bool> socks5_handshake(tcp::socket &socket, uint8_t command, const tcp::endpoint &destination, udp::endpoint *bound = nullptr)
+{
+	asio::error_code ec;
+	co_await socket.async_connect(options.proxy, asio::redirect_error(asio::use_awaitable, ec));
+	if (ec)
+		co_return false;
+	socket.set_option(tcp::no_delay(true), ec);
+
+	bool use_password = !options.username.empty();
+	std::array<uint8_t, 3> greeting = { socks_version, 1, use_password ? socks_method_user_pwd : socks_method_no_auth };
+	co_await asio::async_write(socket, asio::buffer(greeting), asio::redirect_error(asio::use_awaitable, ec));
+	std::array<uint8_t, 2> selection = {};
+	if (!ec)
+		co_await asio::async_read(socket, asio::buffer(selection), asio::redirect_error(asio::use_awaitable, ec));
+	if (ec || selection[1] != greeting[2])
+		co_return false;
+
+	if (use_password)
+	{
+		std::vector<uint8_t> auth = { socks_auth_version, (uint8_t)options.username.size() };
+		auth.insert(auth.end(), options.username.begin(), options.username.end());
+		auth.push_back((uint8_t)options.password.size());
+		auth.insert(auth.end(), options.password.begin(), options.password.end());
+		co_await asio::async_write(socket, asio::buffer(auth), asio::redirect_error(asio::use_awaitable, ec));
+		std::array<uint8_t, 2> auth_reply = {};
+		if (!ec)
+			co_await asio::async_read(socket, asio::buffer(auth_reply), asio::redirect_error(asio::use_awaitable, ec));
+		if (ec || auth_reply[1] != socks_auth_success)
+			co_return false;
+	}
+
+	std::array<uint8_t, socks_header_ipv6_size> request = { socks_version, command, 0 };
+	size_t request_size = 0;
+	asio::ip::address address = destination.address();
+	if (address.is_v4())
+	{
+		request[3] = socks_atyp_ipv4;
+		asio::ip::address_v4::bytes_type bytes = address.to_v4().to_bytes();
+		std::copy(bytes.begin(), bytes.end(), request.begin() + 4);
+		request_size = socks_header_ipv4_size;
+	}
+	else
+	{
+		request[3] = socks_atyp_ipv6;
+		asio::ip::address_v6::bytes_type bytes = address.to_v6().to_bytes();
+		std::copy(bytes.begin(), bytes.end(), request.begin() + 4);
+		request_size = socks_header_ipv6_size;
+	}
+	request[request_size - 2] = (uint8_t)(destination.port() >> 8);
+	request[request_size - 1] = (uint8_t)(destination.port() & 0xFF);
+	co_await asio::async_write(socket, asio::buffer(request, request_size), asio::redirect_error(asio::use_awaitable, ec));
+
+	std::array<uint8_t, socks_header_ipv6_size> reply = {};
+	if (!ec)
+		co_await asio::async_read(socket, asio::buffer(reply, 4), asio::redirect_error(asio::use_awaitable, ec));
+	if (ec || reply[1] != socks_reply_success)
+		co_return false;
+
+	size_t reply_size = reply[3] == socks_atyp_ipv6 ? socks_header_ipv6_size : socks_header_ipv4_size;
+	co_await asio::async_read(socket, asio::buffer(reply.data() + 4, reply_size - 4), asio::redirect_error(asio::use_awaitable, ec));
+	if (ec)
+		co_return false;
+
+	if (bound != nullptr)
+	{
+		uint16_t port = (uint16_t)((reply[reply_size - 2] << 8) | reply[reply_size - 1]);
+		asio::ip::address bound_address;
+		if (reply[3] == socks_atyp_ipv6)
+		{
+			asio::ip::address_v6::bytes_type bytes;
+			std::copy_n(reply.begin() + 4, 16, bytes.begin());
+			bound_address = asio::ip::address_v6(bytes);
+		}
+		else
+		{
+			asio::ip::address_v4::bytes_type bytes;
+			std::copy_n(reply.begin() + 4, 4, bytes.begin());
+			bound_address = asio::ip::address_v4(bytes);
+		}
+		if (bound_address.is_unspecified())
+			bound_address = options.proxy.address();
+		*bound = udp::endpoint(bound_address, port);
+	}
+	co_return true;
+}
+
+// CONNECT throughput: every connection streams chunks through the proxy until the deadline.
+// `mode` is mode_sink for upload and mode_generate for download.
+awaitable<void> throughput_worker(bench_result &result, uint8_t mode, clock_type::time_point deadline)
+{
+	tcp::socket socket(co_await asio::this_coro::executor);
+	if (!co_await socks5_handshake(socket, socks_cmd_connect, options.target))
+	{
+		result.errors++;
+		co_return;
+	}
+
+	asio::error_code ec;
+	std::vector<uint8_t> buffer(options.chunk_size);
+	co_await asio::async_write(socket, asio::buffer(&mode, 1), asio::redirect_error(asio::use_awaitable, ec));
+	while (!ec && clock_type::now() < deadline)
+	{
+		size_t n = 0;
+		if (mode == mode_sink)
+			n = co_await asio::async_write(socket, asio::buffer(buffer), asio::redirect_error(asio::use_awaitable, ec));
+		else
+			n = co_await socket.async_read_some(asio::buffer(buffer), asio::redirect_error(asio::use_awaitable, ec));
+		result.bytes += n;
+	}
+	if (ec && clock_type::now() < deadline)
+		result.errors++;
+}
+
+// Handshake rate and time to first byte: each iteration opens a new proxied connection,
+// sends one byte to the echo server and waits for it to come back.
+awaitable<void> connection_worker(bench_result &result, clock_type::time_point deadline)
+{
+	asio::any_io_executor executor = co_await asio::this_coro::executor;
+	std::vector<uint32_t> latencies;
+	while (clock_type::now() < deadline)
+	{
+		auto start = clock_type::now();
+		tcp::socket socket(executor);
+		if (!co_await socks5_handshake(socket, socks_cmd_connect, options.target))
+		{
+			result.errors++;
+			continue;
+		}
+
+		asio::error_code ec;
+		std::array<uint8_t, 2> request = { mode_echo, 'x' };
+		uint8_t response = 0;
+		co_await asio::async_write(socket, asio::buffer(request), asio::redirect_error(asio::use_awaitable, ec));
+		if (!ec)
+			co_await asio::async_read(socket, asio::buffer(&response, 1), asio::redirect_error(asio::use_awaitable, ec));
+		if (ec)
+		{
+			result.errors++;
+			continue;
+		}
+
+		auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - start);
+		latencies.push_back((uint32_t)std::min<int64_t>(elapsed.count(), UINT32_MAX));
+		result.operations++;
+	}
+
+	std::scoped_lock lock(result.latency_mutex);
+	result.latencies_us.insert(result.latencies_us.end(), latencies.begin(), latencies.end());
+}
+
+// UDP packets per second: one association per worker keeps up to udp_window
+// datagrams in flight to the UDP echo server and counts the echoes.
+awaitable<void> udp_worker(bench_result &result, clock_type::time_point deadline)
+{
+	asio::any_io_executor executor = co_await asio::this_coro::executor;
+	tcp::socket control(executor);
+	udp::endpoint relay;
+	tcp::endpoint unspecified(options.proxy.address().is_v6() ? tcp::v6() : tcp::v4(), 0);
+	if (!co_await socks5_handshake(control, socks_cmd_udp_associate, unspecified, &relay))
+	{
+		result.errors++;
+		co_return;
+	}
+
+	udp::socket socket(executor, udp::endpoint(relay.protocol(), 0));
+	std::vector<uint8_t> datagram(socks_header_ipv6_size + options.datagram_size);
+	size_t header_size = 0;
+	asio::ip::address address = options.target.address();
+	if (address.is_v4())
+	{
+		datagram[3] = socks_atyp_ipv4;
+		asio::ip::address_v4::bytes_type bytes = address.to_v4().to_bytes();
+		std::copy(bytes.begin(), bytes.end(), datagram.begin() + 4);
+		header_size = socks_header_ipv4_size;
+	}
+	else
+	{
+		datagram[3] = socks_atyp_ipv6;
+		asio::ip::address_v6::bytes_type bytes = address.to_v6().to_bytes();
+		std::copy(bytes.begin(), bytes.end(), datagram.begin() + 4);
+		header_size = socks_header_ipv6_size;
+	}
+	datagram[header_size - 2] = (uint8_t)(options.target.port() >> 8);
+	datagram[header_size - 1] = (uint8_t)(options.target.port() & 0xFF);
+	datagram.resize(header_size + options.datagram_size);
+
+	// Datagrams may be lost, so the window is refilled on a short timer as well as on every echo.
+	size_t in_flight = 0;
+	asio::steady_timer refill(executor);
+	bool receiving = true;
+	co_spawn(executor, [&]() -> awaitable<void>
+		{
+			std::vector<uint8_t> buffer(65536);
+			while (clock_type::now() < deadline)
+			{
+				asio::error_code ec;
+				co_await socket.async_receive(asio::buffer(buffer), asio::redirect_error(asio::use_awaitable, ec));
+				if (ec)
+					break;
+				result.operations++;
+				if (in_flight > 0)
+					in_flight--;
+				refill.cancel();
+			}
+			receiving = false;
+			refill.cancel();
+		}, detached);
+
+	while (clock_type::now() < deadline)
+	{
+		while (in_flight < options.udp_window)
+		{
+			asio::error_code ec;
+			co_await socket.async_send_to(asio::buffer(datagram), relay, asio::redirect_error(asio::use_awaitable, ec));
+			if (ec)
+			{
+				result.errors++;
+				break;
+			}
+			in_flight++;
+		}
+		refill.expires_after(std::chrono::milliseconds(10));
+		asio::error_code ec;
+		co_await refill.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+		if (ec != asio::error::operation_aborted)
+			in_flight = 0;
+	}
+
+	// The receiver refers to this frame, so it must finish first.
+	asio::error_code ec;
+	socket.close(ec);
+	while (receiving)
+	{
+		refill.expires_at(asio::steady_timer::time_point::max());
+		co_await refill.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+	}
+}
+
+template<typename Worker>
+double run_scenario(bench_result &result, Worker worker)
+{
+	asio::io_context io_context((int)options.threads);
+	auto start = clock_type::now();
+	auto deadline = start + options.duration;
+
+	// Each worker runs on its own strand; the scenario ends when the last one
+	// returns, or a little after the deadline if the proxy stops responding.
+	std::atomic<size_t> running = options.connections;
+	for (size_t i = 0; i < options.connections; i++)
+	{
+		co_spawn(asio::make_strand(io_context), worker(result, deadline), [&](std::exception_ptr)
+			{
+				if (--running == 0)
+					io_context.stop();
+			});
+	}
+
+	asio::steady_timer watchdog(io_context, deadline + std::chrono::seconds(5));
+	watchdog.async_wait([&](const asio::error_code &) { io_context.stop(); });
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < options.threads; i++)
+		threads.emplace_back([&io_context] { io_context.run(); });
+	io_context.run();
+	for (auto &thread : threads)
+		thread.join();
+
+	return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+uint32_t percentile(const std::vector<uint32_t> &sorted, double fraction)
+{
+	if (sorted.empty())
+		return 0;
+	size_t index = std::min(sorted.size() - 1, (size_t)(fraction * (double)sorted.size()));
+	return sorted[index];
+}
+
+// One JSON object per line, so results can be appended to a file and compared between releases.
+void print_result(const char *benchmark, double seconds, const std::string &fields)
+{
+	std::printf("{\"benchmark\":\"%s\",\"label\":\"%s\",\"connections\":%zu,\"threads\":%zu,\"seconds\":%.3f,%s}\n",
+		benchmark, options.label.c_str(), options.connections, options.threads, seconds, fields.c_str());
+	std::fflush(stdout);
+}
+
+void run_throughput(const char *benchmark, uint8_t mode)
+{
+	bench_result result;
+	double seconds = run_scenario(result, [mode](bench_result &result, clock_type::time_point deadline)
+		{ return throughput_worker(result, mode, deadline); });
+	char fields[256];
+	std::snprintf(fields, sizeof(fields), "\"bytes\":%llu,\"mbit_per_second\":%.1f,\"errors\":%llu",
+		(unsigned long long)result.bytes.load(), result.bytes.load() * 8 / seconds / 1e6, (unsigned long long)result.errors.load());
+	print_result(benchmark, seconds, fields);
+}
+
+void run_connections()
+{
+	bench_result result;
+	double seconds = run_scenario(result, connection_worker);
+	std::vector<uint32_t> &latencies = result.latencies_us;
+	std::sort(latencies.begin(), latencies.end());
+	char fields[384];
+	std::snprintf(fields, sizeof(fields), "\"handshakes\":%llu,\"handshakes_per_second\":%.1f,\"ttfb_p50_us\":%u,\"ttfb_p99_us\":%u,\"ttfb_p999_us\":%u,\"errors\":%llu",
+		(unsigned long long)result.operations.load(), result.operations.load() / seconds,
+		percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999), (unsigned long long)result.errors.load());
+	print_result("connect_handshake", seconds, fields);
+}
+
+void run_udp()
+{
+	bench_result result;
+	double seconds = run_scenario(result, udp_worker);
+	char fields[256];
+	std::snprintf(fields, sizeof(fields), "\"datagram_size\":%zu,\"echoes\":%llu,\"packets_per_second\":%.1f,\"errors\":%llu",
+		options.datagram_size, (unsigned long long)result.operations.load(), result.operations.load() / seconds, (unsigned long long)result.errors.load());
+	print_result("udp_echo", seconds, fields);
+}
+
+tcp::endpoint parse_endpoint(std::string_view text)
+{
+	size_t colon = text.rfind(':');
+	if (colon == std::string_view::npos)
+		throw std::invalid_argument("missing port in " + std::string(text));
+	std::string host(text.substr(0, colon));
+	if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+		host = host.substr(1, host.size() - 2);
+	return tcp::endpoint(asio::ip::make_address(host), (uint16_t)std::stoi(std::string(text.substr(colon + 1))));
+}
+
+// socks5bench [--proxy ADDRESS:PORT] [--target ADDRESS:PORT] [--username NAME --password PASSWORD]
+//             [--scenario all|upload|download|connect|udp] [--connections N] [--threads N] [--duration SECONDS]
+//             [--chunk-size BYTES] [--datagram-size BYTES] [--udp-window N] [--label TEXT]
+bool parse_arguments(int argc, char *argv[])
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view arg = argv[i];
+		if (i + 1 >= argc)
+		{
+			std::printf("Missing value of %s\n", argv[i]);
+			return false;
+		}
+		std::string value = argv[++i];
+		if (arg == "--proxy")
+			options.proxy = parse_endpoint(value);
+		else if (arg == "--target")
+			options.target = parse_endpoint(value);
+		else if (arg == "--username")
+			options.username = value;
+		else if (arg == "--password")
+			options.password = value;
+		else if (arg == "--scenario")
+			options.scenario = value;
+		else if (arg == "--label")
+			options.label = value;
+		else if (arg == "--connections")
+			options.connections = std::max(std::stoi(value), 1);
+		else if (arg == "--threads")
+			options.threads = std::max(std::stoi(value), 1);
+		else if (arg == "--duration")
+			options.duration = std::chrono::seconds(std::max(std::stoi(value), 1));
+		else if (arg == "--chunk-size")
+			options.chunk_size = std::max(std::stoi(value), 1);
+		else if (arg == "--datagram-size")
+			options.datagram_size = std::clamp(std::stoi(value), 1, 65000);
+		else if (arg == "--udp-window")
+			options.udp_window = std::max(std::stoi(value), 1);
+		else
+		{
+			std::printf("Unknown option: %s\n", arg.data());
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		if (!parse_arguments(argc, argv))
+			return 1;
+
+		std::string_view scenario = options.scenario;
+		bool all = scenario == "all";
+		if (all || scenario == "upload")
+			run_throughput("connect_upload", mode_sink);
+		if (all || scenario == "download")
+			run_throughput("connect_download", mode_generate);
+		if (all || scenario == "connect")
+			run_connections();
+		if (all || scenario == "udp")
+			run_udp();
+	}
+	catch (std::exception &e)
+	{
+		std::printf("Exception: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
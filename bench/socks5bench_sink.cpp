@@ -0,0 +1,119 @@
+﻿#include <cstdio>
+#include <array>
+#include <string_view>
+#include <vector>
+#include <asio.hpp>
+
+using asio::ip::tcp;
+using asio::ip::udp;
+using asio::awaitable;
+using asio::co_spawn;
+using asio::detached;
+
+// Target server of the benchmark suite.
+// The first byte of a TCP connection selects what the server does with it:
+//   'e' echoes everything back, 's' discards everything, 'g' sends zeros until the peer closes.
+// Every UDP datagram is echoed back to its sender.
+constexpr uint8_t mode_echo = 'e';
+constexpr uint8_t mode_sink = 's';
+constexpr uint8_t mode_generate = 'g';
+constexpr size_t buffer_size = 64 * 1024;
+
+awaitable<void> serve_tcp(tcp::socket socket)
+{
+	std::vector<uint8_t> buffer(buffer_size);
+	asio::error_code ec;
+	uint8_t mode = 0;
+	co_await asio::async_read(socket, asio::buffer(&mode, 1), asio::redirect_error(asio::use_awaitable, ec));
+	if (ec)
+		co_return;
+
+	switch (mode)
+	{
+	case mode_echo:
+		while (true)
+		{
+			size_t n = co_await socket.async_read_some(asio::buffer(buffer), asio::redirect_error(asio::use_awaitable, ec));
+			if (ec)
+				break;
+			co_await asio::async_write(socket, asio::buffer(buffer.data(), n), asio::redirect_error(asio::use_awaitable, ec));
+			if (ec)
+				break;
+		}
+		break;
+	case mode_sink:
+		while (!ec)
+			co_await socket.async_read_some(asio::buffer(buffer), asio::redirect_error(asio::use_awaitable, ec));
+		break;
+	case mode_generate:
+		while (!ec)
+			co_await asio::async_write(socket, asio::buffer(buffer), asio::redirect_error(asio::use_awaitable, ec));
+		break;
+	default:
+		break;
+	}
+}
+
+awaitable<void> tcp_listener(uint16_t port)
+{
+	asio::any_io_executor executor = co_await asio::this_coro::executor;
+	tcp::acceptor acceptor(executor);
+	acceptor.open(tcp::v6());
+	acceptor.set_option(tcp::acceptor::reuse_address(true));
+	acceptor.set_option(asio::ip::v6_only(false));
+	acceptor.bind({ tcp::v6(), port });
+	acceptor.listen();
+	while (true)
+	{
+		tcp::socket socket = co_await acceptor.async_accept(asio::use_awaitable);
+		socket.set_option(tcp::no_delay(true));
+		co_spawn(executor, serve_tcp(std::move(socket)), detached);
+	}
+}
+
+awaitable<void> udp_echo(uint16_t port)
+{
+	asio::any_io_executor executor = co_await asio::this_coro::executor;
+	udp::socket socket(executor);
+	socket.open(udp::v6());
+	socket.set_option(asio::ip::v6_only(false));
+	socket.bind({ udp::v6(), port });
+
+	std::array<uint8_t, 65536> buffer;
+	udp::endpoint sender;
+	while (true)
+	{
+		asio::error_code ec;
+		size_t n = co_await socket.async_receive_from(asio::buffer(buffer), sender, asio::redirect_error(asio::use_awaitable, ec));
+		if (ec)
+			continue;
+		co_await socket.async_send_to(asio::buffer(buffer.data(), n), sender, asio::redirect_error(asio::use_awaitable, ec));
+	}
+}
+
+// socks5bench_sink [port]    TCP and UDP on the same port, 19100 by default
+int main(int argc, char *argv[])
+{
+	try
+	{
+		uint16_t port = 19100;
+		if (argc > 1)
+			port = (uint16_t)std::stoi(argv[1]);
+
+		asio::io_context io_context(1);
+		co_spawn(io_context, tcp_listener(port), detached);
+		co_spawn(io_context, udp_echo(port), detached);
+
+		asio::signal_set signals(io_context, SIGINT, SIGTERM);
+		signals.async_wait([&](auto, auto) { io_context.stop(); });
+
+		std::printf("socks5bench_sink listening on TCP and UDP port %u\n", port);
+		io_context.run();
+	}
+	catch (std::exception &e)
+	{
+		std::printf("Exception: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,88 @@
+﻿#include <cstdio>
+#include <cstring>
+#include <array>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <asio.hpp>
+#include "socks5_codec.hpp"
+
+using clock_type = std::chrono::steady_clock;
+
+// Microbenchmark of the SOCKS5 codec: ns per UDP header parsed and built, for each ATYP.
+// socks5codec_bench [iterations]
+
+size_t iterations = 10'000'000;
+volatile uint64_t sink = 0;
+
+std::vector<uint8_t> make_datagram(const asio::ip::address &address, uint16_t port, size_t payload_size)
+{
+	std::vector<uint8_t> datagram(socks_header_ipv6_size + payload_size);
+	size_t header_size = encode_udp_header(address, port, datagram);
+	datagram.resize(header_size + payload_size);
+	return datagram;
+}
+
+std::vector<uint8_t> make_domain_datagram(const std::string &hostname, uint16_t port, size_t payload_size)
+{
+	std::vector<uint8_t> datagram(5 + hostname.size() + 2 + payload_size);
+	datagram[3] = socks_atyp_domain;
+	datagram[4] = (uint8_t)hostname.size();
+	std::memcpy(datagram.data() + 5, hostname.data(), hostname.size());
+	write_port(datagram.data() + 5 + hostname.size(), port);
+	return datagram;
+}
+
+void report(const char *operation, const char *address_type, clock_type::duration elapsed)
+{
+	double ns = std::chrono::duration<double, std::nano>(elapsed).count() / (double)iterations;
+	std::printf("{\"benchmark\":\"codec_%s\",\"address_type\":\"%s\",\"iterations\":%zu,\"ns_per_packet\":%.2f}\n",
+		operation, address_type, iterations, ns);
+}
+
+void bench_parse(const char *address_type, const std::vector<uint8_t> &datagram)
+{
+	uint64_t checksum = 0;
+	auto start = clock_type::now();
+	for (size_t i = 0; i < iterations; i++)
+	{
+		socks5_udp_header header;
+		if (decode_udp_header(datagram, header) == socks5_decode_status::complete)
+			checksum += header.header_size + header.destination.port + header.destination.address[i & 3] + header.destination.hostname.size();
+	}
+	auto elapsed = clock_type::now() - start;
+	sink = sink + checksum;
+	report("parse", address_type, elapsed);
+}
+
+void bench_build(const char *address_type, const asio::ip::address &address)
+{
+	std::array<uint8_t, 32> header = {};
+	uint64_t checksum = 0;
+	auto start = clock_type::now();
+	for (size_t i = 0; i < iterations; i++)
+	{
+		size_t header_size = encode_udp_header(address, (uint16_t)i, header);
+		checksum += header_size + header[header_size - 1];
+	}
+	auto elapsed = clock_type::now() - start;
+	sink = sink + checksum;
+	report("build", address_type, elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		iterations = std::max(std::stoull(argv[1]), 1ull);
+
+	asio::ip::address ipv4 = asio::ip::make_address("192.0.2.1");
+	asio::ip::address ipv6 = asio::ip::make_address("2001:db8::1");
+	bench_parse("ipv4", make_datagram(ipv4, 53, 512));
+	bench_parse("ipv6", make_datagram(ipv6, 53, 512));
+	bench_parse("domain", make_domain_datagram("www.example.com", 53, 512));
+
+	// The server only builds headers for datagrams from IP endpoints.
+	bench_build("ipv4", ipv4);
+	bench_build("ipv6", ipv6);
+	return 0;
+}
@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * LD_PRELOAD library that counts the system calls a process makes through the
+ * libc wrappers that asio and socks5demo use. At exit it appends one JSON line
+ * to the file named by SOCKS5BENCH_SYSCALLS, or to stderr.
+ * Written in C because the wrappers must match glibc's declarations exactly.
+ *
+ *   LD_PRELOAD=./bench/libsocks5bench_syscalls.so SOCKS5BENCH_SYSCALLS=copy.json ./socks5demo 1180
+ */
+
+#define SYSCALL_LIST(X) \
+	X(read) X(write) X(readv) X(writev) X(recv) X(recvfrom) X(recvmsg) X(recvmmsg) \
+	X(send) X(sendto) X(sendmsg) X(sendmmsg) X(splice) X(epoll_wait) X(epoll_pwait) X(epoll_ctl) \
+	X(timerfd_settime) X(ioctl) X(fcntl) X(accept) X(accept4) X(connect) X(io_uring_enter) X(other_syscall)
+
+#define SYSCALL_ENUM(name) counter_##name,
+enum { SYSCALL_LIST(SYSCALL_ENUM) counter_count };
+
+#define SYSCALL_NAME(name) #name,
+static const char *counter_names[] = { SYSCALL_LIST(SYSCALL_NAME) };
+
+static unsigned long counters[counter_count];
+
+static void count(int counter)
+{
+	__atomic_fetch_add(&counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+#define REAL(name) \
+	static __typeof__(&name) real_##name = NULL; \
+	if (real_##name == NULL) \
+		real_##name = (__typeof__(&name))dlsym(RTLD_NEXT, #name)
+
+ssize_t read(int fd, void *buffer, size_t size)
+{
+	REAL(read);
+	count(counter_read);
+	return real_read(fd, buffer, size);
+}
+
+ssize_t write(int fd, const void *buffer, size_t size)
+{
+	REAL(write);
+	count(counter_write);
+	return real_write(fd, buffer, size);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int count_of_iov)
+{
+	REAL(readv);
+	count(counter_readv);
+	return real_readv(fd, iov, count_of_iov);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int count_of_iov)
+{
+	REAL(writev);
+	count(counter_writev);
+	return real_writev(fd, iov, count_of_iov);
+}
+
+ssize_t recv(int fd, void *buffer, size_t size, int flags)
+{
+	REAL(recv);
+	count(counter_recv);
+	return real_recv(fd, buffer, size, flags);
+}
+
+ssize_t recvfrom(int fd, void *buffer, size_t size, int flags, struct sockaddr *address, socklen_t *address_size)
+{
+	REAL(recvfrom);
+	count(counter_recvfrom);
+	return real_recvfrom(fd, buffer, size, flags, address, address_size);
+}
+
+ssize_t recvmsg(int fd, struct msghdr *message, int flags)
+{
+	REAL(recvmsg);
+	count(counter_recvmsg);
+	return real_recvmsg(fd, message, flags);
+}
+
+int recvmmsg(int fd, struct mmsghdr *messages, unsigned int size, int flags, struct timespec *timeout)
+{
+	REAL(recvmmsg);
+	count(counter_recvmmsg);
+	return real_recvmmsg(fd, messages, size, flags, timeout);
+}
+
+ssize_t send(int fd, const void *buffer, size_t size, int flags)
+{
+	REAL(send);
+	count(counter_send);
+	return real_send(fd, buffer, size, flags);
+}
+
+ssize_t sendto(int fd, const void *buffer, size_t size, int flags, const struct sockaddr *address, socklen_t address_size)
+{
+	REAL(sendto);
+	count(counter_sendto);
+	return real_sendto(fd, buffer, size, flags, address, address_size);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *message, int flags)
+{
+	REAL(sendmsg);
+	count(counter_sendmsg);
+	return real_sendmsg(fd, message, flags);
+}
+
+int sendmmsg(int fd, struct mmsghdr *messages, unsigned int size, int flags)
+{
+	REAL(sendmmsg);
+	count(counter_sendmmsg);
+	return real_sendmmsg(fd, messages, size, flags);
+}
+
+ssize_t splice(int fd_in, loff_t *offset_in, int fd_out, loff_t *offset_out, size_t size, unsigned int flags)
+{
+	REAL(splice);
+	count(counter_splice);
+	return real_splice(fd_in, offset_in, fd_out, offset_out, size, flags);
+}
+
+int epoll_wait(int fd, struct epoll_event *events, int max_events, int timeout)
+{
+	REAL(epoll_wait);
+	count(counter_epoll_wait);
+	return real_epoll_wait(fd, events, max_events, timeout);
+}
+
+int epoll_pwait(int fd, struct epoll_event *events, int max_events, int timeout, const sigset_t *mask)
+{
+	REAL(epoll_pwait);
+	count(counter_epoll_pwait);
+	return real_epoll_pwait(fd, events, max_events, timeout, mask);
+}
+
+int epoll_ctl(int fd, int operation, int target, struct epoll_event *event)
+{
+	REAL(epoll_ctl);
+	count(counter_epoll_ctl);
+	return real_epoll_ctl(fd, operation, target, event);
+}
+
+int timerfd_settime(int fd, int flags, const struct itimerspec *value, struct itimerspec *old_value)
+{
+	REAL(timerfd_settime);
+	count(counter_timerfd_settime);
+	return real_timerfd_settime(fd, flags, value, old_value);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	REAL(ioctl);
+	va_list args;
+	va_start(args, request);
+	void *argument = va_arg(args, void *);
+	va_end(args);
+	count(counter_ioctl);
+	return real_ioctl(fd, request, argument);
+}
+
+int fcntl(int fd, int command, ...)
+{
+	REAL(fcntl);
+	va_list args;
+	va_start(args, command);
+	void *argument = va_arg(args, void *);
+	va_end(args);
+	count(counter_fcntl);
+	return real_fcntl(fd, command, argument);
+}
+
+int accept(int fd, struct sockaddr *address, socklen_t *address_size)
+{
+	REAL(accept);
+	count(counter_accept);
+	return real_accept(fd, address, address_size);
+}
+
+int accept4(int fd, struct sockaddr *address, socklen_t *address_size, int flags)
+{
+	REAL(accept4);
+	count(counter_accept4);
+	return real_accept4(fd, address, address_size, flags);
+}
+
+int connect(int fd, const struct sockaddr *address, socklen_t address_size)
+{
+	REAL(connect);
+	count(counter_connect);
+	return real_connect(fd, address, address_size);
+}
+
+long syscall(long number, ...)
+{
+	REAL(syscall);
+	va_list args;
+	va_start(args, number);
+	long a[6];
+	for (int i = 0; i < 6; i++)
+		a[i] = va_arg(args, long);
+	va_end(args);
+	count(number == __NR_io_uring_enter ? counter_io_uring_enter : counter_other_syscall);
+	return real_syscall(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+__attribute__((destructor))
+static void report(void)
+{
+	const char *path = getenv("SOCKS5BENCH_SYSCALLS");
+	FILE *output = path != NULL ? fopen(path, "a") : stderr;
+	if (output == NULL)
+		return;
+
+	unsigned long total = 0;
+	for (int i = 0; i < counter_count; i++)
+		total += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+
+	fprintf(output, "{\"benchmark\":\"syscalls\",\"total\":%lu,\"calls\":{", total);
+	for (int i = 0, first = 1; i < counter_count; i++)
+	{
+		unsigned long value = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+		if (value == 0)
+			continue;
+		fprintf(output, "%s\"%s\":%lu", first ? "" : ",", counter_names[i], value);
+		first = 0;
+	}
+	fprintf(output, "}}\n");
+	if (output != stderr)
+		fclose(output);
+}
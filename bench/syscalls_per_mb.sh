@@ -0,0 +1,52 @@
+#!/bin/sh
+# Counts the system calls socks5demo makes per relayed megabyte in each relay mode.
+#
+# syscalls_per_mb.sh BUILD_DIR [MODE ...]    modes: copy splice uring, all three by default
+#
+# The proxy runs under bench/libsocks5bench_syscalls.so while socks5bench
+# downloads through it. One JSON object per mode is printed, for example
+# {"benchmark":"syscalls_per_mb","relay":"uring","bytes":...,"syscalls":...,"syscalls_per_mb":...}
+# The raw counts per system call go to stderr.
+# DURATION, CONNECTIONS, PROXY_PORT and SINK_PORT adjust the run.
+
+set -e
+
+build_dir=${1:?usage: syscalls_per_mb.sh BUILD_DIR [MODE ...]}
+shift
+modes=${*:-copy splice uring}
+duration=${DURATION:-5}
+connections=${CONNECTIONS:-16}
+proxy_port=${PROXY_PORT:-1180}
+sink_port=${SINK_PORT:-19100}
+work_dir=$(mktemp -d)
+
+"$build_dir/bench/socks5bench_sink" "$sink_port" > /dev/null &
+sink_pid=$!
+trap 'kill $sink_pid 2> /dev/null; cat "$work_dir"/*.json >&2; rm -rf "$work_dir"' EXIT
+sleep 0.5
+
+for mode in $modes
+do
+	LD_PRELOAD="$build_dir/bench/libsocks5bench_syscalls.so" SOCKS5BENCH_SYSCALLS="$work_dir/$mode.json" \
+		"$build_dir/socks5demo" "$proxy_port" --relay "$mode" > "$work_dir/$mode.log" &
+	proxy_pid=$!
+	sleep 0.5
+	"$build_dir/bench/socks5bench" --proxy "127.0.0.1:$proxy_port" --target "127.0.0.1:$sink_port" \
+		--scenario download --connections "$connections" --duration "$duration" --label "$mode" > "$work_dir/$mode.bench"
+	kill -INT $proxy_pid
+	wait $proxy_pid || true
+
+	if ! grep -q '"syscalls"' "$work_dir/$mode.json" 2> /dev/null
+	then
+		echo "no system call counts for $mode:" >&2
+		cat "$work_dir/$mode.log" >&2
+		continue
+	fi
+
+	bytes=$(grep -o '"bytes":[0-9]*' "$work_dir/$mode.bench" | cut -d: -f2)
+	syscalls=$(grep -o '"total":[0-9]*' "$work_dir/$mode.json" | cut -d: -f2)
+	awk -v mode="$mode" -v bytes="$bytes" -v syscalls="$syscalls" 'BEGIN {
+		per_mb = bytes > 0 ? syscalls / (bytes / 1048576) : 0
+		printf "{\"benchmark\":\"syscalls_per_mb\",\"relay\":\"%s\",\"bytes\":%s,\"syscalls\":%s,\"syscalls_per_mb\":%.1f}\n", mode, bytes, syscalls, per_mb
+	}'
+done
@@ -0,0 +1,51 @@
+﻿#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+// Replays corpus files through the harness on compilers without libFuzzer:
+// socks5codec_fuzz FILE_OR_DIRECTORY...
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static void replay(const std::filesystem::path &path)
+{
+	std::ifstream file(path, std::ios::binary);
+	std::vector<char> content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	// Copied into a block of the exact size, so sanitizers see reads past the end.
+	std::unique_ptr<uint8_t[]> data(new uint8_t[content.size()]);
+	if (!content.empty())
+		std::memcpy(data.get(), content.data(), content.size());
+	LLVMFuzzerTestOneInput(data.get(), content.size());
+}
+
+int main(int argc, char *argv[])
+{
+	size_t count = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		std::filesystem::path path = argv[i];
+		if (std::filesystem::is_directory(path))
+		{
+			for (auto &entry : std::filesystem::directory_iterator(path))
+			{
+				if (entry.is_regular_file())
+				{
+					replay(entry.path());
+					count++;
+				}
+			}
+		}
+		else
+		{
+			replay(path);
+			count++;
+		}
+	}
+	std::printf("Replayed %zu inputs\n", count);
+	return 0;
+}
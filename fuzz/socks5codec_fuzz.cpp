@@ -0,0 +1,103 @@
+﻿#include <cstdlib>
+#include <cstring>
+#include <array>
+#include <span>
+#include <asio.hpp>
+#include "socks5_codec.hpp"
+#include "socks5_handshake.hpp"
+
+// libFuzzer entry point for the SOCKS5 codec and the handshake parser.
+// The input is in a heap block of exactly `size` bytes, so AddressSanitizer
+// reports any read past the end; the checks below catch results that point
+// outside the input without reading it.
+
+static void check(bool condition)
+{
+	if (!condition)
+		std::abort();
+}
+
+static bool inside(std::span<const uint8_t> input, std::string_view view)
+{
+	const uint8_t *first = (const uint8_t *)view.data();
+	return view.empty() || (first >= input.data() && first + view.size() <= input.data() + input.size());
+}
+
+static void fuzz_udp_header(std::span<const uint8_t> input)
+{
+	socks5_udp_header header;
+	if (decode_udp_header(input, header) != socks5_decode_status::complete)
+		return;
+
+	check(header.header_size <= input.size());
+	check(inside(input, header.destination.hostname));
+
+	// IP headers must encode back to the same bytes.
+	if (std::optional<asio::ip::address> address = to_ip_address(header.destination); address.has_value())
+	{
+		std::array<uint8_t, 32> encoded = {};
+		size_t encoded_size = encode_udp_header(*address, header.destination.port, encoded);
+		check(encoded_size == header.header_size);
+		check(std::memcmp(encoded.data() + socks5_udp_fixed_size, input.data() + socks5_udp_fixed_size, encoded_size - socks5_udp_fixed_size) == 0);
+	}
+}
+
+static void fuzz_address(std::span<const uint8_t> input)
+{
+	socks5_address address;
+	size_t consumed = 0;
+	if (decode_address(input, address, consumed) == socks5_decode_status::complete)
+	{
+		check(consumed <= input.size());
+		check(inside(input, address.hostname));
+	}
+}
+
+// Feeds the input in chunks whose sizes come from the input itself, so the
+// fuzzer also explores messages split across reads.
+static void fuzz_handshake(std::span<const uint8_t> input)
+{
+	socks5_handshake handshake;
+	bool method_selected = false;
+	size_t offset = 0;
+	while (true)
+	{
+		socks5_handshake::status status = handshake.parse();
+		if (status == socks5_handshake::status::malformed)
+			return;
+
+		if (status == socks5_handshake::status::complete)
+		{
+			if (handshake.current_stage() == socks5_handshake::stage::finished)
+				return;
+			if (!method_selected)
+			{
+				if (handshake.methods().empty())
+					return;
+				method_selected = true;
+				bool use_password = std::memchr(handshake.methods().data(), socks_method_user_pwd, handshake.methods().size()) != nullptr;
+				handshake.select_method(use_password ? socks_method_user_pwd : socks_method_no_auth);
+			}
+			continue;
+		}
+
+		if (offset >= input.size())
+			return;
+		std::span<uint8_t> free_space = handshake.prepare();
+		if (free_space.empty())
+			return;
+		size_t chunk = std::min<size_t>({ (size_t)(input[offset] % 16) + 1, input.size() - offset, free_space.size() });
+		std::memcpy(free_space.data(), input.data() + offset, chunk);
+		handshake.commit(chunk);
+		offset += chunk;
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	std::span<const uint8_t> input(data, size);
+	fuzz_udp_header(input);
+	fuzz_address(input);
+	fuzz_handshake(input);
+	return 0;
+}
@@ -0,0 +1,223 @@
+﻿#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include "socks5_defines.hpp"
+#include "access_log.hpp"
+
+access_logger access_log;
+
+namespace
+{
+	constexpr auto write_interval = std::chrono::milliseconds(100);
+
+	const char* command_name(uint8_t command)
+	{
+		switch (command)
+		{
+		case socks_cmd_connect:
+			return "connect";
+		case socks_cmd_bind:
+			return "bind";
+		case socks_cmd_udp_associate:
+			return "udp_associate";
+		default:
+			return "-";
+		}
+	}
+
+	void append_endpoint(std::string &output, asio::ip::address address, uint16_t port)
+	{
+		if (address.is_v6() && address.to_v6().is_v4_mapped())
+			address = asio::ip::make_address_v4(asio::ip::v4_mapped, address.to_v6());
+
+		std::array<char, 64> text;
+		if (address.is_v6())
+			std::snprintf(text.data(), text.size(), "[%s]:%u", address.to_string().c_str(), port);
+		else
+			std::snprintf(text.data(), text.size(), "%s:%u", address.to_string().c_str(), port);
+		output += text.data();
+	}
+
+	// Names come from the client, so anything that would break up the line is escaped.
+	void append_name(std::string &output, const char *name, size_t size)
+	{
+		for (size_t i = 0; i < size; i++)
+		{
+			uint8_t c = (uint8_t)name[i];
+			if (c > ' ' && c < 0x7f && c != '\\')
+			{
+				output += (char)c;
+				continue;
+			}
+			std::array<char, 8> escaped;
+			std::snprintf(escaped.data(), escaped.size(), "\\x%02x", c);
+			output += escaped.data();
+		}
+	}
+
+	void append_record(std::string &output, const access_record &record)
+	{
+		std::time_t seconds = std::chrono::system_clock::to_time_t(record.start);
+		auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(record.start.time_since_epoch()).count() % 1000;
+		std::tm utc = {};
+#ifdef _WIN32
+		gmtime_s(&utc, &seconds);
+#else
+		gmtime_r(&seconds, &utc);
+#endif
+		std::array<char, 64> text;
+		size_t size = std::strftime(text.data(), text.size(), "%Y-%m-%dT%H:%M:%S", &utc);
+		std::snprintf(text.data() + size, text.size() - size, ".%03dZ ", (int)milliseconds);
+		output += text.data();
+
+		append_endpoint(output, record.client.address(), record.client.port());
+		output += ' ';
+		if (record.user_size > 0)
+			append_name(output, record.user.data(), record.user_size);
+		else
+			output += '-';
+		output += ' ';
+		output += command_name(record.command);
+		output += ' ';
+		if (record.hostname_size > 0)
+		{
+			append_name(output, record.hostname.data(), record.hostname_size);
+			output += ':';
+			output += std::to_string(record.target_port);
+		}
+		else if (record.command != 0)
+			append_endpoint(output, record.target_address, record.target_port);
+		else
+			output += '-';
+
+		double duration = std::chrono::duration<double>(record.duration).count();
+		if (record.reply >= 0)
+			std::snprintf(text.data(), text.size(), " %d", record.reply);
+		else
+			std::snprintf(text.data(), text.size(), " -");
+		output += text.data();
+		std::snprintf(text.data(), text.size(), " %llu %llu %.3f\n",
+			(unsigned long long)record.bytes[(size_t)metric_direction::upload],
+			(unsigned long long)record.bytes[(size_t)metric_direction::download], duration);
+		output += text.data();
+	}
+}
+
+access_ring::access_ring(size_t capacity) : slots(std::bit_ceil(std::max<size_t>(capacity, 2))), mask(slots.size() - 1)
+{
+}
+
+bool access_ring::try_push(const access_record &record)
+{
+	size_t head = pushed.load(std::memory_order_relaxed);
+	if (head - popped.load(std::memory_order_acquire) == slots.size())
+		return false;
+	slots[head & mask] = record;
+	pushed.store(head + 1, std::memory_order_release);
+	return true;
+}
+
+bool access_logger::open(const std::string &path, size_t ring_capacity, std::string &error)
+{
+	file = std::fopen(path.c_str(), "a");
+	if (file == nullptr)
+	{
+		error = "cannot open " + path + ": " + std::strerror(errno);
+		return false;
+	}
+	this->path = path;
+	this->ring_capacity = ring_capacity;
+	running = true;
+	writer = std::thread([this] { write_loop(); });
+	return true;
+}
+
+void access_logger::submit(const access_record &record)
+{
+	if (!local_ring().try_push(record))
+		metric_add<uint64_t>(local_metrics().access_log_dropped);
+}
+
+void access_logger::stop()
+{
+	if (!running.exchange(false))
+		return;
+	writer.join();
+	if (file != nullptr)
+		std::fclose(file);
+	file = nullptr;
+}
+
+access_ring& access_logger::local_ring()
+{
+	thread_local access_ring &ring = rings.add(ring_capacity);
+	return ring;
+}
+
+void access_logger::write_loop()
+{
+	std::string batch;
+	while (running.load(std::memory_order_relaxed))
+	{
+		if (reopen_requested.exchange(false, std::memory_order_relaxed))
+		{
+			if (file != nullptr)
+				std::fclose(file);
+			file = std::fopen(path.c_str(), "a");
+			if (file == nullptr)
+				std::printf("Access log %s not reopened: %s\n", path.c_str(), std::strerror(errno));
+		}
+
+		// A pass that had plenty to do is followed by the next one at once.
+		if (write_pending(batch) < ring_capacity / 2)
+			std::this_thread::sleep_for(write_interval);
+	}
+
+	// stop() is called once the shards are destroyed, and with them the last sessions
+	// that could leave a record. One more pass empties the rings.
+	write_pending(batch);
+}
+
+size_t access_logger::write_pending(std::string &batch)
+{
+	batch.clear();
+	size_t most = 0;
+	for (access_ring *ring : rings.snapshot())
+		most = std::max(most, ring->drain([&batch](const access_record &record) { append_record(batch, record); }));
+
+	if (!batch.empty() && file != nullptr)
+	{
+		std::fwrite(batch.data(), 1, batch.size(), file);
+		std::fflush(file);
+	}
+	return most;
+}
+
+access_log_entry::~access_log_entry()
+{
+	if (record == nullptr || !access_log.enabled())
+		return;
+	record->duration = std::chrono::steady_clock::now().time_since_epoch() - record->duration;
+	access_log.submit(*record);
+}
+
+void access_log_entry::set_user(std::string_view user)
+{
+	if (record == nullptr)
+		return;
+	record->user_size = (uint8_t)std::min(user.size(), record->user.size());
+	std::copy_n(user.begin(), record->user_size, record->user.begin());
+}
+
+void access_log_entry::set_request(uint8_t command, std::string_view hostname, const asio::ip::address &address, uint16_t port)
+{
+	if (record == nullptr)
+		return;
+	record->command = command;
+	record->target_address = address;
+	record->target_port = port;
+	record->hostname_size = (uint8_t)std::min(hostname.size(), record->hostname.size());
+	std::copy_n(hostname.begin(), record->hostname_size, record->hostname.begin());
+}
@@ -0,0 +1,138 @@
+﻿#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <asio.hpp>
+#include "metrics.hpp"
+
+// One line per connection, written by --access-log FILE:
+//
+//   TIME CLIENT USER COMMAND TARGET REPLY UPLOADED DOWNLOADED DURATION
+//   2024-05-01T08:30:00.125Z 192.0.2.7:50412 alice connect example.com:443 0 1520 48213 2.031
+//
+// USER, COMMAND, TARGET and REPLY are "-" when the handshake ended before them.
+// USER is the username the client gave, whether or not it was accepted. REPLY is
+// the SOCKS5 reply code, the byte counts are relayed payload and DURATION is in
+// seconds, from accept to close. Bytes of names outside printable ASCII, space
+// and '\' are written as \xHH.
+struct access_record
+{
+	static constexpr size_t max_name_size = 255;
+
+	std::chrono::system_clock::time_point start;
+	std::chrono::steady_clock::duration duration{};
+	asio::ip::tcp::endpoint client;
+	asio::ip::address target_address;
+	uint16_t target_port = 0;
+	uint8_t command = 0;
+	int16_t reply = -1;
+	uint8_t user_size = 0;
+	uint8_t hostname_size = 0;
+	std::array<uint64_t, (size_t)metric_direction::count> bytes{};
+	std::array<char, max_name_size> user;
+	std::array<char, max_name_size> hostname;
+};
+
+// Single-producer single-consumer ring of records. The producer is one io_context
+// thread, the consumer the writer thread. A full ring drops the record.
+class access_ring
+{
+public:
+	explicit access_ring(size_t capacity);
+	bool try_push(const access_record &record);
+
+	// Calls `consume` for each record that was pushed before, oldest first.
+	template<typename Consume>
+	size_t drain(Consume &&consume)
+	{
+		size_t head = pushed.load(std::memory_order_acquire);
+		size_t tail = popped.load(std::memory_order_relaxed);
+		for (size_t i = tail; i != head; i++)
+			consume(slots[i & mask]);
+		popped.store(head, std::memory_order_release);
+		return head - tail;
+	}
+
+private:
+	std::vector<access_record> slots;
+	size_t mask;
+	alignas(64) std::atomic<size_t> pushed{};
+	alignas(64) std::atomic<size_t> popped{};
+};
+
+// Writes the records of all threads. The io_context threads never wait for it:
+// a record is copied into the ring of the calling thread, and the writer thread
+// formats whatever the rings hold and writes it with one fwrite() per pass.
+class access_logger
+{
+public:
+	bool open(const std::string &path, size_t ring_capacity, std::string &error);
+	bool enabled() const { return running.load(std::memory_order_relaxed); }
+
+	// Counted in socks5demo_access_log_dropped_total if the ring of the calling thread is full.
+	void submit(const access_record &record);
+
+	// The file is reopened by the writer thread, after rotation for instance.
+	void reopen() { reopen_requested.store(true, std::memory_order_relaxed); }
+
+	// Writes out what is left and stops the writer thread.
+	void stop();
+
+private:
+	access_ring& local_ring();
+	void write_loop();
+	size_t write_pending(std::string &batch);
+
+	std::string path;
+	size_t ring_capacity = 0;
+	std::FILE *file = nullptr;
+	std::thread writer;
+	std::atomic<bool> running{ false };
+	std::atomic<bool> reopen_requested{ false };
+	thread_registry<access_ring> rings;
+};
+
+extern access_logger access_log;
+
+// Collects the record of one connection while it is handled, and submits it when
+// it goes away. It moves along from the handshake to the session that relays.
+// Does nothing while the access log is disabled.
+class access_log_entry
+{
+public:
+	access_log_entry() = default;
+
+	template<typename Socket>
+	explicit access_log_entry(const Socket &client_socket)
+	{
+		if (!access_log.enabled())
+			return;
+		asio::error_code ec;
+		record = std::make_unique<access_record>();
+		record->start = std::chrono::system_clock::now();
+		record->duration = std::chrono::steady_clock::now().time_since_epoch();
+		record->client = client_socket.remote_endpoint(ec);
+	}
+
+	access_log_entry(access_log_entry &&other) noexcept = default;
+	access_log_entry& operator=(access_log_entry &&other) noexcept = default;
+	~access_log_entry();
+
+	void set_user(std::string_view user);
+	void set_request(uint8_t command, std::string_view hostname, const asio::ip::address &address, uint16_t port);
+	void set_reply(uint8_t reply_code) { if (record) record->reply = reply_code; }
+	void add_bytes(metric_direction direction, size_t bytes) { if (record) record->bytes[(size_t)direction] += bytes; }
+
+private:
+	// Only allocated while the access log is enabled. Until submitted,
+	// duration holds the steady clock reading of the start.
+	std::unique_ptr<access_record> record;
+};
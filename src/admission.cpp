@@ -0,0 +1,78 @@
+﻿#include <algorithm>
+#include "admission.hpp"
+
+admission_control admission;
+
+bool admission_control::accepting() const
+{
+	if (config.max_handshakes != 0 && handshakes.load(std::memory_order_relaxed) >= config.max_handshakes)
+		return false;
+	if (config.max_sessions != 0 && sessions.load(std::memory_order_relaxed) >= config.max_sessions)
+		return false;
+	return !relay_memory_exceeded();
+}
+
+bool admission_control::relay_memory_exceeded() const
+{
+	return config.relay_memory_budget != 0 && relay_memory.load(std::memory_order_relaxed) > config.relay_memory_budget;
+}
+
+bool admission_control::allow_source(const asio::ip::address &address)
+{
+	if (config.per_ip_rate == 0)
+		return true;
+
+	address_key key = address.is_v4() ?
+		asio::ip::make_address_v6(asio::ip::v4_mapped, address.to_v4()).to_bytes() :
+		address.to_v6().to_bytes();
+	size_t hash = address_hash{}(key);
+	rate_stripe &stripe = rate_stripes[hash % rate_stripe_count];
+
+	auto now = std::chrono::steady_clock::now();
+	double burst = (double)config.per_ip_rate;
+	std::scoped_lock lock(stripe.mutex);
+
+	// The burst equals the rate, so a bucket untouched for a second is full again
+	// and carries no state.
+	if (stripe.buckets.size() >= rate_stripe_max_entries)
+		std::erase_if(stripe.buckets, [now](const auto &item) { return now - item.second.last_refill >= std::chrono::seconds(1); });
+
+	auto [iter, inserted] = stripe.buckets.try_emplace(key, rate_bucket{ burst, now });
+	rate_bucket &bucket = iter->second;
+	if (!inserted)
+	{
+		double elapsed = std::chrono::duration<double>(now - bucket.last_refill).count();
+		bucket.tokens = std::min(burst, bucket.tokens + elapsed * config.per_ip_rate);
+		bucket.last_refill = now;
+	}
+
+	if (bucket.tokens < 1.0)
+		return false;
+	bucket.tokens -= 1.0;
+	return true;
+}
+
+void admission_control::relay_reservation::reserve(size_t bytes)
+{
+	owner.relay_memory.fetch_add(bytes, std::memory_order_relaxed);
+	reserved += bytes;
+}
+
+bool admission_control::relay_reservation::try_reserve(size_t bytes)
+{
+	size_t budget = owner.config.relay_memory_budget;
+	size_t used = owner.relay_memory.load(std::memory_order_relaxed);
+	do
+	{
+		if (budget != 0 && used + bytes > budget)
+			return false;
+	} while (!owner.relay_memory.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+	reserved += bytes;
+	return true;
+}
+
+void admission_control::relay_reservation::release(size_t bytes)
+{
+	owner.relay_memory.fetch_sub(bytes, std::memory_order_relaxed);
+	reserved -= bytes;
+}
@@ -0,0 +1,105 @@
+﻿#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <asio.hpp>
+
+// Process-wide admission control, shared by all shards. A limit of 0 disables it.
+//
+// - Listeners stop accepting while the handshake or session cap is reached, or
+//   while relay buffers use more than the memory budget. Pending connections
+//   then wait in the kernel backlog instead of consuming fds and memory here.
+// - Each source address may open `per_ip_rate` connections per second, with a
+//   burst of the same size. Connections above the rate are closed at once.
+// - Relay buffers grow only while the memory budget allows it, and shrink back
+//   to their initial size while it is exceeded.
+class admission_control
+{
+public:
+	struct limits
+	{
+		size_t max_handshakes = 0;
+		size_t max_sessions = 0;
+		size_t per_ip_rate = 0;
+		size_t relay_memory_budget = 0;
+	};
+
+	// Counts one handshake or session for as long as it lives.
+	class ticket
+	{
+	public:
+		explicit ticket(std::atomic<size_t> &counter) : counter(&counter) { counter.fetch_add(1, std::memory_order_relaxed); }
+		~ticket() { counter->fetch_sub(1, std::memory_order_relaxed); }
+		ticket(const ticket &) = delete;
+		ticket& operator=(const ticket &) = delete;
+
+	private:
+		std::atomic<size_t> *counter;
+	};
+
+	// Relay buffer memory held by one relay loop, returned when it goes away.
+	class relay_reservation
+	{
+	public:
+		explicit relay_reservation(admission_control &owner) : owner(owner) {}
+		~relay_reservation() { owner.relay_memory.fetch_sub(reserved, std::memory_order_relaxed); }
+		relay_reservation(const relay_reservation &) = delete;
+		relay_reservation& operator=(const relay_reservation &) = delete;
+
+		// Minimum buffers are always granted, even over budget.
+		void reserve(size_t bytes);
+		bool try_reserve(size_t bytes);
+		void release(size_t bytes);
+
+	private:
+		admission_control &owner;
+		size_t reserved = 0;
+	};
+
+	void configure(const limits &new_limits) { config = new_limits; }
+
+	bool accepting() const;
+	bool allow_source(const asio::ip::address &address);
+	bool relay_memory_exceeded() const;
+	size_t relay_memory_used() const { return relay_memory.load(std::memory_order_relaxed); }
+
+	std::atomic<size_t> handshakes{};
+	std::atomic<size_t> sessions{};
+
+private:
+	struct rate_bucket
+	{
+		double tokens = 0;
+		std::chrono::steady_clock::time_point last_refill;
+	};
+
+	// IPv4 sources are stored as IPv4-mapped IPv6 addresses.
+	using address_key = std::array<uint8_t, 16>;
+	struct address_hash
+	{
+		size_t operator()(const address_key &key) const noexcept
+		{
+			return std::hash<std::string_view>{}(std::string_view((const char *)key.data(), key.size()));
+		}
+	};
+
+	// Source addresses are spread over several locks so that shards rarely contend.
+	struct rate_stripe
+	{
+		std::mutex mutex;
+		std::unordered_map<address_key, rate_bucket, address_hash> buckets;
+	};
+
+	static constexpr size_t rate_stripe_count = 16;
+	static constexpr size_t rate_stripe_max_entries = 4096;
+
+	limits config;
+	std::atomic<size_t> relay_memory{};
+	std::array<rate_stripe, rate_stripe_count> rate_stripes;
+};
+
+extern admission_control admission;
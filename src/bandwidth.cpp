@@ -0,0 +1,107 @@
+﻿#include <algorithm>
+#include "bandwidth.hpp"
+
+bandwidth_policy bandwidth;
+
+namespace
+{
+	constexpr size_t minimum_burst_size = 4096;
+
+	int64_t steady_nanoseconds()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+}
+
+void rate_limiter::configure(size_t bytes_per_second)
+{
+	this->bytes_per_second = bytes_per_second;
+	if (bytes_per_second == 0)
+		return;
+
+	burst = std::max(bytes_per_second / 20, minimum_burst_size);
+	nanoseconds_per_byte = 1e9 / (double)bytes_per_second;
+	tolerance = (int64_t)(burst * nanoseconds_per_byte);
+}
+
+std::chrono::nanoseconds rate_limiter::consume(size_t bytes, int64_t now)
+{
+	int64_t cost = (int64_t)(bytes * nanoseconds_per_byte);
+	int64_t arrival = theoretical_arrival.load(std::memory_order_relaxed);
+	int64_t next_arrival;
+	do
+	{
+		// An idle bucket only keeps `tolerance` worth of credit.
+		next_arrival = std::max(arrival, now) + cost;
+	} while (!theoretical_arrival.compare_exchange_weak(arrival, next_arrival, std::memory_order_relaxed));
+
+	return std::chrono::nanoseconds(std::max<int64_t>(next_arrival - now - tolerance, 0));
+}
+
+void directional_limiter::configure(const rate_limits &limits)
+{
+	(*this)[metric_direction::upload].configure(limits.upload);
+	(*this)[metric_direction::download].configure(limits.download);
+}
+
+void bandwidth_policy::configure(const rate_limits &session, const rate_limits &global, const std::vector<std::pair<std::string, rate_limits>> &users)
+{
+	this->session = session;
+	this->global.configure(global);
+	global_active = global.upload != 0 || global.download != 0;
+	for (auto &[username, limits] : users)
+	{
+		auto limiter = std::make_unique<directional_limiter>();
+		limiter->configure(limits);
+		this->users[username] = std::move(limiter);
+	}
+}
+
+directional_limiter* bandwidth_policy::user_limiter(std::string_view username)
+{
+	auto iter = users.find(username);
+	return iter == users.end() ? nullptr : iter->second.get();
+}
+
+traffic_shaper::traffic_shaper(directional_limiter *user) :
+	user(user), global(bandwidth.global_limiter())
+{
+	session.configure(bandwidth.session_limits());
+	for (size_t i = 0; i < active_directions.size(); i++)
+	{
+		metric_direction direction = (metric_direction)i;
+		active_directions[i] = session[direction].limited() ||
+			(user != nullptr && (*user)[direction].limited()) ||
+			(global != nullptr && (*global)[direction].limited());
+	}
+}
+
+size_t traffic_shaper::max_read(metric_direction direction, size_t buffer_size) const
+{
+	if (!active(direction))
+		return buffer_size;
+
+	for (const directional_limiter *limiter : { &session, (const directional_limiter *)user, (const directional_limiter *)global })
+	{
+		if (limiter != nullptr && (*limiter)[direction].limited())
+			buffer_size = std::min(buffer_size, (*limiter)[direction].burst_size());
+	}
+	return buffer_size;
+}
+
+std::chrono::nanoseconds traffic_shaper::consume(metric_direction direction, size_t bytes)
+{
+	if (!active(direction))
+		return std::chrono::nanoseconds::zero();
+
+	// Every level is charged, so that each one sees the full traffic,
+	// and the caller waits for the one that is furthest behind.
+	int64_t now = steady_nanoseconds();
+	std::chrono::nanoseconds delay = std::chrono::nanoseconds::zero();
+	for (directional_limiter *limiter : { &session, user, global })
+	{
+		if (limiter != nullptr && (*limiter)[direction].limited())
+			delay = std::max(delay, (*limiter)[direction].consume(bytes, now));
+	}
+	return delay;
+}
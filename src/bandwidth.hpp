@@ -0,0 +1,110 @@
+﻿#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "metrics.hpp"
+
+// Bandwidth shaping for the relay loops. Upload and download are limited
+// independently, at three levels that all apply at once:
+// - per session (--session-rate),
+// - per authenticated username, shared by all of that user's sessions (--user-rate),
+// - for the whole process (--global-rate).
+//
+// A relay loop charges every chunk it reads and then waits as long as the
+// tightest limit asks for before reading again, so throttled data stays in
+// the kernel's socket buffers and TCP flow control slows the sender down.
+
+// Bytes per second, 0 means unlimited.
+struct rate_limits
+{
+	size_t upload = 0;
+	size_t download = 0;
+};
+
+// Token bucket kept as a single "theoretical arrival time" (GCRA), so that
+// charging it is one compare-and-swap, without a lock, even when it is shared
+// by sessions on different shards.
+class rate_limiter
+{
+public:
+	void configure(size_t bytes_per_second);
+	bool limited() const { return bytes_per_second != 0; }
+
+	// Largest chunk that should be read at once, about 50 ms worth of traffic.
+	size_t burst_size() const { return burst; }
+
+	// Charges `bytes` and returns how long the caller has to wait before it reads again.
+	std::chrono::nanoseconds consume(size_t bytes, int64_t now);
+
+private:
+	size_t bytes_per_second = 0;
+	size_t burst = 0;
+	double nanoseconds_per_byte = 0;
+	int64_t tolerance = 0;
+	std::atomic<int64_t> theoretical_arrival{};
+};
+
+// One limiter for each metric_direction.
+struct directional_limiter
+{
+	void configure(const rate_limits &limits);
+	rate_limiter& operator[](metric_direction direction) { return directions[(size_t)direction]; }
+	const rate_limiter& operator[](metric_direction direction) const { return directions[(size_t)direction]; }
+
+	std::array<rate_limiter, (size_t)metric_direction::count> directions;
+};
+
+// Limits shared by all sessions. Configured once before the shards start, read-only afterwards.
+class bandwidth_policy
+{
+public:
+	void configure(const rate_limits &session, const rate_limits &global, const std::vector<std::pair<std::string, rate_limits>> &users);
+
+	const rate_limits& session_limits() const { return session; }
+	directional_limiter* global_limiter() { return global_active ? &global : nullptr; }
+
+	// Returns nullptr when the user has no limit of its own.
+	directional_limiter* user_limiter(std::string_view username);
+
+private:
+	struct username_hash
+	{
+		using is_transparent = void;
+		size_t operator()(std::string_view name) const noexcept { return std::hash<std::string_view>{}(name); }
+	};
+
+	rate_limits session;
+	directional_limiter global;
+	bool global_active = false;
+	std::unordered_map<std::string, std::unique_ptr<directional_limiter>, username_hash, std::equal_to<>> users;
+};
+
+extern bandwidth_policy bandwidth;
+
+// The limits one session is subject to. When none of them is set,
+// consume() returns without reading the clock.
+class traffic_shaper
+{
+public:
+	explicit traffic_shaper(directional_limiter *user = nullptr);
+	traffic_shaper(const traffic_shaper &) = delete;
+	traffic_shaper& operator=(const traffic_shaper &) = delete;
+
+	bool active(metric_direction direction) const { return active_directions[(size_t)direction]; }
+
+	// Clamps a read to the smallest burst size of the limits in effect.
+	size_t max_read(metric_direction direction, size_t buffer_size) const;
+	std::chrono::nanoseconds consume(metric_direction direction, size_t bytes);
+
+private:
+	directional_limiter session;
+	directional_limiter *user = nullptr;
+	directional_limiter *global = nullptr;
+	std::array<bool, (size_t)metric_direction::count> active_directions = {};
+};
@@ -0,0 +1,70 @@
+﻿#include <fstream>
+#include "credentials.hpp"
+
+credential_store credentials;
+
+namespace
+{
+	// ULEN and PLEN are single bytes.
+	constexpr size_t max_credential_size = 255;
+
+	bool constant_time_equal(std::string_view expected, std::string_view given)
+	{
+		uint8_t difference = expected.size() == given.size() ? 0 : 1;
+		for (size_t i = 0; i < max_credential_size; i++)
+		{
+			uint8_t a = i < expected.size() ? (uint8_t)expected[i] : 0;
+			uint8_t b = i < given.size() ? (uint8_t)given[i] : 0;
+			difference |= a ^ b;
+		}
+		return difference == 0;
+	}
+}
+
+bool credential_table::load(const std::string &path, std::string &error)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+	{
+		error = "cannot open " + path;
+		return false;
+	}
+
+	std::string line;
+	for (size_t line_number = 1; std::getline(file, line); line_number++)
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty() || line.front() == '#')
+			continue;
+
+		size_t colon = line.find(':');
+		if (colon == std::string::npos || colon == 0 || colon + 1 == line.size() ||
+			colon > max_credential_size || line.size() - colon - 1 > max_credential_size)
+		{
+			error = path + ":" + std::to_string(line_number) + ": expected USERNAME:PASSWORD, each 1 to 255 bytes";
+			return false;
+		}
+		add(line.substr(0, colon), line.substr(colon + 1));
+	}
+	return true;
+}
+
+void credential_table::add(std::string username, std::string password)
+{
+	users.insert_or_assign(std::move(username), std::move(password));
+}
+
+bool credential_table::verify(std::string_view username, std::string_view password) const
+{
+	auto iter = users.find(username);
+	bool found = iter != users.end();
+	bool equal = constant_time_equal(found ? std::string_view(iter->second) : std::string_view(), password);
+	return found && equal;
+}
+
+const credential_table* credential_store::current()
+{
+	thread_local published<credential_table>::cache cached;
+	return cached.get(table).get();
+}
@@ -0,0 +1,52 @@
+﻿#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "published.hpp"
+
+// Usernames and passwords accepted by the username / password method (RFC 1929).
+// A table is immutable once published, so any number of handshakes can read it at once.
+class credential_table
+{
+public:
+	// Adds the entries of a file with one "username:password" per line. The password
+	// may contain ':'. Blank lines and lines starting with '#' are skipped.
+	// A malformed line fails the whole file.
+	bool load(const std::string &path, std::string &error);
+	void add(std::string username, std::string password);
+	size_t size() const { return users.size(); }
+
+	// The comparison takes the same time whether the username exists, the
+	// password is wrong at its first byte or at its last one.
+	bool verify(std::string_view username, std::string_view password) const;
+
+private:
+	struct username_hash
+	{
+		using is_transparent = void;
+		size_t operator()(std::string_view name) const noexcept { return std::hash<std::string_view>{}(name); }
+	};
+
+	std::unordered_map<std::string, std::string, username_hash, std::equal_to<>> users;
+};
+
+// Hands the current credential_table to the shards (see published.hpp).
+// publish() swaps in a complete new table, which was built without any lock held.
+// Each shard thread keeps its own reference, and a handshake only reads the
+// generation unless a reload has happened since its thread last looked.
+class credential_store
+{
+public:
+	void publish(std::shared_ptr<const credential_table> table) { this->table.store(std::move(table)); }
+	bool enabled() const { return table.version() != 0; }
+
+	// The table of the calling thread, valid until the thread calls this again.
+	const credential_table* current();
+
+private:
+	published<credential_table> table;
+};
+
+extern credential_store credentials;
@@ -0,0 +1,276 @@
+﻿#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <fstream>
+#include <optional>
+#include "destination_acl.hpp"
+
+destination_acl acl;
+
+namespace
+{
+	constexpr size_t max_domain_size = 255;
+	constexpr size_t max_label_size = 63;
+
+	std::string_view trim(std::string_view text)
+	{
+		while (!text.empty() && std::isspace((unsigned char)text.front()))
+			text.remove_prefix(1);
+		while (!text.empty() && std::isspace((unsigned char)text.back()))
+			text.remove_suffix(1);
+		return text;
+	}
+
+	// Lower-cases `domain` into `output` and drops the root label's dot.
+	std::string_view normalise_domain(std::string_view domain, std::array<char, max_domain_size> &output)
+	{
+		if (!domain.empty() && domain.back() == '.')
+			domain.remove_suffix(1);
+		size_t size = std::min(domain.size(), output.size());
+		std::transform(domain.begin(), domain.begin() + size, output.begin(), [](char c) { return (char)std::tolower((unsigned char)c); });
+		return std::string_view(output.data(), size);
+	}
+
+	// Splits off the rightmost label.
+	std::string_view pop_label(std::string_view &name)
+	{
+		size_t dot = name.rfind('.');
+		std::string_view label = dot == std::string_view::npos ? name : name.substr(dot + 1);
+		name = dot == std::string_view::npos ? std::string_view() : name.substr(0, dot);
+		return label;
+	}
+
+	bool bit_at(const uint8_t *bits, size_t index)
+	{
+		return (bits[index / 8] >> (7 - index % 8)) & 1;
+	}
+
+	// The shorter IPv4 forms inet_aton() and most resolvers accept as well:
+	// "a", "a.b", "a.b.c" and "a.b.c.d", each part decimal, octal (leading 0)
+	// or hexadecimal (0x), the last part filling the remaining bytes.
+	std::optional<asio::ip::address_v4> parse_ipv4_numbers(std::string_view name)
+	{
+		std::array<uint64_t, 4> parts = {};
+		size_t count = 0;
+		while (true)
+		{
+			if (count == parts.size())
+				return std::nullopt;
+			size_t dot = name.find('.');
+			std::string_view part = name.substr(0, dot);
+			int base = 10;
+			if (part.size() > 1 && part[0] == '0' && (part[1] == 'x' || part[1] == 'X'))
+			{
+				base = 16;
+				part.remove_prefix(2);
+			}
+			else if (part.size() > 1 && part[0] == '0')
+			{
+				base = 8;
+				part.remove_prefix(1);
+			}
+			auto [end, parse_error] = std::from_chars(part.data(), part.data() + part.size(), parts[count], base);
+			if (part.empty() || parse_error != std::errc() || end != part.data() + part.size())
+				return std::nullopt;
+			count++;
+			if (dot == std::string_view::npos)
+				break;
+			name.remove_prefix(dot + 1);
+		}
+
+		uint64_t value = 0;
+		for (size_t i = 0; i + 1 < count; i++)
+		{
+			if (parts[i] > 0xff)
+				return std::nullopt;
+			value |= parts[i] << (8 * (3 - i));
+		}
+		uint64_t last_limit = 0xffffffffu >> (8 * (count - 1));
+		if (parts[count - 1] > last_limit)
+			return std::nullopt;
+		value |= parts[count - 1];
+		return asio::ip::address_v4((uint32_t)value);
+	}
+}
+
+bool destination_acl::load(const std::string &path, std::string &error)
+{
+	std::ifstream file(path);
+	if (!file)
+	{
+		error = "cannot open " + path;
+		return false;
+	}
+
+	std::string line;
+	for (size_t line_number = 1; std::getline(file, line); line_number++)
+	{
+		std::string_view text = trim(line);
+		if (text.empty() || text.front() == '#')
+			continue;
+
+		size_t space = text.find_first_of(" \t");
+		std::string_view keyword = text.substr(0, space);
+		std::string_view pattern = space == std::string_view::npos ? std::string_view() : trim(text.substr(space));
+		verdict rule = keyword == "allow" ? verdict::allow : keyword == "deny" ? verdict::deny : verdict::none;
+
+		bool valid = false;
+		if (keyword == "default" && (pattern == "allow" || pattern == "deny"))
+		{
+			fallback = pattern == "allow" ? verdict::allow : verdict::deny;
+			valid = true;
+		}
+		else if (rule != verdict::none && !pattern.empty())
+		{
+			valid = add_rule(rule, pattern);
+		}
+
+		if (!valid)
+		{
+			error = path + ":" + std::to_string(line_number) + ": expected \"allow|deny ADDRESS[/PREFIX]\", \"allow|deny DOMAIN\" or \"default allow|deny\"";
+			return false;
+		}
+	}
+
+	loaded = true;
+	return true;
+}
+
+bool destination_acl::add_rule(verdict rule, std::string_view pattern)
+{
+	size_t slash = pattern.find('/');
+	asio::error_code ec;
+	asio::ip::address address = asio::ip::make_address(std::string(pattern.substr(0, slash)), ec);
+	if (ec)
+		return slash == std::string_view::npos && insert_domain(pattern, rule);
+
+	if (address.is_v6() && address.to_v6().is_v4_mapped())
+		address = asio::ip::make_address_v4(asio::ip::v4_mapped, address.to_v6());
+
+	size_t bit_count = address.is_v4() ? 32 : 128;
+	size_t prefix_length = bit_count;
+	if (slash != std::string_view::npos)
+	{
+		std::string_view length_text = pattern.substr(slash + 1);
+		auto [end, parse_error] = std::from_chars(length_text.data(), length_text.data() + length_text.size(), prefix_length);
+		if (parse_error != std::errc() || end != length_text.data() + length_text.size() || prefix_length > bit_count)
+			return false;
+	}
+
+	if (address.is_v4())
+		insert_prefix(ipv4_trie, address.to_v4().to_bytes().data(), prefix_length, rule);
+	else
+		insert_prefix(ipv6_trie, address.to_v6().to_bytes().data(), prefix_length, rule);
+	rules++;
+	return true;
+}
+
+void destination_acl::insert_prefix(std::vector<prefix_node> &trie, const uint8_t *bits, size_t prefix_length, verdict rule)
+{
+	uint32_t node = 0;
+	for (size_t i = 0; i < prefix_length; i++)
+	{
+		bool bit = bit_at(bits, i);
+		if (trie[node].children[bit] == 0)
+		{
+			trie[node].children[bit] = (uint32_t)trie.size();
+			trie.emplace_back();
+		}
+		node = trie[node].children[bit];
+	}
+	trie[node].rule = rule;
+}
+
+destination_acl::verdict destination_acl::lookup_prefix(const std::vector<prefix_node> &trie, const uint8_t *bits, size_t bit_count)
+{
+	verdict result = trie[0].rule;
+	uint32_t node = 0;
+	for (size_t i = 0; i < bit_count; i++)
+	{
+		node = trie[node].children[bit_at(bits, i)];
+		if (node == 0)
+			break;
+		if (trie[node].rule != verdict::none)
+			result = trie[node].rule;
+	}
+	return result;
+}
+
+bool destination_acl::insert_domain(std::string_view domain, verdict rule)
+{
+	// "*.example.com" and ".example.com" mean the same as "example.com".
+	if (domain.starts_with("*."))
+		domain.remove_prefix(2);
+	else if (domain.starts_with("."))
+		domain.remove_prefix(1);
+	if (domain.size() > max_domain_size)
+		return false;
+
+	std::array<char, max_domain_size> buffer;
+	std::string_view name = normalise_domain(domain, buffer);
+	if (name.empty())
+		return false;
+
+	uint32_t node = 0;
+	while (!name.empty())
+	{
+		std::string_view label = pop_label(name);
+		if (label.empty() || label.size() > max_label_size)
+			return false;
+
+		auto iter = domains[node].children.find(label);
+		if (iter != domains[node].children.end())
+		{
+			node = iter->second;
+			continue;
+		}
+
+		uint32_t child = (uint32_t)domains.size();
+		domains[node].children.emplace(std::string(label), child);
+		domains.emplace_back();
+		node = child;
+	}
+	domains[node].rule = rule;
+	rules++;
+	return true;
+}
+
+destination_acl::verdict destination_acl::match(const asio::ip::address &address) const
+{
+	verdict result = verdict::none;
+	if (address.is_v4())
+		result = lookup_prefix(ipv4_trie, address.to_v4().to_bytes().data(), 32);
+	else if (address.to_v6().is_v4_mapped())
+		result = lookup_prefix(ipv4_trie, asio::ip::make_address_v4(asio::ip::v4_mapped, address.to_v6()).to_bytes().data(), 32);
+	else
+		result = lookup_prefix(ipv6_trie, address.to_v6().to_bytes().data(), 128);
+	return result == verdict::none ? fallback : result;
+}
+
+destination_acl::verdict destination_acl::match(std::string_view domain) const
+{
+	std::array<char, max_domain_size> buffer;
+	std::string_view name = normalise_domain(domain, buffer);
+
+	// A name that is an address literal never reaches the domain rules. An upstream
+	// proxy would connect to the address, so the prefix rules decide.
+	asio::error_code ec;
+	asio::ip::address address = asio::ip::make_address(std::string(name), ec);
+	if (!ec)
+		return match(address);
+	if (std::optional<asio::ip::address_v4> numbers = parse_ipv4_numbers(name); numbers.has_value())
+		return match(asio::ip::address(*numbers));
+
+	verdict result = verdict::none;
+	uint32_t node = 0;
+	while (!name.empty())
+	{
+		auto iter = domains[node].children.find(pop_label(name));
+		if (iter == domains[node].children.end())
+			break;
+		node = iter->second;
+		if (domains[node].rule != verdict::none)
+			result = domains[node].rule;
+	}
+	return result;
+}
@@ -0,0 +1,74 @@
+﻿#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <asio.hpp>
+
+// Destination access control, loaded from --acl FILE before the shards start
+// and read-only afterwards. Each line of the file is one rule:
+//
+//   allow|deny 10.0.0.0/8          an IPv4 or IPv6 prefix, or a single address
+//   allow|deny example.com         a domain name and all of its subdomains
+//   default allow|deny             destinations no rule covers, allow if not given
+//
+// The most specific rule wins: the longest matching prefix, or the longest
+// matching domain suffix. Prefixes are kept in binary tries and domain names
+// in a trie of their labels read from right to left, so a lookup takes at most
+// 32 / 128 steps for an address or one step per label for a name, no matter
+// how many rules there are.
+class destination_acl
+{
+public:
+	enum class verdict : uint8_t { none, allow, deny };
+
+	bool load(const std::string &path, std::string &error);
+	bool enabled() const { return loaded; }
+	size_t rule_count() const { return rules; }
+	verdict default_verdict() const { return fallback; }
+
+	// Never returns verdict::none.
+	verdict match(const asio::ip::address &address) const;
+
+	// verdict::none when no domain rule covers the name.
+	// The addresses it resolves to are checked instead.
+	// An address literal, "10.0.0.5" or "::1" but also "10.5" or "0x0a000005",
+	// is matched as that address, so the result is never none for it.
+	verdict match(std::string_view domain) const;
+
+private:
+	// Child index 0 means "no child", since the root is never anybody's child.
+	struct prefix_node
+	{
+		std::array<uint32_t, 2> children = {};
+		verdict rule = verdict::none;
+	};
+
+	struct label_hash
+	{
+		using is_transparent = void;
+		size_t operator()(std::string_view label) const noexcept { return std::hash<std::string_view>{}(label); }
+	};
+
+	struct domain_node
+	{
+		std::unordered_map<std::string, uint32_t, label_hash, std::equal_to<>> children;
+		verdict rule = verdict::none;
+	};
+
+	bool add_rule(verdict rule, std::string_view pattern);
+	static void insert_prefix(std::vector<prefix_node> &trie, const uint8_t *bits, size_t prefix_length, verdict rule);
+	static verdict lookup_prefix(const std::vector<prefix_node> &trie, const uint8_t *bits, size_t bit_count);
+	bool insert_domain(std::string_view domain, verdict rule);
+
+	std::vector<prefix_node> ipv4_trie = std::vector<prefix_node>(1);
+	std::vector<prefix_node> ipv6_trie = std::vector<prefix_node>(1);
+	std::vector<domain_node> domains = std::vector<domain_node>(1);
+	verdict fallback = verdict::allow;
+	size_t rules = 0;
+	bool loaded = false;
+};
+
+extern destination_acl acl;
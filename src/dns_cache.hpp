@@ -0,0 +1,137 @@
+﻿#pragma once
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <asio.hpp>
+
+// Per-shard hostname cache shared by every session of one io_context.
+// Only the thread that runs the io_context may use it, so no locking is needed.
+//
+// - Positive answers are kept for `ttl`, NXDOMAIN answers for `negative_ttl`.
+// - Concurrent lookups of the same hostname share one getaddrinfo() query.
+// - Entries are keyed by hostname only: SOCKS5 always carries a numeric port,
+//   so callers build endpoints from the cached addresses and their own port.
+class dns_cache
+{
+public:
+	using address_list = std::shared_ptr<const std::vector<asio::ip::address>>;
+
+	dns_cache(const asio::any_io_executor &executor, std::chrono::seconds ttl, std::chrono::seconds negative_ttl, size_t max_entries = 4096) :
+		executor(executor), resolver(executor), ttl(ttl), negative_ttl(negative_ttl), max_entries(max_entries) {}
+
+	// hostname must stay valid until the lookup completes.
+	asio::awaitable<address_list> resolve(std::string_view hostname, asio::error_code &ec)
+	{
+		ec.clear();
+		while (true)
+		{
+			auto iter = entries.find(hostname);
+			if (iter == entries.end())
+				break;
+
+			cache_entry &entry = iter->second;
+			if (entry.pending != nullptr)
+			{
+				// Another coroutine is already resolving this hostname, wait for it.
+				std::shared_ptr<asio::steady_timer> pending = entry.pending;
+				asio::error_code wait_ec;
+				co_await pending->async_wait(asio::redirect_error(asio::use_awaitable, wait_ec));
+				iter = entries.find(hostname);
+				if (iter == entries.end() || iter->second.pending != nullptr)
+					continue;
+				ec = iter->second.error;
+				co_return iter->second.addresses;
+			}
+
+			if (entry.expire_time > std::chrono::steady_clock::now())
+			{
+				ec = entry.error;
+				co_return entry.addresses;
+			}
+			break;
+		}
+
+		make_room();
+		std::shared_ptr<asio::steady_timer> pending = std::make_shared<asio::steady_timer>(executor, asio::steady_timer::time_point::max());
+		entries.insert_or_assign(std::string(hostname), cache_entry{ .addresses = nullptr, .error = {}, .expire_time = {}, .pending = pending });
+
+		asio::ip::tcp::resolver::results_type results = co_await resolver.async_resolve(hostname, "0", asio::redirect_error(asio::use_awaitable, ec));
+		if (!ec && results.empty())
+			ec = asio::error::host_not_found;
+
+		auto now = std::chrono::steady_clock::now();
+		cache_entry &entry = entries.find(hostname)->second;
+		entry.pending.reset();
+		entry.error = ec;
+		if (!ec)
+		{
+			auto addresses = std::make_shared<std::vector<asio::ip::address>>();
+			for (auto &&result : results)
+			{
+				asio::ip::address address = result.endpoint().address();
+				if (std::find(addresses->begin(), addresses->end(), address) == addresses->end())
+					addresses->push_back(address);
+			}
+			entry.addresses = std::move(addresses);
+			entry.expire_time = now + ttl;
+		}
+		else if (ec == asio::error::host_not_found)
+		{
+			entry.addresses.reset();
+			entry.expire_time = now + negative_ttl;
+		}
+		else
+		{
+			// Transient failure: hand it to the waiters, but let the next lookup try again.
+			entry.addresses.reset();
+			entry.expire_time = now;
+		}
+
+		pending->cancel();
+		co_return entry.addresses;
+	}
+
+private:
+	// Lets lookups take a std::string_view without building a std::string.
+	struct hostname_hash
+	{
+		using is_transparent = void;
+		size_t operator()(std::string_view hostname) const noexcept { return std::hash<std::string_view>{}(hostname); }
+	};
+
+	struct cache_entry
+	{
+		address_list addresses;
+		asio::error_code error;
+		std::chrono::steady_clock::time_point expire_time;
+		std::shared_ptr<asio::steady_timer> pending;
+	};
+
+	void make_room()
+	{
+		if (entries.size() < max_entries)
+			return;
+
+		auto now = std::chrono::steady_clock::now();
+		std::erase_if(entries, [now](const auto &item) { return item.second.pending == nullptr && item.second.expire_time <= now; });
+
+		for (auto iter = entries.begin(); entries.size() >= max_entries && iter != entries.end();)
+		{
+			if (iter->second.pending == nullptr)
+				iter = entries.erase(iter);
+			else
+				++iter;
+		}
+	}
+
+	asio::any_io_executor executor;
+	asio::ip::tcp::resolver resolver;
+	std::chrono::seconds ttl;
+	std::chrono::seconds negative_ttl;
+	size_t max_entries;
+	std::unordered_map<std::string, cache_entry, hostname_hash, std::equal_to<>> entries;
+};
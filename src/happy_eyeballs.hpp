@@ -0,0 +1,123 @@
+﻿#pragma once
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+#include <asio.hpp>
+
+// RFC 8305 section 4: interleave address families, starting with the family
+// of the first address. The resolver has already sorted them by RFC 6724.
+template<typename Endpoint>
+std::vector<Endpoint> order_endpoints_rfc8305(const std::vector<Endpoint> &endpoints)
+{
+	if (endpoints.empty())
+		return {};
+
+	bool first_is_v6 = endpoints.front().address().is_v6();
+	std::vector<Endpoint> preferred, other;
+	for (const Endpoint &endpoint : endpoints)
+		(endpoint.address().is_v6() == first_is_v6 ? preferred : other).push_back(endpoint);
+
+	std::vector<Endpoint> ordered;
+	ordered.reserve(endpoints.size());
+	for (size_t i = 0; i < preferred.size() || i < other.size(); i++)
+	{
+		if (i < preferred.size())
+			ordered.push_back(preferred[i]);
+		if (i < other.size())
+			ordered.push_back(other[i]);
+	}
+	return ordered;
+}
+
+// RFC 8305 connection racing. A new attempt starts every `attempt_delay`, or
+// at once when every running attempt has failed. The first connected socket
+// is returned and every other attempt is cancelled. At `expiry`, every attempt
+// is cancelled and the race fails with timed_out.
+// `prepare` is called on each opened socket before it connects, to set socket options.
+template<typename Socket>
+asio::awaitable<Socket> happy_eyeballs_connect(const std::vector<typename Socket::endpoint_type> &endpoints,
+	std::chrono::milliseconds attempt_delay, std::chrono::steady_clock::time_point expiry,
+	typename Socket::endpoint_type &connected_endpoint, asio::error_code &ec,
+	const std::function<void(Socket &)> &prepare = nullptr)
+{
+	using endpoint_type = typename Socket::endpoint_type;
+	asio::any_io_executor executor = co_await asio::this_coro::executor;
+
+	struct race_state
+	{
+		explicit race_state(const asio::any_io_executor &executor) : wakeup(executor) {}
+		std::vector<std::unique_ptr<Socket>> attempts;
+		std::optional<size_t> winner;
+		size_t failed = 0;
+		asio::error_code last_error = asio::error::host_not_found;
+		asio::steady_timer wakeup;
+	};
+
+	std::vector<endpoint_type> ordered = order_endpoints_rfc8305(endpoints);
+	auto state = std::make_shared<race_state>(executor);
+	auto next_attempt_time = std::chrono::steady_clock::now();
+
+	bool expired = false;
+	while (!state->winner.has_value() && state->failed < ordered.size())
+	{
+		size_t started = state->attempts.size();
+		auto now = std::chrono::steady_clock::now();
+		if (now >= expiry)
+		{
+			expired = true;
+			break;
+		}
+		if (started < ordered.size() && (now >= next_attempt_time || state->failed == started))
+		{
+			Socket &socket = *state->attempts.emplace_back(std::make_unique<Socket>(executor));
+			if (prepare)
+			{
+				asio::error_code open_ec;
+				socket.open(ordered[started].protocol(), open_ec);
+				if (!open_ec)
+					prepare(socket);
+			}
+			socket.async_connect(ordered[started], [state, index = started](const asio::error_code &e)
+				{
+					if (e)
+					{
+						state->failed++;
+						state->last_error = e;
+					}
+					else if (!state->winner.has_value())
+					{
+						state->winner = index;
+					}
+					state->wakeup.cancel();
+				});
+			started++;
+			next_attempt_time = now + attempt_delay;
+		}
+
+		state->wakeup.expires_at(started < ordered.size() ? std::min(next_attempt_time, expiry) : expiry);
+		asio::error_code wait_ec;
+		co_await state->wakeup.async_wait(asio::redirect_error(asio::use_awaitable, wait_ec));
+	}
+
+	for (size_t i = 0; i < state->attempts.size(); i++)
+	{
+		if (state->winner != i)
+		{
+			asio::error_code close_ec;
+			state->attempts[i]->close(close_ec);
+		}
+	}
+
+	if (!state->winner.has_value())
+	{
+		ec = expired ? asio::error::timed_out : state->last_error;
+		co_return Socket(executor);
+	}
+
+	ec.clear();
+	connected_endpoint = ordered[*state->winner];
+	co_return std::move(*state->attempts[*state->winner]);
+}
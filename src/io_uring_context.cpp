@@ -0,0 +1,369 @@
+﻿#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "io_uring_context.hpp"
+
+namespace
+{
+	constexpr unsigned minimum_ring_entries = 64;
+
+	int io_uring_setup(unsigned entries, io_uring_params *params)
+	{
+		return (int)syscall(__NR_io_uring_setup, entries, params);
+	}
+
+	int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+	{
+		return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+	}
+
+	int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned count)
+	{
+		return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+	}
+
+	template<typename T>
+	T* ring_field(void *ring, uint32_t offset)
+	{
+		return reinterpret_cast<T *>(static_cast<uint8_t *>(ring) + offset);
+	}
+}
+
+// The coroutine waiting for a request sleeps on `done`, which the completion cancels.
+struct io_uring_context::operation
+{
+	explicit operation(const asio::any_io_executor &executor) : done(executor, asio::steady_timer::time_point::max()) {}
+	asio::steady_timer done;
+	int result = 0;
+	bool completed = false;
+};
+
+io_uring_context::io_uring_context(const asio::any_io_executor &executor) :
+	executor(executor), event_descriptor(executor) {}
+
+std::unique_ptr<io_uring_context> io_uring_context::create(const asio::any_io_executor &executor, size_t buffer_count, size_t buffer_size, std::string &error)
+{
+	std::unique_ptr<io_uring_context> context(new io_uring_context(executor));
+	if (!context->setup(buffer_count, buffer_size, error))
+		return nullptr;
+	return context;
+}
+
+io_uring_context::~io_uring_context()
+{
+	if (sqes != nullptr)
+		munmap(sqes, sqes_size);
+	if (cq_ring != nullptr && cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	if (sq_ring != nullptr)
+		munmap(sq_ring, sq_ring_size);
+	if (buffer_memory != nullptr)
+		munmap(buffer_memory, buffer_memory_size);
+	if (ring_fd >= 0)
+		close(ring_fd);
+}
+
+bool io_uring_context::setup(size_t buffer_count, size_t buffer_size, std::string &error)
+{
+	buffer_count = std::clamp<size_t>(buffer_count, 1, UINT16_MAX);
+
+	// Each buffer has at most one request in flight, plus the poll linked in front of it,
+	// so the completion queue (twice the submission queue) can never overflow.
+	unsigned entries = minimum_ring_entries;
+	while (entries < buffer_count)
+		entries *= 2;
+
+	io_uring_params params = {};
+	params.flags = IORING_SETUP_CLAMP;
+	ring_fd = io_uring_setup(entries, &params);
+	if (ring_fd < 0)
+	{
+		error = std::string("io_uring_setup: ") + std::strerror(errno);
+		return false;
+	}
+
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap)
+		sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+	void *mapped = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (mapped == MAP_FAILED)
+	{
+		error = std::string("io_uring submission queue: ") + std::strerror(errno);
+		return false;
+	}
+	sq_ring = mapped;
+
+	if (single_mmap)
+	{
+		cq_ring = sq_ring;
+	}
+	else
+	{
+		mapped = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (mapped == MAP_FAILED)
+		{
+			error = std::string("io_uring completion queue: ") + std::strerror(errno);
+			return false;
+		}
+		cq_ring = mapped;
+	}
+
+	sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	mapped = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (mapped == MAP_FAILED)
+	{
+		error = std::string("io_uring submission entries: ") + std::strerror(errno);
+		return false;
+	}
+	sqes = static_cast<io_uring_sqe *>(mapped);
+
+	sq_head = ring_field<unsigned>(sq_ring, params.sq_off.head);
+	sq_tail = ring_field<unsigned>(sq_ring, params.sq_off.tail);
+	sq_array = ring_field<unsigned>(sq_ring, params.sq_off.array);
+	sq_mask = *ring_field<unsigned>(sq_ring, params.sq_off.ring_mask);
+	sq_entries = params.sq_entries;
+	cq_head = ring_field<unsigned>(cq_ring, params.cq_off.head);
+	cq_tail = ring_field<unsigned>(cq_ring, params.cq_off.tail);
+	if (params.cq_off.flags != 0)	// Linux 5.8 and later
+		cq_flags = ring_field<unsigned>(cq_ring, params.cq_off.flags);
+	cqes = ring_field<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+	cq_mask = *ring_field<unsigned>(cq_ring, params.cq_off.ring_mask);
+	local_tail = *sq_tail;
+
+	this->buffer_size = buffer_size;
+	buffer_memory_size = buffer_count * buffer_size;
+	mapped = mmap(nullptr, buffer_memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapped == MAP_FAILED)
+	{
+		error = std::string("io_uring buffers: ") + std::strerror(errno);
+		return false;
+	}
+	buffer_memory = static_cast<uint8_t *>(mapped);
+
+	std::vector<iovec> iovecs(buffer_count);
+	for (size_t i = 0; i < buffer_count; i++)
+		iovecs[i] = { buffer_memory + i * buffer_size, buffer_size };
+	if (io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, iovecs.data(), (unsigned)iovecs.size()) < 0)
+	{
+		error = std::string("io_uring buffer registration: ") + std::strerror(errno);
+		return false;
+	}
+
+	int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event_fd < 0)
+	{
+		error = std::string("eventfd: ") + std::strerror(errno);
+		return false;
+	}
+	event_descriptor.assign(event_fd);
+	if (io_uring_register(ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0)
+	{
+		error = std::string("io_uring eventfd registration: ") + std::strerror(errno);
+		return false;
+	}
+
+	free_buffers.reserve(buffer_count);
+	for (size_t i = buffer_count; i > 0; i--)
+		free_buffers.push_back((uint16_t)(i - 1));
+	return true;
+}
+
+void io_uring_context::start()
+{
+	asio::co_spawn(executor, reap_completions(), asio::detached);
+}
+
+std::optional<io_uring_context::buffer> io_uring_context::acquire_buffer()
+{
+	if (free_buffers.empty())
+		return std::nullopt;
+
+	uint16_t index = free_buffers.back();
+	free_buffers.pop_back();
+	return buffer{ index, std::span<uint8_t>(buffer_memory + index * buffer_size, buffer_size) };
+}
+
+void io_uring_context::release_buffer(const buffer &released)
+{
+	free_buffers.push_back(released.index);
+}
+
+asio::awaitable<int> io_uring_context::read_fixed(int fd, const buffer &target, size_t offset, size_t size)
+{
+	return submit_fixed(IORING_OP_READ_FIXED, fd, target, offset, size, false);
+}
+
+asio::awaitable<int> io_uring_context::write_fixed(int fd, const buffer &source, size_t offset, size_t size)
+{
+	return submit_fixed(IORING_OP_WRITE_FIXED, fd, source, offset, size, false);
+}
+
+asio::awaitable<int> io_uring_context::read_fixed_when_readable(int fd, const buffer &target, size_t offset, size_t size)
+{
+	return submit_fixed(IORING_OP_READ_FIXED, fd, target, offset, size, true);
+}
+
+asio::awaitable<int> io_uring_context::submit_fixed(uint8_t opcode, int fd, const buffer &slot, size_t offset, size_t size, bool poll_first)
+{
+	operation request(executor);
+	if (poll_first)
+	{
+		// The poll has no user_data: only the request behind it completes the caller.
+		// A failed poll fails the linked request with ECANCELED.
+		io_uring_sqe *poll = next_sqe(2);
+		std::memset(poll, 0, sizeof(io_uring_sqe));
+		poll->opcode = IORING_OP_POLL_ADD;
+		poll->fd = fd;
+		poll->poll32_events = POLLIN;
+		poll->flags = IOSQE_IO_LINK;
+	}
+	io_uring_sqe *sqe = next_sqe();
+	std::memset(sqe, 0, sizeof(io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->off = (uint64_t)-1;	// sockets have no file position
+	sqe->addr = (uint64_t)(uintptr_t)(slot.data.data() + offset);
+	sqe->len = (uint32_t)std::min(size, slot.data.size() - offset);
+	sqe->buf_index = slot.index;
+	sqe->user_data = (uint64_t)(uintptr_t)&request;
+	schedule_submit();
+
+	while (!request.completed)
+	{
+		asio::error_code ec;
+		co_await request.done.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+	}
+	co_return request.result;
+}
+
+// `needed` entries are kept free, so a linked pair never straddles two submissions.
+io_uring_sqe* io_uring_context::next_sqe(unsigned needed)
+{
+	if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + needed > sq_entries)
+		submit();
+	// Still full: the kernel refused the queued requests. Their callers see EAGAIN,
+	// wait through asio and try again.
+	if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + needed > sq_entries)
+		fail_unsubmitted(EAGAIN);
+
+	unsigned index = local_tail & sq_mask;
+	sq_array[index] = index;
+	local_tail++;
+	unsubmitted++;
+	return &sqes[index];
+}
+
+// Requests queued by every handler that is ready now go out together.
+void io_uring_context::schedule_submit()
+{
+	if (submit_scheduled)
+		return;
+	submit_scheduled = true;
+	asio::post(executor, [this] { submit(); });
+}
+
+void io_uring_context::submit()
+{
+	submit_scheduled = false;
+	__atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+	while (unsubmitted > 0)
+	{
+		// Requests that complete inside io_uring_enter() are drained right after it, so they
+		// need not signal the eventfd and wake reap_completions() for nothing.
+		set_eventfd_enabled(false);
+		int submitted = io_uring_enter(ring_fd, unsubmitted, 0, 0);
+		set_eventfd_enabled(true);
+		if (submitted >= 0)
+		{
+			unsubmitted -= (unsigned)submitted;
+			drain_completions();
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		// EAGAIN / EBUSY: the kernel is short of resources, try again on the next round.
+		if (errno == EAGAIN || errno == EBUSY)
+		{
+			schedule_submit();
+			return;
+		}
+
+		// Anything else would fail the same way on every round.
+		int error = errno;
+		std::printf("io_uring_enter: %s\n", std::strerror(error));
+		fail_unsubmitted(error);
+		return;
+	}
+}
+
+// Takes back the requests the kernel has not consumed and completes them with `error`.
+void io_uring_context::fail_unsubmitted(int error)
+{
+	unsigned first = local_tail - unsubmitted;
+	__atomic_store_n(sq_tail, first, __ATOMIC_RELEASE);
+	for (unsigned i = first; i != local_tail; i++)
+	{
+		operation *request = reinterpret_cast<operation *>((uintptr_t)sqes[i & sq_mask].user_data);
+		if (request == nullptr)
+			continue;
+		request->result = -error;
+		request->completed = true;
+		request->done.cancel();
+	}
+	local_tail = first;
+	unsubmitted = 0;
+}
+
+asio::awaitable<void> io_uring_context::reap_completions()
+{
+	// Reading rather than waiting lets asio try the read first, and spares the epoll_ctl()
+	// it needs to re-arm an edge-triggered descriptor for async_wait().
+	uint64_t count = 0;
+	while (true)
+	{
+		asio::error_code ec;
+		co_await event_descriptor.async_read_some(asio::buffer(&count, sizeof(count)), asio::redirect_error(asio::use_awaitable, ec));
+		if (ec && ec != asio::error::would_block)
+			co_return;
+		drain_completions();
+	}
+}
+
+// Completions posted while the eventfd is off are picked up by the drain that follows.
+void io_uring_context::set_eventfd_enabled(bool enabled)
+{
+	if (cq_flags == nullptr)
+		return;
+	unsigned flags = __atomic_load_n(cq_flags, __ATOMIC_RELAXED);
+	flags = enabled ? flags & ~IORING_CQ_EVENTFD_DISABLED : flags | IORING_CQ_EVENTFD_DISABLED;
+	__atomic_store_n(cq_flags, flags, __ATOMIC_SEQ_CST);
+}
+
+void io_uring_context::drain_completions()
+{
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++)
+	{
+		const io_uring_cqe &cqe = cqes[head & cq_mask];
+		operation *request = reinterpret_cast<operation *>((uintptr_t)cqe.user_data);
+		if (request == nullptr)
+			continue;
+		request->result = cqe.res;
+		request->completed = true;
+		request->done.cancel();
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,97 @@
+﻿#pragma once
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+#include <asio.hpp>
+#include <linux/io_uring.h>
+
+// Per-shard io_uring instance for `--relay uring`, built with -DSOCKS5DEMO_IO_URING=ON.
+// Like dns_cache, it belongs to one io_context and is only used by the thread that runs it.
+//
+// - A fixed set of buffers is registered with the kernel once, so reads and
+//   writes into them skip the per-call page pinning of ordinary buffers.
+// - Requests queued while the io_context runs ready handlers are submitted
+//   together with one io_uring_enter(), instead of one syscall per read or write.
+// - Completions are signalled through an eventfd that the io_context watches,
+//   so asio's reactor stays the only place where the thread blocks.
+//
+// asio's own io_uring backend (ASIO_HAS_IO_URING) needs liburing, switches every
+// io_context of the program over at compile time, and has no registered buffers.
+// This ring is driven through the raw system calls instead and needs no liburing.
+class io_uring_context
+{
+public:
+	// One registered buffer, owned by one relay loop at a time.
+	struct buffer
+	{
+		uint16_t index = 0;
+		std::span<uint8_t> data;
+	};
+
+	// Returns nullptr and sets `error` when the kernel refuses the ring or the buffers.
+	static std::unique_ptr<io_uring_context> create(const asio::any_io_executor &executor, size_t buffer_count, size_t buffer_size, std::string &error);
+	~io_uring_context();
+	io_uring_context(const io_uring_context &) = delete;
+	io_uring_context& operator=(const io_uring_context &) = delete;
+
+	void start();
+
+	std::optional<buffer> acquire_buffer();
+	void release_buffer(const buffer &released);
+
+	// All three return the byte count, or a negative errno.
+	asio::awaitable<int> read_fixed(int fd, const buffer &target, size_t offset, size_t size);
+	asio::awaitable<int> write_fixed(int fd, const buffer &source, size_t offset, size_t size);
+	// Waits for `fd` to become readable inside the ring (a poll linked to the read), so a
+	// drained socket costs no epoll_ctl() and the wait and read go out in one submission.
+	asio::awaitable<int> read_fixed_when_readable(int fd, const buffer &target, size_t offset, size_t size);
+
+private:
+	struct operation;
+
+	explicit io_uring_context(const asio::any_io_executor &executor);
+
+	bool setup(size_t buffer_count, size_t buffer_size, std::string &error);
+	asio::awaitable<int> submit_fixed(uint8_t opcode, int fd, const buffer &slot, size_t offset, size_t size, bool poll_first);
+	io_uring_sqe* next_sqe(unsigned needed = 1);
+	void schedule_submit();
+	void submit();
+	void fail_unsubmitted(int error);
+	void set_eventfd_enabled(bool enabled);
+	asio::awaitable<void> reap_completions();
+	void drain_completions();
+
+	asio::any_io_executor executor;
+	int ring_fd = -1;
+	asio::posix::stream_descriptor event_descriptor;
+
+	void *sq_ring = nullptr;
+	void *cq_ring = nullptr;
+	size_t sq_ring_size = 0;
+	size_t cq_ring_size = 0;
+	io_uring_sqe *sqes = nullptr;
+	size_t sqes_size = 0;
+
+	unsigned *sq_head = nullptr;
+	unsigned *sq_tail = nullptr;
+	unsigned *sq_array = nullptr;
+	unsigned sq_mask = 0;
+	unsigned sq_entries = 0;
+	unsigned *cq_head = nullptr;
+	unsigned *cq_tail = nullptr;
+	unsigned *cq_flags = nullptr;
+	io_uring_cqe *cqes = nullptr;
+	unsigned cq_mask = 0;
+
+	unsigned local_tail = 0;
+	unsigned unsubmitted = 0;
+	bool submit_scheduled = false;
+
+	uint8_t *buffer_memory = nullptr;
+	size_t buffer_memory_size = 0;
+	size_t buffer_size = 0;
+	std::vector<uint16_t> free_buffers;
+};
@@ -0,0 +1,200 @@
+﻿#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "metrics.hpp"
+#include "latency_trace.hpp"
+
+namespace
+{
+	constexpr const char *stage_names[] = { "greeting", "authentication", "request", "dns", "connect", "reply", "first_byte", "total" };
+	constexpr double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+	struct alignas(64) thread_traces
+	{
+		std::array<latency_histogram, (size_t)trace_stage::count> stages;
+		size_t connections = 0;
+	};
+
+	thread_registry<thread_traces> registry;
+	size_t sampling_interval = 0;
+
+	thread_traces& local_traces()
+	{
+		thread_local thread_traces &traces = registry.add();
+		return traces;
+	}
+
+	struct stage_totals
+	{
+		std::array<uint64_t, latency_histogram::bucket_count> buckets{};
+		uint64_t count = 0;
+		uint64_t sum = 0;
+
+		uint64_t value_at(double quantile) const
+		{
+			uint64_t rank = std::max<uint64_t>(1, (uint64_t)(quantile * count + 0.5));
+			uint64_t seen = 0;
+			for (size_t i = 0; i < buckets.size(); i++)
+			{
+				seen += buckets[i];
+				if (seen >= rank)
+					return latency_histogram::highest_value(i);
+			}
+			return 0;
+		}
+
+		uint64_t max() const
+		{
+			for (size_t i = buckets.size(); i > 0; i--)
+			{
+				if (buckets[i - 1] != 0)
+					return latency_histogram::highest_value(i - 1);
+			}
+			return 0;
+		}
+	};
+
+	std::array<stage_totals, (size_t)trace_stage::count> collect()
+	{
+		std::array<stage_totals, (size_t)trace_stage::count> totals;
+		for (thread_traces *traces : registry.snapshot())
+		{
+			for (size_t stage = 0; stage < totals.size(); stage++)
+			{
+				const latency_histogram &histogram = traces->stages[stage];
+				for (size_t i = 0; i < latency_histogram::bucket_count; i++)
+				{
+					uint64_t count = histogram.buckets[i].load(std::memory_order_relaxed);
+					totals[stage].buckets[i] += count;
+					totals[stage].count += count;
+				}
+				totals[stage].sum += histogram.sum.load(std::memory_order_relaxed);
+			}
+		}
+		return totals;
+	}
+}
+
+size_t latency_histogram::bucket_of(uint64_t microseconds)
+{
+	microseconds = std::min<uint64_t>(microseconds, lowest_value(bucket_count) - 1);
+	size_t magnitude = (size_t)std::max(0, (int)std::bit_width(microseconds) - 5);
+	return sub_buckets * magnitude + (size_t)(microseconds >> magnitude);
+}
+
+uint64_t latency_histogram::lowest_value(size_t bucket)
+{
+	if (bucket < sub_buckets * 2)
+		return bucket;
+	size_t magnitude = bucket / sub_buckets - 1;
+	return (uint64_t)(bucket - sub_buckets * magnitude) << magnitude;
+}
+
+void latency_histogram::add(uint64_t microseconds)
+{
+	metric_add<uint64_t>(buckets[bucket_of(microseconds)]);
+	metric_add<uint64_t>(sum, microseconds);
+}
+
+void configure_tracing(size_t sample_every)
+{
+	sampling_interval = sample_every;
+}
+
+bool tracing_enabled()
+{
+	return sampling_interval != 0;
+}
+
+connection_trace connection_trace::sample()
+{
+	connection_trace trace;
+	if (sampling_interval == 0 || local_traces().connections++ % sampling_interval != 0)
+		return trace;
+	trace.active = true;
+	trace.marks[(size_t)trace_stage::total] = std::chrono::steady_clock::now();
+	return trace;
+}
+
+connection_trace& connection_trace::operator=(connection_trace &&other) noexcept
+{
+	if (this != &other)
+	{
+		finish();
+		marks = other.marks;
+		active = other.active;
+		other.active = false;
+	}
+	return *this;
+}
+
+void connection_trace::finish()
+{
+	if (!active)
+		return;
+	active = false;
+
+	auto microseconds = [](auto duration) { return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(duration).count(); };
+	thread_traces &traces = local_traces();
+	std::chrono::steady_clock::time_point previous = marks[(size_t)trace_stage::total];
+	for (size_t stage = 0; stage < (size_t)trace_stage::total; stage++)
+	{
+		if (marks[stage] == std::chrono::steady_clock::time_point{})
+			continue;
+		traces.stages[stage].add(microseconds(marks[stage] - previous));
+		previous = marks[stage];
+	}
+
+	if (marks[(size_t)trace_stage::first_byte] != std::chrono::steady_clock::time_point{})
+		traces.stages[(size_t)trace_stage::total].add(microseconds(marks[(size_t)trace_stage::first_byte] - marks[(size_t)trace_stage::total]));
+}
+
+void render_trace_metrics(std::string &output)
+{
+	if (!tracing_enabled())
+		return;
+
+	std::array<stage_totals, (size_t)trace_stage::count> totals = collect();
+	output += "# HELP socks5demo_stage_latency_seconds Time spent in each stage of the connections sampled by --trace-sample.\n";
+	output += "# TYPE socks5demo_stage_latency_seconds summary\n";
+	for (size_t stage = 0; stage < totals.size(); stage++)
+	{
+		std::string labels = std::string("stage=\"") + stage_names[stage] + "\"";
+		std::array<char, 160> text;
+		for (double quantile : quantiles)
+		{
+			std::snprintf(text.data(), text.size(), "socks5demo_stage_latency_seconds{%s,quantile=\"%g\"} %.6f\n",
+				labels.c_str(), quantile, totals[stage].value_at(quantile) / 1e6);
+			output += text.data();
+		}
+		std::snprintf(text.data(), text.size(), "socks5demo_stage_latency_seconds_sum{%s} %.6f\n", labels.c_str(), totals[stage].sum / 1e6);
+		output += text.data();
+		output += "socks5demo_stage_latency_seconds_count{" + labels + "} " + std::to_string(totals[stage].count) + "\n";
+	}
+}
+
+std::string render_trace_table()
+{
+	if (!tracing_enabled())
+		return "Tracing is disabled, see --trace-sample\n";
+
+	std::array<stage_totals, (size_t)trace_stage::count> totals = collect();
+	std::array<char, 160> header;
+	std::snprintf(header.data(), header.size(), "%-14s %11s %10s %10s %10s %10s %10s  (microseconds)\n", "stage", "count", "p50", "p90", "p99", "p999", "max");
+	std::string output = header.data();
+	for (size_t stage = 0; stage < totals.size(); stage++)
+	{
+		const stage_totals &stage_total = totals[stage];
+		std::array<char, 160> text;
+		std::snprintf(text.data(), text.size(), "%-14s %11llu %10llu %10llu %10llu %10llu %10llu\n", stage_names[stage],
+			(unsigned long long)stage_total.count,
+			(unsigned long long)stage_total.value_at(0.5), (unsigned long long)stage_total.value_at(0.9),
+			(unsigned long long)stage_total.value_at(0.99), (unsigned long long)stage_total.value_at(0.999),
+			(unsigned long long)stage_total.max());
+		output += text.data();
+	}
+	return output;
+}
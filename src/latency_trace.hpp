@@ -0,0 +1,77 @@
+﻿#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Where the time to first byte of a connection goes, for one connection in
+// every --trace-sample. Each stage is measured from the previous stage that the
+// connection went through, so a CONNECT to an address has no dns stage and its
+// connect stage starts when the request was read.
+enum class trace_stage : uint8_t
+{
+	greeting,			// accept -> method selection read
+	authentication,		// -> username / password checked
+	request,			// -> request read
+	dns,				// -> hostname resolved
+	connect,			// -> destination or upstream proxy connected
+	reply,				// -> reply sent
+	first_byte,			// -> first payload byte relayed, either way
+	total,				// accept -> first payload byte relayed
+	count
+};
+
+// Log-linear buckets over microseconds, in the manner of HdrHistogram: values
+// below 32 have a bucket each, and every power of two above that is split into
+// 16 buckets, so a bucket is never wider than 1/16 of its values.
+struct latency_histogram
+{
+	static constexpr size_t sub_buckets = 16;
+	static constexpr size_t max_magnitude = 32;	// values up to 2^37 microseconds, about 38 hours
+	static constexpr size_t bucket_count = sub_buckets * (max_magnitude + 2);
+
+	static size_t bucket_of(uint64_t microseconds);
+	static uint64_t lowest_value(size_t bucket);
+	static uint64_t highest_value(size_t bucket) { return lowest_value(bucket + 1) - 1; }
+
+	// Only the owning thread calls this.
+	void add(uint64_t microseconds);
+
+	std::array<std::atomic<uint64_t>, bucket_count> buckets{};
+	std::atomic<uint64_t> sum{};
+};
+
+void configure_tracing(size_t sample_every);
+bool tracing_enabled();
+
+// Timestamps of one connection. Moves from the handshake to the session that relays,
+// and adds its stages to the histograms of the calling thread when the first byte has
+// been relayed, or when it goes away before that.
+class connection_trace
+{
+public:
+	// Starts the clock if this connection is one of the sampled ones.
+	static connection_trace sample();
+
+	connection_trace() = default;
+	connection_trace(connection_trace &&other) noexcept : marks(other.marks), active(other.active) { other.active = false; }
+	connection_trace& operator=(connection_trace &&other) noexcept;
+	~connection_trace() { finish(); }
+
+	void mark(trace_stage stage) { if (active) marks[(size_t)stage] = std::chrono::steady_clock::now(); }
+	void first_byte() { if (active) { mark(trace_stage::first_byte); finish(); } }
+
+private:
+	void finish();
+
+	// marks[total] holds the time of accept.
+	std::array<std::chrono::steady_clock::time_point, (size_t)trace_stage::count> marks{};
+	bool active = false;
+};
+
+// Prometheus summaries of all threads, appended to render_metrics().
+void render_trace_metrics(std::string &output);
+
+// Human readable table of all threads, for SIGUSR1 and GET /trace on the metrics port.
+std::string render_trace_table();
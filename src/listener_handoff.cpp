@@ -0,0 +1,117 @@
+﻿#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "listener_handoff.hpp"
+
+int connect_handoff(const std::string &path, std::string &error)
+{
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+	{
+		error = "handoff socket path is too long";
+		return -1;
+	}
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (connection < 0)
+	{
+		error = std::string("socket: ") + std::strerror(errno);
+		return -1;
+	}
+
+	if (connect(connection, (const sockaddr *)&address, sizeof(address)) < 0)
+	{
+		// A path left behind by a process that has exited refuses the connection.
+		if (errno != ENOENT && errno != ECONNREFUSED)
+			error = "connect to " + path + ": " + std::strerror(errno);
+		close(connection);
+		return -1;
+	}
+	return connection;
+}
+
+bool send_listeners(int connection, const std::vector<int> &handles, std::string_view kinds, std::string &error)
+{
+	if (handles.empty() || handles.size() > max_handoff_sockets || handles.size() != kinds.size())
+	{
+		error = "nothing to hand over";
+		return false;
+	}
+
+	iovec payload = { (void *)kinds.data(), kinds.size() };
+	std::vector<char> control(CMSG_SPACE(sizeof(int) * handles.size()));
+	msghdr message = {};
+	message.msg_iov = &payload;
+	message.msg_iovlen = 1;
+	message.msg_control = control.data();
+	message.msg_controllen = control.size();
+
+	cmsghdr *header = CMSG_FIRSTHDR(&message);
+	header->cmsg_level = SOL_SOCKET;
+	header->cmsg_type = SCM_RIGHTS;
+	header->cmsg_len = CMSG_LEN(sizeof(int) * handles.size());
+	std::memcpy(CMSG_DATA(header), handles.data(), sizeof(int) * handles.size());
+
+	ssize_t sent;
+	do
+	{
+		sent = sendmsg(connection, &message, MSG_NOSIGNAL);
+	} while (sent < 0 && errno == EINTR);
+
+	if (sent != (ssize_t)kinds.size())
+	{
+		error = std::string("sendmsg: ") + (sent < 0 ? std::strerror(errno) : "short write");
+		return false;
+	}
+	return true;
+}
+
+bool receive_listeners(int connection, std::vector<int> &handles, std::string &kinds, std::string &error)
+{
+	std::string payload(max_handoff_sockets, '\0');
+	iovec buffer = { payload.data(), payload.size() };
+	std::vector<char> control(CMSG_SPACE(sizeof(int) * max_handoff_sockets));
+	msghdr message = {};
+	message.msg_iov = &buffer;
+	message.msg_iovlen = 1;
+	message.msg_control = control.data();
+	message.msg_controllen = control.size();
+
+	ssize_t received;
+	do
+	{
+		received = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+	} while (received < 0 && errno == EINTR);
+
+	if (received <= 0)
+	{
+		error = std::string("recvmsg: ") + (received < 0 ? std::strerror(errno) : "connection closed");
+		return false;
+	}
+
+	handles.clear();
+	for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+	{
+		if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+			continue;
+		size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		size_t offset = handles.size();
+		handles.resize(offset + count);
+		std::memcpy(handles.data() + offset, CMSG_DATA(header), sizeof(int) * count);
+	}
+
+	kinds = payload.substr(0, (size_t)received);
+	if (handles.size() != kinds.size() || (message.msg_flags & MSG_CTRUNC))
+	{
+		for (int handle : handles)
+			close(handle);
+		handles.clear();
+		error = "malformed handoff message";
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,26 @@
+﻿#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Passing listening sockets from a running socks5demo to the one replacing it
+// (--handoff-socket), over a Unix socket with SCM_RIGHTS. Linux only.
+//
+// 1. The new process connects to the old one's handoff socket.
+// 2. The old process sends its listening sockets, each tagged with one byte
+//    that says what it is for.
+// 3. The new process starts accepting on them and sends one byte back.
+// 4. Only then does the old process close its copies and drain its sessions.
+//
+// The listening sockets stay open throughout, so no connection is refused,
+// and if the new process dies before step 3 the old one simply carries on.
+
+constexpr char handoff_socks_listener = 'S';
+constexpr char handoff_metrics_listener = 'M';
+constexpr size_t max_handoff_sockets = 64;
+
+// Returns -1 and leaves `error` empty when no process is listening at `path`.
+int connect_handoff(const std::string &path, std::string &error);
+
+bool send_listeners(int connection, const std::vector<int> &handles, std::string_view kinds, std::string &error);
+bool receive_listeners(int connection, std::vector<int> &handles, std::string &kinds, std::string &error);
@@ -1,9 +1,52 @@
 ﻿#include <cstdio>
+#include <cstring>
+#include <csignal>
 #include <iostream>
 #include <array>
+#include <algorithm>
 #include <span>
 #include <optional>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <string_view>
+#include <unordered_map>
+#include <list>
+#include <mutex>
 #include <asio.hpp>
+#include "socks5_defines.hpp"
+#include "socks5_codec.hpp"
+#include "socks5_handshake.hpp"
+#include "dns_cache.hpp"
+#include "happy_eyeballs.hpp"
+#include "timer_wheel.hpp"
+#include "metrics.hpp"
+#include "slab_pool.hpp"
+#include "admission.hpp"
+#include "bandwidth.hpp"
+#include "upstream_pool.hpp"
+#include "credentials.hpp"
+#include "destination_acl.hpp"
+#include "access_log.hpp"
+#include "latency_trace.hpp"
+#include "udp_reassembly.hpp"
+#include "published.hpp"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include "listener_handoff.hpp"
+#endif
+
+#ifdef SOCKS5DEMO_IO_URING
+#include "io_uring_context.hpp"
+#endif
 
 using asio::ip::tcp;
 using asio::ip::udp;
@@ -16,430 +59,1461 @@ using tcp_socket = use_awaitable_t<>::as_default_on_t<tcp::socket>;
 using udp_socket = use_awaitable_t<>::as_default_on_t<udp::socket>;
 namespace this_coro = asio::this_coro;
 
-constexpr uint8_t socks_version = 0x05;
-
-// SOCKS5 Method Codes
-constexpr uint8_t socks_method_no_auth = 0;
-constexpr uint8_t socks_method_gssapi = 0x01;
-constexpr uint8_t socks_method_user_pwd = 0x02;
-constexpr uint8_t socks_method_unacceptable = 0xFF;
-
-// SOCKS5 Command Codes
-constexpr uint8_t socks_cmd_connect = 0x01;
-constexpr uint8_t socks_cmd_bind = 0x02;
-constexpr uint8_t socks_cmd_udp_associate = 0x03;
-
-// Address Types
-constexpr uint8_t socks_atyp_ipv4 = 0x01;
-constexpr uint8_t socks_atyp_domain = 0x03;
-constexpr uint8_t socks_atyp_ipv6 = 0x04;
-
-// SOCKS5 Reply Codes
-constexpr uint8_t socks_reply_success = 0x00;
-constexpr uint8_t socks_reply_general_failure = 0x01;
-constexpr uint8_t socks_reply_connection_not_allowed = 0x02;
-constexpr uint8_t socks_reply_network_unreachable = 0x03;
-constexpr uint8_t socks_reply_host_unreachable = 0x04;
-constexpr uint8_t socks_reply_connection_refused = 0x05;
-constexpr uint8_t socks_reply_ttl_expired = 0x06;
-constexpr uint8_t socks_reply_command_not_supported = 0x07;
-constexpr uint8_t socks_reply_address_type_not_supported = 0x08;
-
-constexpr unsigned int socks_header_ipv4_size = 10;
-constexpr unsigned int socks_header_ipv6_size = 22;
+// Same as asio::detached, but carries an allocator, so asio versions that
+// allocate co_spawn state through the completion handler use the slab pool.
+struct pooled_detached_t
+{
+	using allocator_type = slab_allocator<void>;
+	allocator_type get_allocator() const noexcept { return {}; }
+	void operator()(std::exception_ptr) const noexcept {}
+};
+constexpr pooled_detached_t pooled_detached{};
 
 constexpr auto expire_seconds = std::chrono::seconds(180);
 
+constexpr size_t relay_buffer_initial_size = 4096;
+constexpr size_t udp_datagram_buffer_size = 4096;
+constexpr size_t udp_gro_buffer_size = 65536;	// holds a whole run of segments coalesced by UDP_GRO
+constexpr size_t udp_gso_max_segments = 64;	// the least that any kernel with UDP_SEGMENT accepts
+constexpr size_t udp_gso_max_size = 65507;
+constexpr size_t udp_destination_table_size = 1024;
+constexpr auto udp_reassembly_timeout = std::chrono::seconds(5);	// RFC 1928 asks for no less than 5 seconds
+constexpr auto admission_retry_interval = std::chrono::milliseconds(10);
+constexpr auto accept_error_retry_interval = std::chrono::milliseconds(100);
+constexpr auto drain_poll_interval = std::chrono::milliseconds(100);
+constexpr auto pacing_slice = std::chrono::milliseconds(100);
+constexpr int tcp_fast_open_queue = 256;
+
 #ifdef __linux__	
 constexpr bool linux_system = true;
 #else
 constexpr bool linux_system = false;
 #endif
 
-uint8_t convert_error_code(asio::error_code ec);
+#ifdef __linux__
+constexpr int splice_pipe_size = 256 * 1024;
+#endif
 
-#pragma pack (push, 1)
-struct socks5_udp_packet_header
-{
-	uint16_t rsv;
-	uint8_t frag;
-	uint8_t address_type;
-};
+#ifdef SOCKS5DEMO_IO_URING
+constexpr bool io_uring_supported = true;
+#else
+constexpr bool io_uring_supported = false;
+#endif
 
-struct socks5_udp_packet_ipv4
+enum class relay_mode { copy, splice, uring };
+
+struct server_settings
 {
-	uint16_t rsv;
-	uint8_t frag;
-	uint8_t address_type;
-	uint8_t dst_addr[4];
-	uint16_t dst_port;
-	uint8_t data[1];
+	const char *username = nullptr;
+	const char *password = nullptr;
+	const char *credentials_file = nullptr;
+	const char *acl_file = nullptr;
+	const char *access_log_file = nullptr;
+	size_t access_log_buffer = 4096;
+	size_t trace_sample = 0;
+	const char *handoff_socket = nullptr;
+	std::vector<int> listen_fds;
+	std::chrono::seconds drain_timeout{ 60 };
+	uint16_t port = 1080;
+	size_t threads = 1;
+	bool cpu_affinity = false;
+	relay_mode relay = relay_mode::copy;
+	size_t relay_buffer_max = 64 * 1024;
+	size_t uring_buffers = 256;
+	std::chrono::seconds dns_ttl{ 60 };
+	std::chrono::seconds dns_negative_ttl{ 10 };
+	std::chrono::milliseconds connect_attempt_delay{ 250 };
+	size_t udp_batch = 1;
+	size_t udp_connected_sockets = 0;
+	bool udp_offload = false;
+	std::chrono::seconds handshake_timeout{ 30 };
+	std::chrono::seconds tcp_idle_timeout{ 600 };
+	std::chrono::seconds udp_idle_timeout{ expire_seconds };
+	uint16_t metrics_port = 0;
+	admission_control::limits admission_limits;
+	rate_limits session_rate;
+	rate_limits global_rate;
+	std::vector<std::pair<std::string, rate_limits>> user_rates;
+	std::optional<upstream_pool<tcp_socket>::config> upstream;
+	bool tcp_fast_open = false;
+	std::chrono::seconds tcp_defer_accept{ 0 };
+	bool tcp_nodelay = false;
 };
 
-struct socks5_udp_packet_ipv6
+server_settings settings;
+
+uint8_t convert_error_code(asio::error_code ec);
+
+published<asio::ip::address> tcp_local_address;
+thread_local published<asio::ip::address>::cache tcp_local_address_cache;
+
+// Each shard owns one io_context and is run by exactly one thread.
+// A session stays on the shard that accepted its connection.
+struct server_shard
 {
-	uint16_t rsv;
-	uint8_t frag;
-	uint8_t address_type;
-	uint8_t dst_addr[16];
-	uint16_t dst_port;
-	uint8_t data[1];
+	explicit server_shard(size_t index) :
+		io_context(1), index(index), dns(io_context.get_executor(), settings.dns_ttl, settings.dns_negative_ttl),
+		timers(io_context.get_executor())
+	{
+		timers.start();
+		if (settings.upstream.has_value())
+		{
+			upstream = std::make_unique<upstream_pool<tcp_socket>>(io_context.get_executor(), dns, *settings.upstream);
+			upstream->start();
+		}
+#ifdef SOCKS5DEMO_IO_URING
+		if (settings.relay == relay_mode::uring)
+		{
+			std::string error;
+			uring = io_uring_context::create(io_context.get_executor(), settings.uring_buffers, settings.relay_buffer_max, error);
+			if (uring != nullptr)
+				uring->start();
+			else
+				std::printf("Shard %zu: io_uring is not available (%s), relaying with copy\n", index, error.c_str());
+		}
+#endif
+	}
+
+	asio::io_context io_context;
+	size_t index;
+	size_t next_dispatch = 0;
+	dns_cache dns;
+	timer_wheel timers;
+	std::unique_ptr<upstream_pool<tcp_socket>> upstream;
+	std::vector<tcp_acceptor *> acceptors;	// closed when the process starts draining
+#ifdef SOCKS5DEMO_IO_URING
+	std::unique_ptr<io_uring_context> uring;
+#endif
 };
-#pragma pack(pop)
 
-std::shared_ptr<asio::ip::address> tcp_local_address;
+std::vector<std::unique_ptr<server_shard>> shards;
+thread_local server_shard *current_shard = nullptr;
+
+// Set once the listeners have been handed to a new process.
+std::atomic<bool> draining{ false };
+
+// The listening sockets of all shards, for a handoff.
+std::mutex listener_mutex;
+std::vector<tcp_acceptor::native_handle_type> listener_handles;
+
+#if defined(SO_REUSEPORT_LB)
+constexpr bool reuse_port_supported = true;
+using reuse_port_option = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT_LB>;
+#elif defined(__linux__)
+constexpr bool reuse_port_supported = true;
+using reuse_port_option = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#else
+constexpr bool reuse_port_supported = false;
+#endif
+
+#ifdef TCP_FASTOPEN
+using fast_open_option = asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN>;
+#endif
+#ifdef TCP_FASTOPEN_CONNECT
+using fast_open_connect_option = asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>;
+#endif
+#ifdef TCP_DEFER_ACCEPT
+using defer_accept_option = asio::detail::socket_option::integer<IPPROTO_TCP, TCP_DEFER_ACCEPT>;
+#endif
+#ifdef __linux__
+// C libraries older than glibc 2.29 lack these, while the kernel may still have them.
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+using udp_segment_option = asio::detail::socket_option::integer<SOL_UDP, UDP_SEGMENT>;
+using udp_gro_option = asio::detail::socket_option::boolean<SOL_UDP, UDP_GRO>;
+#endif
+
+// Waits out a delay returned by traffic_shaper::consume(). The wait is cut
+// into slices so that a session closed in the meantime does not linger.
+template<typename Socket>
+awaitable<void> pace(asio::steady_timer &timer, const Socket &socket, std::chrono::nanoseconds delay)
+{
+	asio::error_code ec;
+	auto deadline = std::chrono::steady_clock::now() + delay;
+	for (auto now = std::chrono::steady_clock::now(); socket.is_open() && now < deadline; now = std::chrono::steady_clock::now())
+	{
+		timer.expires_at(std::min<std::chrono::steady_clock::time_point>(deadline, now + pacing_slice));
+		co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+	}
+}
 
 class tcp_session : public std::enable_shared_from_this<tcp_session>
 {
 public:
-	tcp_session(tcp_socket local_socket, tcp_socket remote_socket) :
-		local_socket(std::move(local_socket)), remote_socket(std::move(remote_socket)) {}
+	tcp_session(tcp_socket local_socket, tcp_socket remote_socket, access_log_entry access, connection_trace trace, directional_limiter *user_limiter = nullptr) :
+		local_socket(std::move(local_socket)), remote_socket(std::move(remote_socket)), shaper(user_limiter), access(std::move(access)), trace(std::move(trace)) {}
 
 	void start()
 	{
+		idle = current_shard->timers.add(settings.tcp_idle_timeout, [weak = weak_from_this()]
+			{
+				if (auto self = weak.lock())
+					self->stop();
+			});
+
+		if (settings.tcp_nodelay)
+		{
+			asio::error_code ec;
+			local_socket.set_option(tcp::no_delay(true), ec);
+			remote_socket.set_option(tcp::no_delay(true), ec);
+		}
+
+#ifdef SOCKS5DEMO_IO_URING
+		if (settings.relay == relay_mode::uring)
+		{
+			co_spawn(local_socket.get_executor(),
+				[self = shared_from_this()] { return self->uring_relay(self->local_socket, self->remote_socket); },
+				pooled_detached);
+
+			co_spawn(local_socket.get_executor(),
+				[self = shared_from_this()] { return self->uring_relay(self->remote_socket, self->local_socket); },
+				pooled_detached);
+			return;
+		}
+#endif
+#ifdef __linux__
+		if (settings.relay == relay_mode::splice)
+		{
+			co_spawn(local_socket.get_executor(),
+				[self = shared_from_this()] { return self->splice_relay(self->local_socket, self->remote_socket); },
+				pooled_detached);
+
+			co_spawn(local_socket.get_executor(),
+				[self = shared_from_this()] { return self->splice_relay(self->remote_socket, self->local_socket); },
+				pooled_detached);
+			return;
+		}
+#endif
 		co_spawn(local_socket.get_executor(),
-			[self = shared_from_this()] { return self->reader(); },
-			detached);
+			[self = shared_from_this()] { return self->copy_relay(self->local_socket, self->remote_socket); },
+			pooled_detached);
 
 		co_spawn(local_socket.get_executor(),
-			[self = shared_from_this()] { return self->writer(); },
-			detached);
+			[self = shared_from_this()] { return self->copy_relay(self->remote_socket, self->local_socket); },
+			pooled_detached);
 	}
 
 private:
-	awaitable<void> reader()
+#ifdef __linux__
+	struct splice_pipe
+	{
+		splice_pipe() { if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) fds[0] = fds[1] = -1; }
+		~splice_pipe() { if (fds[0] >= 0) { close(fds[0]); close(fds[1]); } }
+		splice_pipe(const splice_pipe &) = delete;
+		splice_pipe& operator=(const splice_pipe &) = delete;
+		int fds[2];
+	};
+
+	// Moves data socket -> pipe -> socket inside the kernel.
+	// Falls back to the copy loop if splice() is not usable on these sockets.
+	awaitable<void> splice_relay(tcp_socket &from, tcp_socket &to)
 	{
-		std::array<uint8_t, 4096> data = {};
 		asio::error_code ec;
-		while (true)
+		splice_pipe pipe;
+		admission_control::relay_reservation memory(admission);
+		bool fallback = pipe.fds[0] < 0 || !memory.try_reserve(splice_pipe_size);
+		if (!fallback)
 		{
-			size_t n = co_await local_socket.async_read_some(asio::buffer(data), asio::redirect_error(asio::use_awaitable, ec));
-			if (ec)
+			fcntl(pipe.fds[1], F_SETPIPE_SZ, splice_pipe_size);
+			from.non_blocking(true, ec);
+			to.non_blocking(true, ec);
+			fallback = static_cast<bool>(ec);
+		}
+
+		size_t bytes_in_pipe = 0;
+		bool relayed = false;
+		metric_direction direction = direction_of(from);
+		asio::steady_timer pacing(from.get_executor());
+		std::chrono::nanoseconds delay = std::chrono::nanoseconds::zero();
+		while (!fallback)
+		{
+			if (bytes_in_pipe == 0)
 			{
-				stop();
-				break;
+				if (delay.count() > 0)
+				{
+					co_await pace(pacing, from, delay);
+					delay = std::chrono::nanoseconds::zero();
+				}
+
+				size_t splice_size = shaper.max_read(direction, splice_pipe_size);
+				ssize_t n = splice(from.native_handle(), nullptr, pipe.fds[1], nullptr, splice_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (n == 0)
+					break;
+
+				if (n < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					if (errno == EAGAIN)
+					{
+						co_await from.async_wait(tcp::socket::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+						if (ec)
+							break;
+						continue;
+					}
+					fallback = !relayed && (errno == EINVAL || errno == ENOSYS);
+					break;
+				}
+
+				bytes_in_pipe = (size_t)n;
+				relayed = true;
+				idle.touch();
+				metric_bytes(false, direction, (size_t)n);
+				access.add_bytes(direction, (size_t)n);
+				trace.first_byte();
+				delay = shaper.consume(direction, (size_t)n);
 			}
 
-			if (n == 0)
+			ssize_t n = splice(pipe.fds[0], nullptr, to.native_handle(), nullptr, bytes_in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN)
+					break;
+				co_await to.async_wait(tcp::socket::wait_write, asio::redirect_error(asio::use_awaitable, ec));
+				if (ec)
+					break;
 				continue;
+			}
+			bytes_in_pipe -= (size_t)n;
+		}
 
-			co_await remote_socket.async_write_some(asio::buffer(data, n), asio::redirect_error(asio::use_awaitable, ec));
-			if (ec)
+		if (fallback)
+		{
+			co_await copy_relay(from, to);
+			co_return;
+		}
+
+		stop();
+	}
+#endif
+
+#ifdef SOCKS5DEMO_IO_URING
+	// Reads and writes through the shard's io_uring, using one of its registered buffers.
+	// Falls back to the copy loop if the ring is not available or all of its buffers are taken.
+	awaitable<void> uring_relay(tcp_socket &from, tcp_socket &to)
+	{
+		io_uring_context *ring = current_shard->uring.get();
+		std::optional<io_uring_context::buffer> slot;
+		if (ring != nullptr)
+			slot = ring->acquire_buffer();
+		if (!slot.has_value())
+		{
+			co_await copy_relay(from, to);
+			co_return;
+		}
+
+		// The sockets belong to asio and stay in non-blocking mode, so the ring reports EAGAIN
+		// instead of waiting for data. A read that did not fill the buffer has most likely
+		// drained the socket: the next one waits for readiness inside the ring first.
+		// stop() shuts the sockets down, which ends that wait.
+		asio::error_code ec;
+		metric_direction direction = direction_of(from);
+		asio::steady_timer pacing(from.get_executor());
+		bool drained = false;
+		while (true)
+		{
+			size_t wanted = shaper.max_read(direction, slot->data.size());
+			int n = drained ?
+				co_await ring->read_fixed_when_readable(from.native_handle(), *slot, 0, wanted) :
+				co_await ring->read_fixed(from.native_handle(), *slot, 0, wanted);
+			if (n == -EAGAIN || n == -EINTR)
+			{
+				drained = true;
+				continue;
+			}
+			if (n <= 0)
+				break;
+			drained = (size_t)n < wanted;
+
+			idle.touch();
+			metric_bytes(false, direction, (size_t)n);
+			access.add_bytes(direction, (size_t)n);
+			trace.first_byte();
+
+			size_t written = 0;
+			while (written < (size_t)n)
 			{
-				stop();
+				int sent = co_await ring->write_fixed(to.native_handle(), *slot, written, (size_t)n - written);
+				if (sent == -EAGAIN || sent == -EINTR)
+				{
+					co_await to.async_wait(tcp::socket::wait_write, asio::redirect_error(asio::use_awaitable, ec));
+					if (ec)
+						break;
+					continue;
+				}
+				if (sent <= 0)
+					break;
+				written += (size_t)sent;
+			}
+			if (written < (size_t)n)
 				break;
+
+			if (std::chrono::nanoseconds delay = shaper.consume(direction, (size_t)n); delay.count() > 0)
+			{
+				co_await pace(pacing, from, delay);
+				idle.touch();
 			}
 		}
+
+		ring->release_buffer(*slot);
+		stop();
 	}
+#endif
 
-	awaitable<void> writer()
+	// Double-buffered relay: chunk N+1 is read while chunk N is still being written.
+	// Buffers start at relay_buffer_initial_size and double whenever a read fills
+	// them completely, up to settings.relay_buffer_max and within the relay memory budget.
+	awaitable<void> copy_relay(tcp_socket &from, tcp_socket &to)
 	{
-		std::array<uint8_t, 4096> data = {};
-		asio::error_code ec;
+		size_t initial_size = std::min(relay_buffer_initial_size, settings.relay_buffer_max);
+		std::array<std::vector<uint8_t>, 2> buffers;
+		buffers[0].resize(initial_size);
+		buffers[1].resize(initial_size);
+		admission_control::relay_reservation memory(admission);
+		memory.reserve(initial_size * 2);
+		asio::steady_timer write_done(from.get_executor());
+		asio::steady_timer pacing(from.get_executor());
+		asio::error_code ec, write_ec;
+		bool writing = false;
+		size_t current = 0;
+		metric_direction direction = direction_of(from);
+
 		while (true)
 		{
-			size_t n = co_await remote_socket.async_read_some(asio::buffer(data), asio::redirect_error(asio::use_awaitable, ec));
+			std::vector<uint8_t> &buffer = buffers[current];
+			size_t n = co_await from.async_read_some(asio::buffer(buffer.data(), shaper.max_read(direction, buffer.size())), asio::redirect_error(asio::use_awaitable, ec));
 			if (ec)
-			{
-				stop();
 				break;
-			}
 
 			if (n == 0)
 				continue;
 
-			co_await local_socket.async_write_some(asio::buffer(data, n), asio::redirect_error(asio::use_awaitable, ec));
-			if (ec)
+			idle.touch();
+			metric_bytes(false, direction, n);
+			access.add_bytes(direction, n);
+			trace.first_byte();
+			while (writing)
 			{
-				stop();
+				write_done.expires_at(asio::steady_timer::time_point::max());
+				co_await write_done.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+			}
+
+			if (write_ec)
 				break;
+
+			writing = true;
+			asio::async_write(to, asio::buffer(buffer.data(), n),
+				[&writing, &write_ec, &write_done](const asio::error_code &e, size_t)
+				{
+					writing = false;
+					write_ec = e;
+					write_done.cancel();
+				});
+
+			current ^= 1;
+			std::vector<uint8_t> &next_buffer = buffers[current];
+			if (n == buffer.size() && next_buffer.size() < settings.relay_buffer_max)
+			{
+				size_t new_size = std::min(buffer.size() * 2, settings.relay_buffer_max);
+				if (memory.try_reserve(new_size - next_buffer.size()))
+					next_buffer.resize(new_size);
+			}
+			else if (next_buffer.size() > initial_size && admission.relay_memory_exceeded())
+			{
+				// Over the memory budget: give back everything above the initial size.
+				memory.release(next_buffer.size() - initial_size);
+				next_buffer = std::vector<uint8_t>(initial_size);
+			}
+
+			// The next read waits while the session is over its rate, so the kernel buffers fill up
+			// and TCP flow control slows the sender down. The pending write continues meanwhile.
+			if (std::chrono::nanoseconds delay = shaper.consume(direction, n); delay.count() > 0)
+			{
+				co_await pace(pacing, from, delay);
+				idle.touch();
 			}
 		}
+
+		stop();
+
+		// The write handler refers to this frame, so it must finish first.
+		while (writing)
+		{
+			write_done.expires_at(asio::steady_timer::time_point::max());
+			co_await write_done.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+		}
+	}
+
+	metric_direction direction_of(const tcp_socket &from) const
+	{
+		return &from == &local_socket ? metric_direction::upload : metric_direction::download;
 	}
 
 	void stop()
 	{
 		asio::error_code ec;
+		if (settings.relay == relay_mode::uring)
+		{
+			// Requests for these descriptors may still be queued in the ring, so they stay
+			// open until the session goes away. shutdown() ends every pending request.
+			local_socket.shutdown(tcp::socket::shutdown_both, ec);
+			remote_socket.shutdown(tcp::socket::shutdown_both, ec);
+			return;
+		}
 		local_socket.close(ec);
 		remote_socket.close(ec);
 	}
 
 	tcp_socket local_socket;
 	tcp_socket remote_socket;
+	traffic_shaper shaper;
+	timer_wheel::timeout idle;
+	access_log_entry access;
+	connection_trace trace;
+	metric_gauge gauge{ metric_session::tcp };
+	admission_control::ticket session_ticket{ admission.sessions };
 };
 
 class tcp_binding : public std::enable_shared_from_this<tcp_binding>
 {
 public:
-	tcp_binding(tcp_socket client_socket, tcp_acceptor acceptor) :
-		timer(client_socket.get_executor()), client_socket(std::move(client_socket)), acceptor(std::move(acceptor)){};
+	tcp_binding(tcp_socket client_socket, tcp_acceptor acceptor, access_log_entry access, directional_limiter *user_limiter = nullptr) :
+		client_socket(std::move(client_socket)), acceptor(std::move(acceptor)), user_limiter(user_limiter), access(std::move(access)) {};
 
 	void start(std::array<uint8_t, 32> reply)
 	{
-		co_spawn(client_socket.get_executor(),
-			[self = shared_from_this()] { return self->watchdog(); },
-			detached);
+		deadline = current_shard->timers.add(expire_seconds, [weak = weak_from_this()]
+			{
+				asio::error_code ec;
+				if (auto self = weak.lock())
+					self->acceptor.cancel(ec);
+			});
 		co_spawn(client_socket.get_executor(),
 			[self = shared_from_this(), reply] { return self->handle_bind_request(reply); },
-			detached);
+			pooled_detached);
 	}
 private:
-	awaitable<void> watchdog()
-	{
-		asio::error_code ec;
-		auto now = std::chrono::steady_clock::now();
-		std::chrono::steady_clock::time_point deadline = now + expire_seconds;
-		while (deadline > now)
-		{
-			timer.expires_at(deadline);
-			co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
-			if (ec)
-				co_return;
-			now = std::chrono::steady_clock::now();
-		}
-		ec.clear();
-		acceptor.cancel(ec);
-	}
-
 	awaitable<void> handle_bind_request(std::array<uint8_t, 32> reply)
 	{
 		asio::error_code ec;
 		try
 		{
-			unsigned int reply_size = 0;
+			size_t reply_size = reply[3] == socks_atyp_ipv6 ? socks_header_ipv6_size : socks_header_ipv4_size;
 			tcp_socket listener_socket = co_await acceptor.async_accept(asio::redirect_error(asio::use_awaitable, ec));
 			if (ec)
 			{
 				reply[1] = convert_error_code(ec);
+				metric_reply(reply[1]);
+				access.set_reply(reply[1]);
 				co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
 				co_return;
 			}
 
 			tcp::endpoint remote_endpoint = listener_socket.remote_endpoint();
-			asio::ip::address remote_address = remote_endpoint.address();
-			uint16_t remote_port = remote_endpoint.port();
-			if (remote_address.is_v6())
-			{
-				reply_size = socks_header_ipv6_size;
-				reply[3] = socks_atyp_ipv6;
-				asio::ip::address_v6::bytes_type v6_bytes = remote_address.to_v6().to_bytes();
-				std::copy(v6_bytes.begin(), v6_bytes.end(), reply.begin() + 4);
-				*(uint16_t *)(reply.data() + 20) = htons(remote_port);
-
-			}
-			else
-			{
-				reply_size = socks_header_ipv4_size;
-				reply[3] = socks_atyp_ipv4;
-				asio::ip::address_v4::bytes_type v4_bytes = remote_address.to_v4().to_bytes();
-				*(uint32_t *)(reply.data() + 4) = *(uint32_t *)v4_bytes.data();
-				*(uint16_t *)(reply.data() + 8) = htons(remote_port);
-			}
+			reply_size = encode_reply(socks_reply_success, remote_endpoint.address(), remote_endpoint.port(), reply);
 
 			// BIND: Second Reply
+			metric_reply(reply[1]);
+			access.set_reply(reply[1]);
 			co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
 
 			// 5. Forward Traffic
-			std::make_shared<tcp_session>(std::move(client_socket), std::move(listener_socket))->start();
+			make_pooled<tcp_session>(std::move(client_socket), std::move(listener_socket), std::move(access), connection_trace(), user_limiter)->start();
 		}
 		catch (std::exception &e)
 		{
 			std::printf("TCP BIND Exception: %s\n", e.what());
 		}
-		ec.clear();
-		timer.cancel(ec);
+		deadline.cancel();
 	}
 
-	asio::steady_timer timer;
+	timer_wheel::timeout deadline;
 	tcp_socket client_socket;
 	tcp_acceptor acceptor;
+	directional_limiter *user_limiter;
+	access_log_entry access;
+	metric_gauge gauge{ metric_session::tcp_binding };
+	admission_control::ticket session_ticket{ admission.sessions };
+};
+
+struct udp_endpoint_hash
+{
+	size_t operator()(const udp::endpoint &endpoint) const noexcept
+	{
+		size_t value = endpoint.port();
+		asio::ip::address address = endpoint.address();
+		if (address.is_v4())
+			return value ^ (std::hash<uint32_t>{}(address.to_v4().to_uint()) << 1);
+
+		asio::ip::address_v6::bytes_type v6_bytes = address.to_v6().to_bytes();
+		std::string_view bytes_view((const char *)v6_bytes.data(), v6_bytes.size());
+		return value ^ (std::hash<std::string_view>{}(bytes_view) << 1);
+	}
 };
 
 class udp_session : public std::enable_shared_from_this<udp_session>
 {
 public:
-	udp_session(tcp_socket request_socket, udp_socket listener_socket) :
+	udp_session(tcp_socket request_socket, udp_socket listener_socket, access_log_entry access, directional_limiter *user_limiter = nullptr) :
 		request_socket(std::move(request_socket)), listener_socket(std::move(listener_socket)),
-		forwarder_socket(listener_socket.get_executor(), udp::endpoint()) {}
+		forwarder_socket(open_forwarder(this->request_socket.get_executor())), shaper(user_limiter), access(std::move(access)) {}
 
 	void start()
 	{
+		idle = current_shard->timers.add(settings.udp_idle_timeout, [weak = weak_from_this()]
+			{
+				if (auto self = weak.lock())
+					self->stop();
+			});
+
+		co_spawn(request_socket.get_executor(),
+			[self = shared_from_this()] { return self->control_watcher(); },
+			pooled_detached);
+
+#ifdef __linux__
+		if (settings.udp_batch > 1 || settings.udp_offload)
+		{
+			co_spawn(request_socket.get_executor(),
+				[self = shared_from_this()] { return self->batch_reader(); },
+				pooled_detached);
+
+			co_spawn(request_socket.get_executor(),
+				[self = shared_from_this()] { return self->batch_writer(); },
+				pooled_detached);
+			return;
+		}
+#endif
 		co_spawn(request_socket.get_executor(),
 			[self = shared_from_this()] { return self->reader(); },
-			detached);
+			pooled_detached);
 
 		co_spawn(request_socket.get_executor(),
 			[self = shared_from_this()] { return self->writer(); },
-			detached);
+			pooled_detached);
 	}
 
 private:
-	awaitable<void> reader()
+	// The association ends when the client closes the TCP connection that requested it.
+	awaitable<void> control_watcher()
 	{
-		std::array<uint8_t, 4096> data = {};
-		udp::endpoint from_udp_endpoint;
-
-		while(request_socket.is_open())
-		{
-			asio::error_code ec;
-			std::string hostname;
-			uint16_t port = 0;
-			size_t bytes_read = co_await listener_socket.async_receive_from(asio::buffer(data), from_udp_endpoint, asio::redirect_error(asio::use_awaitable, ec));
-			if (ec)
-				break;
-			if (bytes_read <= 4)
-				continue;
-			client_udp_endpoint = from_udp_endpoint;
+		std::array<uint8_t, 64> data = {};
+		asio::error_code ec;
+		while (!ec)
+			co_await request_socket.async_read_some(asio::buffer(data), asio::redirect_error(asio::use_awaitable, ec));
+		stop();
+	}
 
-			std::unique_ptr<udp::endpoint> remote_udp_endpoint;
-			std::span<uint8_t> client_data = {};
-			socks5_udp_packet_header *udp_raw_data = (socks5_udp_packet_header *)data.data();
-			if (udp_raw_data->frag) // Too cumbersome to implement
-				continue;
+	// One remote peer of the association, keyed by its IPv4 or IPv6 endpoint.
+	// reply_header is the SOCKS5 header that is put in front of every datagram from this peer.
+	// connected_socket is set when the peer has its own socket, see settings.udp_connected_sockets.
+	struct udp_destination
+	{
+		udp::endpoint endpoint;
+		std::array<uint8_t, 32> reply_header = {};
+		size_t reply_header_size = 0;
+		std::unique_ptr<udp_socket> connected_socket;
+	};
 
-			switch (udp_raw_data->address_type)
-			{
-			case socks_atyp_ipv4:
-			{
-				if (bytes_read <= socks_header_ipv4_size)
-					continue;
+	// Most recently used first, so the table evicts from the back.
+	using destination_list = std::list<std::shared_ptr<udp_destination>>;
 
-				socks5_udp_packet_ipv4 *udp_v4_raw_data = (socks5_udp_packet_ipv4 *)data.data();
-				asio::ip::address_v4::bytes_type address_bytes;
-				*(uint32_t *)address_bytes.data() = *(uint32_t *)udp_v4_raw_data->dst_addr;
-				asio::ip::address_v4 address(address_bytes);
-				uint16_t port = ntohs(udp_v4_raw_data->dst_port);
-				remote_udp_endpoint = std::make_unique<udp::endpoint>(address, port);
-				client_data = std::span<uint8_t>((uint8_t *)udp_v4_raw_data->data, data.data() + bytes_read);	// extract client data from UDP Packet
-				break;
-			}
-			case socks_atyp_ipv6:
-			{
-				if (bytes_read <= socks_header_ipv6_size)
-					continue;
-		
-				socks5_udp_packet_ipv6 *udp_v6_raw_data = (socks5_udp_packet_ipv6 *)data.data();
-				asio::ip::address_v6::bytes_type address_bytes;
-				std::copy(std::begin(udp_v6_raw_data->dst_addr), std::end(udp_v6_raw_data->dst_addr), address_bytes.begin());
-				asio::ip::address_v6 address(address_bytes);
-				uint16_t port = ntohs(udp_v6_raw_data->dst_port);
-				remote_udp_endpoint = std::make_unique<udp::endpoint>(address, port);
-				client_data = std::span<uint8_t>((uint8_t *)udp_v6_raw_data->data, data.data() + bytes_read);	// extract client data from UDP Packet
-				break;
-			}
-			case socks_atyp_domain:
-			{
-				if (bytes_read <= socks_header_ipv4_size)
-					continue;
+	// A dual-stack socket reaches IPv4 and IPv6 peers alike.
+	static udp_socket open_forwarder(const asio::any_io_executor &executor)
+	{
+		asio::error_code ec;
+		udp_socket socket(executor);
+		socket.open(udp::v6(), ec);
+		if (!ec)
+			socket.set_option(asio::ip::v6_only(false), ec);
+		if (!ec)
+			socket.bind(udp::endpoint(udp::v6(), 0), ec);
+		if (!ec)
+			return socket;
+
+		socket.close(ec);
+		return udp_socket(executor, udp::endpoint(udp::v4(), 0));
+	}
 
-				size_t domain_length = data[4];
-				constexpr size_t header_size = sizeof(socks5_udp_packet_header);
-				if (bytes_read <= header_size + 1 + domain_length + 2)
-					continue;
+	static udp::endpoint unmapped(const udp::endpoint &endpoint)
+	{
+		asio::ip::address address = endpoint.address();
+		if (address.is_v6() && address.to_v6().is_v4_mapped())
+			return udp::endpoint(asio::ip::make_address_v4(asio::ip::v4_mapped, address.to_v6()), endpoint.port());
+		return endpoint;
+	}
 
-				uint8_t *domain_ptr_starts = &data[5];
-				uint8_t *port_ptr_starts = domain_ptr_starts + domain_length;
-				hostname = std::string(domain_ptr_starts, domain_ptr_starts + domain_length);
-				port = ntohs(*(uint16_t *)port_ptr_starts);
+	udp::endpoint forwarder_endpoint(const udp::endpoint &endpoint) const
+	{
+		if (endpoint.address().is_v4() && forwarder_is_v6)
+			return udp::endpoint(asio::ip::make_address_v6(asio::ip::v4_mapped, endpoint.address().to_v4()), endpoint.port());
+		return endpoint;
+	}
 
-				udp::resolver resolver(request_socket.get_executor());
-				udp::resolver::results_type endpoints = co_await resolver.async_resolve(hostname, std::to_string(port), asio::redirect_error(asio::use_awaitable, ec));
-				if (ec || endpoints.empty())
-					continue;
+	// Moves a destination to the front of the table. Returns end() for a peer that is not in it.
+	auto touch_destination(const udp::endpoint &endpoint)
+	{
+		auto iter = destinations.find(endpoint);
+		if (iter != destinations.end())
+			recency.splice(recency.begin(), recency, iter->second);
+		return iter;
+	}
 
-				// starting from ASIO 1.31, the endpoints can be connected directly:
-				// udp::endpoint connected_endpoint = co_await asio::async_connect(forwarder_socket, endpoints, asio::redirect_error(asio::use_awaitable, ec));
-				for (auto &&endpoint : endpoints)
-				{
-					co_await forwarder_socket.async_connect(endpoint, asio::redirect_error(asio::use_awaitable, ec));
-					if (!ec)
-					{
-						remote_udp_endpoint = std::make_unique<udp::endpoint>(endpoint.endpoint());
-						break;
-					}
-				}
+	// The destination of a datagram from the client, added to the table if it is new.
+	std::shared_ptr<udp_destination> find_destination(const udp::endpoint &endpoint)
+	{
+		if (auto iter = touch_destination(endpoint); iter != destinations.end())
+			return *iter->second;
 
-				if (ec)
-					continue;
+		std::shared_ptr<udp_destination> destination = make_pooled<udp_destination>();
+		destination->endpoint = endpoint;
+		destination->reply_header_size = encode_udp_header(endpoint.address(), endpoint.port(), destination->reply_header);
+		if (destination->reply_header_size == 0)
+			return nullptr;
 
-				uint8_t *client_data_ptr_starts = port_ptr_starts + 2;
-				client_data = std::span<uint8_t>(client_data_ptr_starts, data.data() + bytes_read);	// extract client data from UDP Packet
+		if (destinations.size() >= udp_destination_table_size)
+			evict_destination();
 
-				break;
-			}
-			default:
-				continue;
-			}
+		if (connected_destinations < settings.udp_connected_sockets)
+			connect_destination(destination);
 
-			if (remote_udp_endpoint == nullptr)
-				continue;
+		recency.push_front(destination);
+		destinations.emplace(endpoint, recency.begin());
+		return destination;
+	}
 
-			co_await forwarder_socket.async_send_to(asio::buffer(client_data.data(), client_data.size()), *remote_udp_endpoint, asio::redirect_error(asio::use_awaitable, ec));
+	// Writes the SOCKS5 header of a datagram from `sender` into `header`, and returns its size.
+	// A peer that the client never wrote to gets its header built on the spot instead of a table
+	// entry, so unsolicited senders cannot push the client's own destinations out.
+	size_t reply_header(const udp::endpoint &sender, std::array<uint8_t, 32> &header)
+	{
+		if (auto iter = touch_destination(sender); iter != destinations.end())
+		{
+			const udp_destination &destination = **iter->second;
+			header = destination.reply_header;
+			return destination.reply_header_size;
 		}
-		stop();
+		return encode_udp_header(sender.address(), sender.port(), header);
 	}
 
-	awaitable<void> writer()
+	void evict_destination()
 	{
-		std::array<uint8_t, 4096> data = {};
+		if (recency.empty())
+			return;
 
-		while (request_socket.is_open())
+		std::shared_ptr<udp_destination> &oldest = recency.back();
+		if (oldest->connected_socket != nullptr)
 		{
-			udp::endpoint remote_udp_endpoint;
 			asio::error_code ec;
-			size_t bytes_read = co_await forwarder_socket.async_receive_from(asio::buffer(data), remote_udp_endpoint, asio::redirect_error(asio::use_awaitable, ec));
-			if (ec)
-				break;
-
-			std::array<uint8_t, 32> socks5_header_raw = {};
-			size_t header_size = 0;
-			asio::ip::address remote_address = remote_udp_endpoint.address();
-			uint16_t port = remote_udp_endpoint.port();
-			if (remote_address.is_v4())
-			{
-				socks5_udp_packet_ipv4 *socks5_header = (socks5_udp_packet_ipv4 *)socks5_header_raw.data();
-				socks5_header->address_type = socks_atyp_ipv4;
-				header_size = socks_header_ipv4_size;
-
-				asio::ip::address_v4::bytes_type v4_bytes = remote_address.to_v4().to_bytes();
-				*(uint32_t *)socks5_header->dst_addr = *(uint32_t *)v4_bytes.data();
-				socks5_header->dst_port = htons(port);
-
-			}
-			else if (remote_address.is_v6())
-			{
-				socks5_udp_packet_ipv6 *socks5_header = (socks5_udp_packet_ipv6 *)socks5_header_raw.data();
-				socks5_header->address_type = socks_atyp_ipv4;
-				header_size = socks_header_ipv6_size;
-
-				asio::ip::address_v6::bytes_type v6_bytes = remote_address.to_v6().to_bytes();
-				std::copy(v6_bytes.begin(), v6_bytes.end(), std::begin(socks5_header->dst_addr));
-				socks5_header->dst_port = htons(port);
-			}
-			else continue;
-
-			std::array<asio::const_buffer, 2> reply_buffers = 
-			{
-				asio::buffer(socks5_header_raw.data(), header_size),
-				asio::buffer(data.data(), bytes_read)
-			};
-			co_await listener_socket.async_send_to(reply_buffers, client_udp_endpoint, asio::redirect_error(asio::use_awaitable, ec));
+			oldest->connected_socket->close(ec);
+			connected_destinations--;
 		}
-		stop();
+		destinations.erase(oldest->endpoint);
+		recency.pop_back();
 	}
 
-	void stop()
+	// Gives the destination its own connected socket, so the kernel looks up the route once.
+	void connect_destination(std::shared_ptr<udp_destination> destination)
 	{
 		asio::error_code ec;
-		request_socket.close(ec);
-		listener_socket.close(ec);
+		auto socket = std::make_unique<udp_socket>(request_socket.get_executor());
+		socket->open(destination->endpoint.protocol(), ec);
+		if (!ec)
+			socket->connect(destination->endpoint, ec);
+		if (ec)
+			return;
+
+		destination->connected_socket = std::move(socket);
+		connected_destinations++;
+		co_spawn(request_socket.get_executor(),
+			[self = shared_from_this(), destination] { return self->destination_reader(destination); },
+			pooled_detached);
 	}
 
-	tcp_socket request_socket;
-	udp_socket listener_socket;
-	udp_socket forwarder_socket;
-	udp::endpoint client_udp_endpoint;
-};
+	// Datagrams that arrive while a direction is paced wait in the socket buffer,
+	// and the kernel drops them once it is full.
+	awaitable<void> pace_datagrams(asio::steady_timer &pacing, metric_direction direction, size_t bytes)
+	{
+		if (std::chrono::nanoseconds delay = shaper.consume(direction, bytes); delay.count() > 0)
+			co_await pace(pacing, request_socket, delay);
+	}
+
+	awaitable<void> destination_reader(std::shared_ptr<udp_destination> destination)
+	{
+		std::array<uint8_t, udp_datagram_buffer_size> data = {};
+		asio::steady_timer pacing(request_socket.get_executor());
+		udp_socket &socket = *destination->connected_socket;
+		while (request_socket.is_open() && socket.is_open())
+		{
+			asio::error_code ec;
+			size_t bytes_read = co_await socket.async_receive(asio::buffer(data), asio::redirect_error(asio::use_awaitable, ec));
+			if (ec)
+				break;
+
+			// An evicted destination has its socket closed, and the endpoint may be in the table again by now.
+			if (socket.is_open())
+				touch_destination(destination->endpoint);
+			idle.touch();
+			metric_bytes(true, metric_direction::download, bytes_read);
+			access.add_bytes(metric_direction::download, bytes_read);
+			co_await send_to_client(std::span<const uint8_t>(destination->reply_header.data(), destination->reply_header_size), std::span<uint8_t>(data.data(), bytes_read));
+			if (shaper.active(metric_direction::download))
+				co_await pace_datagrams(pacing, metric_direction::download, bytes_read);
+		}
+	}
+
+	awaitable<void> send_to_client(std::span<const uint8_t> reply_header, std::span<uint8_t> data)
+	{
+		asio::error_code ec;
+		std::array<asio::const_buffer, 2> reply_buffers =
+		{
+			asio::buffer(reply_header.data(), reply_header.size()),
+			asio::buffer(data.data(), data.size())
+		};
+		co_await listener_socket.async_send_to(reply_buffers, client_udp_endpoint, asio::redirect_error(asio::use_awaitable, ec));
+	}
+
+	template<typename ConstBufferSequence>
+	awaitable<void> send_to_destination(const udp_destination &destination, const ConstBufferSequence &client_data)
+	{
+		asio::error_code ec;
+		if (destination.connected_socket != nullptr)
+			co_await destination.connected_socket->async_send(client_data, asio::redirect_error(asio::use_awaitable, ec));
+		else
+			co_await forwarder_socket.async_send_to(client_data, forwarder_endpoint(destination.endpoint), asio::redirect_error(asio::use_awaitable, ec));
+
+		if (ec)
+			mark_unreachable(destination.endpoint, ec);
+	}
+
+	void mark_unreachable(const udp::endpoint &endpoint, const asio::error_code &ec)
+	{
+		if (ec != asio::error::network_unreachable && ec != asio::error::host_unreachable && ec != asio::error::address_family_not_supported)
+			return;
+		(endpoint.address().is_v6() ? ipv6_unreachable : ipv4_unreachable) = true;
+	}
+
+	// Adds a fragment to the reassembly queue. True when it completed a datagram, which is then in fragments.payload().
+	bool reassemble(std::span<uint8_t> data, const socks5_udp_header &header)
+	{
+		udp_reassembly::status status = fragments.add(data, header);
+		if (status == udp_reassembly::status::dropped)
+			metric_add<uint64_t>(local_metrics().udp_reassembly[1]);
+		if (status == udp_reassembly::status::complete)
+			metric_add<uint64_t>(local_metrics().udp_reassembly[0]);
+
+		// The reassembly timer starts with the first fragment of each sequence.
+		if (status == udp_reassembly::status::pending && (header.frag & ~udp_reassembly::last_fragment_flag) == 1)
+		{
+			reassembly_timer = current_shard->timers.add(udp_reassembly_timeout, [weak = weak_from_this()]
+				{
+					// While a sequence is under way, the reader only waits where it holds
+					// nothing in the buffer, so the buffer can go at once.
+					auto self = weak.lock();
+					if (self == nullptr || !self->fragments.active())
+						return;
+					metric_add<uint64_t>(local_metrics().udp_reassembly[2]);
+					self->fragments.release();
+				});
+		}
+		return status == udp_reassembly::status::complete;
+	}
+
+	// Parses the SOCKS5 UDP request header of one datagram from the client.
+	// Returns the destination, and points client_data at the payload behind the header.
+	// For the last fragment of a datagram, `reassembled` is set and the payload is in fragments.payload() instead.
+	awaitable<std::optional<udp::endpoint>> decode_datagram(std::span<uint8_t> data, std::span<uint8_t> &client_data, bool &reassembled)
+	{
+		socks5_udp_header header;
+		reassembled = false;
+		if (decode_udp_header(data, header) != socks5_decode_status::complete || header.header_size >= data.size())
+			co_return std::nullopt;
+
+		// A datagram that is not a fragment ends the sequence under way (RFC 1928, section 7).
+		// It may lie in the reassembly buffer, which the reader releases before its next receive.
+		if (header.frag == 0)
+		{
+			fragments.abandon();
+			client_data = data.subspan(header.header_size);	// extract client data from UDP Packet
+		}
+		else
+		{
+			if (!reassemble(data, header))
+				co_return std::nullopt;
+			header = fragments.header();
+			reassembled = true;
+			client_data = {};
+		}
+		if (std::optional<asio::ip::address> address = to_ip_address(header.destination); address.has_value())
+		{
+			if (acl.enabled() && acl.match(*address) == destination_acl::verdict::deny)
+			{
+				metric_add<uint64_t>(local_metrics().acl_denied_datagrams);
+				co_return std::nullopt;
+			}
+			co_return udp::endpoint(*address, header.destination.port);
+		}
+
+		destination_acl::verdict verdict = acl.enabled() ? acl.match(header.destination.hostname) : destination_acl::verdict::allow;
+		if (verdict == destination_acl::verdict::deny)
+		{
+			metric_add<uint64_t>(local_metrics().acl_denied_datagrams);
+			co_return std::nullopt;
+		}
+
+		asio::error_code ec;
+		uint16_t port = header.destination.port;
+		dns_cache::address_list addresses = co_await current_shard->dns.resolve(header.destination.hostname, ec);
+		if (ec || addresses == nullptr || addresses->empty())
+			co_return std::nullopt;
+
+		std::vector<udp::endpoint> candidates;
+		for (auto &&address : *addresses)
+		{
+			if (verdict == destination_acl::verdict::allow || acl.match(address) == destination_acl::verdict::allow)
+				candidates.emplace_back(address, port);
+		}
+		if (candidates.empty())
+		{
+			metric_add<uint64_t>(local_metrics().acl_denied_datagrams);
+			co_return std::nullopt;
+		}
+
+		// Sending UDP does not need a handshake, so the first endpoint in RFC 8305
+		// order is used, skipping address families that have proved unreachable.
+		std::vector<udp::endpoint> ordered = order_endpoints_rfc8305(candidates);
+		for (auto &&endpoint : ordered)
+		{
+			if (!(endpoint.address().is_v6() ? ipv6_unreachable : ipv4_unreachable))
+				co_return endpoint;
+		}
+		co_return ordered.front();
+	}
+
+	awaitable<void> reader()
+	{
+		std::array<uint8_t, udp_datagram_buffer_size> data = {};
+		asio::steady_timer pacing(request_socket.get_executor());
+		udp::endpoint from_udp_endpoint;
+
+		while(request_socket.is_open())
+		{
+			asio::error_code ec;
+			if (!fragments.active())
+				fragments.release();
+
+			// While a fragmented datagram is under way, the next one is received straight into
+			// the reassembly buffer. The wait comes first, since an expiring sequence frees it.
+			std::span<uint8_t> space(data);
+			size_t bytes_read = 0;
+			if (fragments.active())
+			{
+				co_await listener_socket.async_wait(udp::socket::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+				if (ec)
+					break;
+				if (std::span<uint8_t> in_place = fragments.receive_space(data.size()); !in_place.empty())
+					space = in_place;
+				bytes_read = listener_socket.receive_from(asio::buffer(space.data(), space.size()), from_udp_endpoint, 0, ec);
+			}
+			else
+			{
+				bytes_read = co_await listener_socket.async_receive_from(asio::buffer(data), from_udp_endpoint, asio::redirect_error(asio::use_awaitable, ec));
+			}
+			if (ec)
+				break;
+			if (bytes_read <= 4)
+				continue;
+			client_udp_endpoint = from_udp_endpoint;
+			idle.touch();
+
+			std::span<uint8_t> client_data = {};
+			bool reassembled = false;
+			std::optional<udp::endpoint> remote_udp_endpoint = co_await decode_datagram(space.first(bytes_read), client_data, reassembled);
+			if (!remote_udp_endpoint.has_value())
+				continue;
+
+			std::shared_ptr<udp_destination> destination = find_destination(*remote_udp_endpoint);
+			if (destination == nullptr)
+				continue;
+
+			size_t payload_size = reassembled ? fragments.payload_size() : client_data.size();
+			metric_bytes(true, metric_direction::upload, payload_size);
+			access.add_bytes(metric_direction::upload, payload_size);
+			if (reassembled)
+				co_await send_to_destination(*destination, fragments.payload());
+			else
+				co_await send_to_destination(*destination, asio::buffer(client_data.data(), client_data.size()));
+			if (shaper.active(metric_direction::upload))
+				co_await pace_datagrams(pacing, metric_direction::upload, payload_size);
+		}
+		stop();
+	}
+
+	awaitable<void> writer()
+	{
+		std::array<uint8_t, udp_datagram_buffer_size> data = {};
+		asio::steady_timer pacing(request_socket.get_executor());
+
+		while (request_socket.is_open())
+		{
+			udp::endpoint remote_udp_endpoint;
+			asio::error_code ec;
+			size_t bytes_read = co_await forwarder_socket.async_receive_from(asio::buffer(data), remote_udp_endpoint, asio::redirect_error(asio::use_awaitable, ec));
+			if (ec)
+				break;
+
+			std::array<uint8_t, 32> socks5_header_raw;
+			size_t header_size = reply_header(unmapped(remote_udp_endpoint), socks5_header_raw);
+			if (header_size == 0)
+				continue;
+
+			idle.touch();
+			metric_bytes(true, metric_direction::download, bytes_read);
+			access.add_bytes(metric_direction::download, bytes_read);
+			co_await send_to_client(std::span<const uint8_t>(socks5_header_raw.data(), header_size), std::span<uint8_t>(data.data(), bytes_read));
+			if (shaper.active(metric_direction::download))
+				co_await pace_datagrams(pacing, metric_direction::download, bytes_read);
+		}
+		stop();
+	}
+
+#ifdef __linux__
+	// One recvmmsg()/sendmmsg() batch of up to settings.udp_batch datagrams.
+	//
+	// With UDP_GRO (`gro`), the kernel may coalesce a run of datagrams from one sender into
+	// one received message, cut into segments of segment_size(). With UDP_SEGMENT (`gso`),
+	// queued datagrams that go to the same place join the message before them while they
+	// are no larger than its first one, and the kernel cuts it up again when sending.
+	//
+	// The batch is charged to the relay memory budget. UDP_GRO needs 64 KiB slots and room
+	// for 64 segments in each, so it is only turned on for `receiving` while the budget
+	// has room for that; otherwise the batch takes the small slots, which are always granted.
+	struct datagram_batch
+	{
+		datagram_batch(size_t size, udp_socket &receiving, bool gso) : gso(gso), memory(admission)
+		{
+			bool gro_reserved = settings.udp_offload && memory.try_reserve(footprint(size, true));
+			gro = gro_reserved && enable_gro(receiving);
+			if (gro_reserved && !gro)
+				memory.release(footprint(size, true));
+			if (!gro)
+				memory.reserve(footprint(size, false));
+
+			slot_size = gro ? udp_gro_buffer_size : udp_datagram_buffer_size;
+			buffers.resize(size * slot_size);
+			names.resize(size);
+			recv_iov.resize(size);
+			recv_msgs.resize(size);
+			recv_controls.resize(size);
+			headers.resize(size * segments_per_slot());
+			endpoints.resize(size * segments_per_slot());
+			runs.resize(size * segments_per_slot());
+			send_iov.resize(size * segments_per_slot() * 2);
+			send_msgs.resize(size * segments_per_slot());
+			send_controls.resize(size * segments_per_slot());
+		}
+
+		// Room for one UDP_GRO or UDP_SEGMENT control message.
+		struct control_buffer
+		{
+			alignas(cmsghdr) std::array<uint8_t, CMSG_SPACE(sizeof(int))> bytes;
+		};
+
+		// The datagrams that one message carries, two buffers each at most.
+		struct datagram_run
+		{
+			size_t first_iov;
+			size_t buffers_per_datagram;
+			size_t datagrams;
+			size_t segment_size;
+			size_t total_size;
+		};
+
+		size_t segments_per_slot() const { return gro ? udp_gso_max_segments : 1; }
+
+		// Bytes held by a batch of `size` messages.
+		static size_t footprint(size_t size, bool gro)
+		{
+			size_t per_slot = (gro ? udp_gro_buffer_size : udp_datagram_buffer_size) +
+				sizeof(sockaddr_storage) + sizeof(iovec) + sizeof(mmsghdr) + sizeof(control_buffer);
+			size_t per_segment = sizeof(std::array<uint8_t, 32>) + sizeof(udp::endpoint) + sizeof(datagram_run) +
+				2 * sizeof(iovec) + sizeof(mmsghdr) + sizeof(control_buffer);
+			return size * (per_slot + (gro ? udp_gso_max_segments : 1) * per_segment);
+		}
+
+		// Rearms the receive headers, since the kernel overwrites msg_namelen, msg_controllen and msg_flags.
+		void prepare_receive()
+		{
+			for (size_t i = 0; i < recv_msgs.size(); i++)
+			{
+				recv_iov[i] = { buffers.data() + i * slot_size, slot_size };
+				recv_msgs[i] = {};
+				recv_msgs[i].msg_hdr.msg_name = &names[i];
+				recv_msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+				recv_msgs[i].msg_hdr.msg_iov = &recv_iov[i];
+				recv_msgs[i].msg_hdr.msg_iovlen = 1;
+				if (gro)
+				{
+					recv_msgs[i].msg_hdr.msg_control = recv_controls[i].bytes.data();
+					recv_msgs[i].msg_hdr.msg_controllen = recv_controls[i].bytes.size();
+				}
+			}
+			queued = 0;
+			iov_used = 0;
+			headers_used = 0;
+		}
+
+		udp::endpoint sender(size_t i) const
+		{
+			udp::endpoint endpoint;
+			std::memcpy(endpoint.data(), &names[i], recv_msgs[i].msg_hdr.msg_namelen);
+			endpoint.resize(recv_msgs[i].msg_hdr.msg_namelen);
+			return endpoint;
+		}
+
+		// Size of the datagrams that received message i is made of. The last one may be shorter.
+		size_t segment_size(size_t i)
+		{
+			msghdr &header = recv_msgs[i].msg_hdr;
+			for (cmsghdr *control = CMSG_FIRSTHDR(&header); control != nullptr; control = CMSG_NXTHDR(&header, control))
+			{
+				if (control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO)
+				{
+					int size = 0;
+					std::memcpy(&size, CMSG_DATA(control), sizeof(size));
+					if (size > 0)
+						return (size_t)size;
+				}
+			}
+			return recv_msgs[i].msg_len;
+		}
+
+		// Room for a reply header that has to stay put until the batch has been sent.
+		std::array<uint8_t, 32>& next_header() { return headers[headers_used++]; }
+
+		// Queues one outgoing datagram made of up to two buffers.
+		void push(const udp::endpoint &destination, std::span<uint8_t> first, std::span<uint8_t> second = {})
+		{
+			size_t size = first.size() + second.size();
+			size_t buffer_count = second.empty() ? 1 : 2;
+			if (iov_used + buffer_count > send_iov.size() || queued == runs.size())
+				return;	// more segments than UDP_GRO has ever coalesced
+			send_iov[iov_used++] = { first.data(), first.size() };
+			if (buffer_count == 2)
+				send_iov[iov_used++] = { second.data(), second.size() };
+
+			if (gso && queued > 0)
+			{
+				datagram_run &run = runs[queued - 1];
+				bool joins = size != 0 && size <= run.segment_size && run.buffers_per_datagram == buffer_count &&
+					run.datagrams < udp_gso_max_segments && run.total_size + size <= udp_gso_max_size &&
+					run.datagrams * run.segment_size == run.total_size && endpoints[queued - 1] == destination;
+				if (joins)
+				{
+					run.datagrams++;
+					run.total_size += size;
+					return;
+				}
+			}
+
+			endpoints[queued] = destination;
+			runs[queued] = { iov_used - buffer_count, buffer_count, 1, size, size };
+			queued++;
+		}
+
+		// Fills in the message headers of everything push()ed since prepare_receive().
+		size_t prepare_send()
+		{
+			for (size_t i = 0; i < queued; i++)
+			{
+				const datagram_run &run = runs[i];
+				send_msgs[i] = {};
+				send_msgs[i].msg_hdr.msg_name = endpoints[i].data();
+				send_msgs[i].msg_hdr.msg_namelen = (socklen_t)endpoints[i].size();
+				send_msgs[i].msg_hdr.msg_iov = &send_iov[run.first_iov];
+				send_msgs[i].msg_hdr.msg_iovlen = run.datagrams * run.buffers_per_datagram;
+				if (run.datagrams == 1)
+					continue;
+
+				send_msgs[i].msg_hdr.msg_control = send_controls[i].bytes.data();
+				send_msgs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+				cmsghdr *control = CMSG_FIRSTHDR(&send_msgs[i].msg_hdr);
+				control->cmsg_level = SOL_UDP;
+				control->cmsg_type = UDP_SEGMENT;
+				control->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				uint16_t segment_size = (uint16_t)run.segment_size;
+				std::memcpy(CMSG_DATA(control), &segment_size, sizeof(segment_size));
+			}
+			return queued;
+		}
+
+		bool gro = false;
+		bool gso;
+		admission_control::relay_reservation memory;
+		size_t slot_size = 0;
+		std::vector<uint8_t> buffers;
+		std::vector<sockaddr_storage> names;
+		std::vector<iovec> recv_iov;
+		std::vector<mmsghdr> recv_msgs;
+		std::vector<control_buffer> recv_controls;
+
+		size_t queued = 0;
+		size_t iov_used = 0;
+		size_t headers_used = 0;
+		std::vector<std::array<uint8_t, 32>> headers;
+		std::vector<udp::endpoint> endpoints;
+		std::vector<datagram_run> runs;
+		std::vector<iovec> send_iov;
+		std::vector<mmsghdr> send_msgs;
+		std::vector<control_buffer> send_controls;
+	};
+
+	// Turns on UDP_GRO for receiving into a batch, if the kernel has it (Linux 5.0).
+	static bool enable_gro(udp_socket &socket)
+	{
+		if (!settings.udp_offload)
+			return false;
+		asio::error_code ec;
+		socket.set_option(udp_gro_option(true), ec);
+		return !ec;
+	}
+
+	// Whether the kernel takes UDP_SEGMENT for sending from a batch (Linux 4.18).
+	static bool gso_available(udp_socket &socket)
+	{
+		if (!settings.udp_offload)
+			return false;
+		asio::error_code ec;
+		socket.set_option(udp_segment_option(0), ec);
+		return !ec;
+	}
+
+	// Receives as many datagrams as are queued, up to the batch size, without blocking.
+	awaitable<int> receive_batch(udp_socket &socket, datagram_batch &batch, asio::error_code &ec)
+	{
+		while (true)
+		{
+			co_await socket.async_wait(udp::socket::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+			if (ec)
+				co_return -1;
+
+			batch.prepare_receive();
+			int received = recvmmsg(socket.native_handle(), batch.recv_msgs.data(), (unsigned int)batch.recv_msgs.size(), MSG_DONTWAIT, nullptr);
+			if (received >= 0)
+				co_return received;
+			if (errno != EAGAIN && errno != EINTR)
+			{
+				ec = asio::error_code(errno, asio::system_category());
+				co_return -1;
+			}
+		}
+	}
+
+	// Sends the datagrams queued in the batch. A datagram that the kernel rejects is dropped.
+	awaitable<void> send_batch(udp_socket &socket, datagram_batch &batch)
+	{
+		size_t count = batch.prepare_send();
+		size_t sent = 0;
+		while (sent < count)
+		{
+			int n = sendmmsg(socket.native_handle(), batch.send_msgs.data() + sent, (unsigned int)(count - sent), MSG_DONTWAIT);
+			if (n > 0)
+			{
+				sent += n;
+				continue;
+			}
+
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			if (n < 0 && errno == EAGAIN)
+			{
+				asio::error_code ec;
+				co_await socket.async_wait(udp::socket::wait_write, asio::redirect_error(asio::use_awaitable, ec));
+				if (ec)
+					co_return;
+				continue;
+			}
+
+			// A device without checksum offload refuses UDP_SEGMENT, and so does a route whose MTU
+			// is below the segment size. The datagrams then go out one by one.
+			const datagram_batch::datagram_run &run = batch.runs[sent];
+			if (run.datagrams > 1)
+			{
+				if (errno == EIO)
+					batch.gso = false;
+				for (size_t i = 0; i < run.datagrams; i++)
+				{
+					msghdr message = batch.send_msgs[sent].msg_hdr;
+					message.msg_iov = &batch.send_iov[run.first_iov + i * run.buffers_per_datagram];
+					message.msg_iovlen = run.buffers_per_datagram;
+					message.msg_control = nullptr;
+					message.msg_controllen = 0;
+					sendmsg(socket.native_handle(), &message, MSG_DONTWAIT);
+				}
+			}
+			sent++;
+		}
+	}
+
+	awaitable<void> batch_reader()
+	{
+		datagram_batch batch(settings.udp_batch, listener_socket, gso_available(forwarder_socket));
+		asio::steady_timer pacing(request_socket.get_executor());
+		while (request_socket.is_open())
+		{
+			asio::error_code ec;
+			if (!fragments.active())
+				fragments.release();
+			int received = co_await receive_batch(listener_socket, batch, ec);
+			if (ec)
+				break;
+			idle.touch();
+
+			size_t batch_bytes = 0;
+			for (int i = 0; i < received; i++)
+			{
+				mmsghdr &msg = batch.recv_msgs[i];
+				if (msg.msg_hdr.msg_flags & MSG_TRUNC)
+					continue;
+				client_udp_endpoint = batch.sender(i);
+
+				// Every segment of a coalesced message is a SOCKS5 datagram of its own.
+				size_t segment_size = batch.segment_size(i);
+				for (size_t offset = 0; offset < msg.msg_len; offset += segment_size)
+				{
+					std::span<uint8_t> data((uint8_t *)batch.recv_iov[i].iov_base + offset, std::min<size_t>(segment_size, msg.msg_len - offset));
+					if (data.size() <= 4)
+						continue;
+
+					std::span<uint8_t> client_data = {};
+					bool reassembled = false;
+					std::optional<udp::endpoint> remote_udp_endpoint = co_await decode_datagram(data, client_data, reassembled);
+					if (!remote_udp_endpoint.has_value())
+						continue;
+
+					std::shared_ptr<udp_destination> destination = find_destination(*remote_udp_endpoint);
+					if (destination == nullptr)
+						continue;
+
+					// Fragments are copied out of the batch, and the rare reassembled datagram is sent on its own.
+					if (reassembled)
+					{
+						metric_bytes(true, metric_direction::upload, fragments.payload_size());
+						access.add_bytes(metric_direction::upload, fragments.payload_size());
+						batch_bytes += fragments.payload_size();
+						co_await send_to_destination(*destination, fragments.payload());
+						continue;
+					}
+
+					metric_bytes(true, metric_direction::upload, client_data.size());
+					access.add_bytes(metric_direction::upload, client_data.size());
+					batch_bytes += client_data.size();
+					if (destination->connected_socket != nullptr)
+					{
+						// Datagrams are dropped rather than queued when the socket buffer is full.
+						::send(destination->connected_socket->native_handle(), client_data.data(), client_data.size(), MSG_DONTWAIT);
+						continue;
+					}
+
+					batch.push(forwarder_endpoint(destination->endpoint), client_data);
+				}
+			}
+
+			co_await send_batch(forwarder_socket, batch);
+			if (shaper.active(metric_direction::upload))
+				co_await pace_datagrams(pacing, metric_direction::upload, batch_bytes);
+		}
+		stop();
+	}
+
+	awaitable<void> batch_writer()
+	{
+		datagram_batch batch(settings.udp_batch, forwarder_socket, gso_available(listener_socket));
+		asio::steady_timer pacing(request_socket.get_executor());
+		while (request_socket.is_open())
+		{
+			asio::error_code ec;
+			int received = co_await receive_batch(forwarder_socket, batch, ec);
+			if (ec)
+				break;
+			idle.touch();
+
+			size_t batch_bytes = 0;
+			for (int i = 0; i < received; i++)
+			{
+				mmsghdr &msg = batch.recv_msgs[i];
+				if (msg.msg_hdr.msg_flags & MSG_TRUNC)
+					continue;
+
+				// The batch keeps its own copy because the destination may be evicted before sending.
+				// Each segment of a coalesced message gets the header in front of it.
+				std::array<uint8_t, 32> &header = batch.next_header();
+				size_t header_size = reply_header(unmapped(batch.sender(i)), header);
+				if (header_size == 0)
+					continue;
+
+				metric_bytes(true, metric_direction::download, msg.msg_len);
+				access.add_bytes(metric_direction::download, msg.msg_len);
+				batch_bytes += msg.msg_len;
+
+				std::span<uint8_t> socks5_header_raw(header.data(), header_size);
+				size_t segment_size = batch.segment_size(i);
+				size_t offset = 0;
+				do
+				{
+					size_t size = std::min<size_t>(segment_size, msg.msg_len - offset);
+					batch.push(client_udp_endpoint, socks5_header_raw, std::span<uint8_t>((uint8_t *)batch.recv_iov[i].iov_base + offset, size));
+					offset += size;
+				} while (offset < msg.msg_len);
+			}
+
+			co_await send_batch(listener_socket, batch);
+			if (shaper.active(metric_direction::download))
+				co_await pace_datagrams(pacing, metric_direction::download, batch_bytes);
+		}
+		stop();
+	}
+#endif
+
+	void stop()
+	{
+		asio::error_code ec;
+		request_socket.close(ec);
+		listener_socket.close(ec);
+		forwarder_socket.close(ec);
+		for (auto &destination : recency)
+		{
+			if (destination->connected_socket != nullptr)
+				destination->connected_socket->close(ec);
+		}
+		destinations.clear();
+		recency.clear();
+	}
+
+	tcp_socket request_socket;
+	udp_socket listener_socket;
+	udp_socket forwarder_socket;
+	udp::endpoint client_udp_endpoint;
+	bool forwarder_is_v6 = forwarder_socket.local_endpoint().address().is_v6();
+	destination_list recency;
+	std::unordered_map<udp::endpoint, destination_list::iterator, udp_endpoint_hash> destinations;
+	size_t connected_destinations = 0;
+	bool ipv4_unreachable = false;
+	bool ipv6_unreachable = false;
+	udp_reassembly fragments{ admission };
+	timer_wheel::timeout reassembly_timer;
+	traffic_shaper shaper;
+	timer_wheel::timeout idle;
+	access_log_entry access;
+	metric_gauge gauge{ metric_session::udp };
+	admission_control::ticket session_ticket{ admission.sessions };
+};
 
 
 uint8_t convert_error_code(asio::error_code ec)
@@ -482,470 +1556,1411 @@ uint8_t convert_error_code(asio::error_code ec)
 	return reply_code;
 }
 
-awaitable<void> socks5_access(tcp_socket client_socket, const char *username, const char *password)
+// Reads until the current handshake stage has a complete message.
+// Nothing is read if a pipelined message is already buffered.
+awaitable<bool> read_handshake_message(tcp_socket &client_socket, socks5_handshake &handshake)
 {
-	try
+	while (true)
 	{
-		std::array<uint8_t, 1024> data = {};
-		// 1. Negotiation
-		size_t bytes_read = co_await asio::async_read(client_socket, asio::buffer(data), asio::transfer_exactly(2), asio::use_awaitable);
-		if (bytes_read != 2 || data[0] != socks_version)
-			co_return;
+		switch (handshake.parse())
+		{
+		case socks5_handshake::status::complete:
+			co_return true;
+		case socks5_handshake::status::malformed:
+			co_return false;
+		default:
+			break;
+		}
 
-		uint8_t num_methods = data[1];
-		bytes_read = co_await asio::async_read(client_socket, asio::buffer(data, num_methods), asio::transfer_exactly(num_methods), asio::use_awaitable);
-		if (bytes_read != num_methods)
-			co_return;
+		std::span<uint8_t> free_space = handshake.prepare();
+		if (free_space.empty())
+			co_return false;
 
-		std::optional<uint8_t> method_supported;
-		for (uint16_t i = 0; i < num_methods; i++)
-		{
-			if (data[i] == socks_method_no_auth && username == nullptr && password == nullptr)
+		asio::error_code ec;
+		size_t bytes_read = co_await client_socket.async_read_some(asio::buffer(free_space.data(), free_space.size()), asio::redirect_error(asio::use_awaitable, ec));
+		if (ec)
+			co_return false;
+		handshake.commit(bytes_read);
+	}
+}
+
+// CONNECT through the upstream proxy. The destination is passed on as the client sent it,
+// so hostnames are resolved by the upstream.
+awaitable<void> upstream_connect(tcp_socket &client_socket, const socks5_handshake &handshake, std::chrono::steady_clock::time_point handshake_expiry,
+	access_log_entry &access, connection_trace &trace, directional_limiter *user_limiter)
+{
+	socks5_address destination{ handshake.address_type(), handshake.address(), handshake.hostname(), handshake.port() };
+	asio::error_code ec;
+	uint8_t reply_code = socks_reply_general_failure;
+	bool pooled = false;
+	tcp_socket remote_socket = co_await current_shard->upstream->connect(socks_cmd_connect, destination, handshake_expiry, reply_code, ec, pooled);
+	metric_add<uint64_t>(pooled ? local_metrics().upstream_pooled : local_metrics().upstream_dialled);
+	if (ec)
+		reply_code = convert_error_code(ec);
+	else
+		trace.mark(trace_stage::connect);
+
+	std::array<uint8_t, 32> reply = {};
+	size_t reply_size = 0;
+	if (handshake.address_type() == socks_atyp_ipv6)
+		reply_size = encode_reply(reply_code, asio::ip::address_v6::any(), 0, reply);
+	else
+		reply_size = encode_reply(reply_code, asio::ip::address_v4::any(), 0, reply);
+
+	metric_reply(reply[1]);
+	access.set_reply(reply[1]);
+	co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
+	if (reply_code != socks_reply_success)
+		co_return;
+	trace.mark(trace_stage::reply);
+
+	if (std::span<const uint8_t> early_data = handshake.remaining(); !early_data.empty())
+		co_await asio::async_write(remote_socket, asio::buffer(early_data.data(), early_data.size()));
+
+	make_pooled<tcp_session>(std::move(client_socket), std::move(remote_socket), std::move(access), std::move(trace), user_limiter)->start();
+}
+
+awaitable<void> socks5_access(tcp_socket client_socket)
+{
+	try
+	{
+		metric_gauge gauge(metric_session::handshake);
+		admission_control::ticket handshake_ticket(admission.handshakes);
+		access_log_entry access(client_socket);
+		connection_trace trace = connection_trace::sample();
+		socks5_handshake handshake;
+		auto handshake_expiry = std::chrono::steady_clock::now() + settings.handshake_timeout;
+		timer_wheel::timeout handshake_deadline = current_shard->timers.add(settings.handshake_timeout, [&client_socket]
 			{
-				method_supported = data[i];
+				asio::error_code ec;
+				client_socket.close(ec);
+			});
+
+		// 1. Negotiation
+		if (!co_await read_handshake_message(client_socket, handshake))
+			co_return;
+		trace.mark(trace_stage::greeting);
+
+		std::optional<uint8_t> method_supported;
+		bool authenticate = credentials.enabled();
+		for (uint8_t method : handshake.methods())
+		{
+			if (method == socks_method_no_auth && !authenticate)
+			{
+				method_supported = method;
 				break;
 			}
 
-			if (data[i] == socks_method_user_pwd && username && password)
+			if (method == socks_method_user_pwd && authenticate)
 			{
-				method_supported = data[i];
+				method_supported = method;
 				break;
 			}
 		}
 
 		uint8_t chosen_method = method_supported.has_value() ? method_supported.value() : socks_method_unacceptable;
-		data[0] = socks_version;
-		data[1] = chosen_method;
-
-		co_await asio::async_write(client_socket, asio::buffer(data, 2));
+		std::array<uint8_t, 2> selection = { socks_version, chosen_method };
+		co_await asio::async_write(client_socket, asio::buffer(selection));
 		if (!method_supported)
 		{
 			std::cerr << "No supported authentication method." << std::endl;
 			co_return;
 		}
+		handshake.select_method(chosen_method);
 
 		// 2. Username / Password Authentication
+		directional_limiter *user_limiter = nullptr;
 		if (chosen_method == socks_method_user_pwd)
 		{
-			std::string recv_username, recv_password;
-			bytes_read = co_await asio::async_read(client_socket, asio::buffer(data, 1), asio::transfer_exactly(1), asio::use_awaitable);
-			if (bytes_read != 1 || data[0] != 1)
+			if (!co_await read_handshake_message(client_socket, handshake))
+			{
+				std::cerr << "Invalid SOCKS version or message length incorrect." << std::endl;
+				co_return;
+			}
+
+			std::array<uint8_t, 2> auth_reply = { socks_auth_version, socks_auth_success };
+			access.set_user(handshake.username());
+			if (credentials.current()->verify(handshake.username(), handshake.password()))
+			{
+				user_limiter = bandwidth.user_limiter(handshake.username());
+				co_await asio::async_write(client_socket, asio::buffer(auth_reply));
+				trace.mark(trace_stage::authentication);
+			}
+			else
+			{
+				auth_reply[1] = socks_auth_failure;
+				metric_add<uint64_t>(local_metrics().auth_failures);
+				co_await asio::async_write(client_socket, asio::buffer(auth_reply));
+				co_return;
+			}
+		}
+
+		// 3. Request
+		if (!co_await read_handshake_message(client_socket, handshake))
+		{
+			std::cerr << "Invalid SOCKS version or message too short." << std::endl;
+			co_return;
+		}
+		trace.mark(trace_stage::request);
+
+		std::array<uint8_t, 32> reply = {};
+		size_t reply_size = 0;
+		uint8_t command = handshake.command();
+		uint8_t address_type = handshake.address_type();
+		metric_handshake(command, address_type);
+		std::optional<tcp::endpoint> tcp_endpoint;
+		std::string_view hostname;
+		uint16_t port = handshake.port();
+
+		switch (address_type)
+		{
+		case socks_atyp_ipv4:
+		{
+			asio::ip::address_v4::bytes_type address_bytes;
+			std::copy_n(handshake.address().begin(), 4, address_bytes.begin());
+			asio::ip::address_v4 address(address_bytes);
+			tcp_endpoint = tcp::endpoint(address, port);
+			break;
+		}
+		case socks_atyp_domain:
+		{
+			hostname = handshake.hostname();
+			break;
+		}
+		case socks_atyp_ipv6:
+		{
+			asio::ip::address_v6::bytes_type address_bytes;
+			std::copy_n(handshake.address().begin(), 16, address_bytes.begin());
+			asio::ip::address_v6 address(address_bytes);
+			tcp_endpoint = tcp::endpoint(address, port);
+			break;
+		}
+		default:
+			// Send "Address type not supported" reply
+			std::cerr << "Unsupported address type: " << static_cast<uint16_t>(address_type) << std::endl;
+			reply_size = encode_reply(socks_reply_address_type_not_supported, asio::ip::address_v4::any(), 0, reply);
+			metric_reply(reply[1]);
+			access.set_reply(reply[1]);
+			co_await asio::async_write(client_socket, asio::buffer(reply, reply_size));
+			co_return;
+		}
+		access.set_request(command, hostname, tcp_endpoint.has_value() ? tcp_endpoint->address() : asio::ip::address(), port);
+
+		// Destination access control. UDP_ASSOCIATE with an unspecified address only means
+		// that the client does not know its own address yet.
+		bool check_resolved = false;
+		if (acl.enabled() && !(command == socks_cmd_udp_associate && tcp_endpoint.has_value() && tcp_endpoint->address().is_unspecified()))
+		{
+			destination_acl::verdict verdict = tcp_endpoint.has_value() ? acl.match(tcp_endpoint->address()) : acl.match(hostname);
+			// Only a direct CONNECT resolves the name itself and can check the addresses.
+			if (verdict == destination_acl::verdict::none && (command != socks_cmd_connect || current_shard->upstream != nullptr))
+				verdict = acl.default_verdict();
+			if (verdict == destination_acl::verdict::deny)
+			{
+				reply_size = encode_reply(socks_reply_connection_not_allowed, asio::ip::address_v4::any(), 0, reply);
+				metric_reply(reply[1]);
+				access.set_reply(reply[1]);
+				co_await asio::async_write(client_socket, asio::buffer(reply, reply_size));
+				co_return;
+			}
+			check_resolved = verdict == destination_acl::verdict::none;
+		}
+
+		// 4. Establish Connection
+		switch (command)
+		{
+		case socks_cmd_connect:
+		{
+			if (current_shard->upstream != nullptr)
+			{
+				co_await upstream_connect(client_socket, handshake, handshake_expiry, access, trace, user_limiter);
+				break;
+			}
+
+			asio::error_code ec;
+			if (address_type == socks_atyp_ipv6)
+				reply_size = encode_reply(socks_reply_success, asio::ip::address_v6::any(), 0, reply);
+			else
+				reply_size = encode_reply(socks_reply_success, asio::ip::address_v4::any(), 0, reply);
+
+			std::vector<tcp::endpoint> candidates;
+			if (!tcp_endpoint.has_value())
+			{
+				dns_cache::address_list addresses = co_await current_shard->dns.resolve(hostname, ec);
+				if (ec || addresses == nullptr || addresses->empty())
+				{
+					if (ec)
+						reply[1] = convert_error_code(ec);
+					else
+						reply[1] = socks_reply_network_unreachable;
+					// 4. Send Reply
+					metric_reply(reply[1]);
+					access.set_reply(reply[1]);
+					co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
+					break;
+				}
+				trace.mark(trace_stage::dns);
+
+				for (auto &&address : *addresses)
+				{
+					if (!check_resolved || acl.match(address) == destination_acl::verdict::allow)
+						candidates.emplace_back(address, port);
+				}
+
+				if (candidates.empty())
+				{
+					reply[1] = socks_reply_connection_not_allowed;
+					metric_reply(reply[1]);
+					access.set_reply(reply[1]);
+					co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
+					break;
+				}
+			}
+			else
+			{
+				candidates.push_back(*tcp_endpoint);
+				tcp_endpoint.reset();
+			}
+
+			// With TCP Fast Open, the kernel holds the SYN back when it has a cookie for the destination,
+			// and sends it together with the first bytes of the client.
+			std::function<void(tcp_socket &)> prepare_socket;
+#ifdef TCP_FASTOPEN_CONNECT
+			if (settings.tcp_fast_open)
+				prepare_socket = [](tcp_socket &socket) { asio::error_code option_ec; socket.set_option(fast_open_connect_option(true), option_ec); };
+#endif
+			tcp::endpoint connected_endpoint;
+			tcp_socket remote_socket = co_await happy_eyeballs_connect<tcp_socket>(candidates, settings.connect_attempt_delay, handshake_expiry, connected_endpoint, ec, prepare_socket);
+			if (!ec)
+			{
+				tcp_endpoint = connected_endpoint;
+				trace.mark(trace_stage::connect);
+			}
+
+			if (ec || !tcp_endpoint.has_value())
+			{
+				if (ec)
+					reply[1] = convert_error_code(ec);
+				else
+					reply[1] = socks_reply_network_unreachable;
+				// 5. Send Reply
+				metric_reply(reply[1]);
+				access.set_reply(reply[1]);
+				co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
+				break;
+			}
+			else if (reply[3] != socks_atyp_ipv6 && tcp_endpoint->address().is_v6())
+			{
+				reply_size = encode_reply(socks_reply_success, asio::ip::address_v6::any(), 0, reply);
+			}
+
+			// Only replaced when it changes, which saves an allocation per connection.
+			asio::ip::address local_address = remote_socket.local_endpoint().address();
+			if (const auto &previous = tcp_local_address_cache.get(tcp_local_address); previous == nullptr || *previous != local_address)
+				tcp_local_address.store(std::make_shared<const asio::ip::address>(local_address));
+
+			// 5. Send Reply
+			metric_reply(reply[1]);
+			access.set_reply(reply[1]);
+			co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
+			trace.mark(trace_stage::reply);
+
+			// Data that the client pipelined behind the request
+			if (std::span<const uint8_t> early_data = handshake.remaining(); !early_data.empty())
+				co_await asio::async_write(remote_socket, asio::buffer(early_data.data(), early_data.size()));
+
+			// 6. Forward Traffic
+			make_pooled<tcp_session>(std::move(client_socket), std::move(remote_socket), std::move(access), std::move(trace), user_limiter)->start();
+			break;
+		}
+		case socks_cmd_bind:
+		{
+			std::shared_ptr<const asio::ip::address> tcp_local_address = tcp_local_address_cache.get(::tcp_local_address);
+			if (tcp_local_address == nullptr)
+			{
+				reply_size = encode_reply(socks_reply_command_not_supported, asio::ip::address_v4::any(), 0, reply);
+				metric_reply(reply[1]);
+				access.set_reply(reply[1]);
+				co_await asio::async_write(client_socket, asio::buffer(reply, reply_size));
+				break;
+			}
+
+			asio::error_code ec;
+			tcp_acceptor acceptor(client_socket.get_executor());
+			acceptor.set_option(asio::detail::socket_option::integer<SOL_SOCKET, SO_RCVTIMEO>{ 60000 });
+			uint16_t listener_port = acceptor.local_endpoint().port();
+			reply_size = encode_reply(socks_reply_success, *tcp_local_address, listener_port, reply);
+
+			// BIND: First Reply
+			metric_reply(reply[1]);
+			access.set_reply(reply[1]);
+			asio::async_write(client_socket, asio::buffer(reply, reply_size), [](const asio::error_code &, size_t) {});
+			make_pooled<tcp_binding>(std::move(client_socket), std::move(acceptor), std::move(access), user_limiter)->start(reply);
+			break;
+		}
+		case socks_cmd_udp_associate:
+		{
+			asio::error_code ec;
+			udp::endpoint initialise_endpoint;
+			asio::ip::address local_address = client_socket.local_endpoint().address();
+			if (local_address.is_v6())
+			{
+				reply_size = encode_reply(socks_reply_success, asio::ip::address_v6::any(), 0, reply);
+				initialise_endpoint = udp::endpoint(udp::v6(), 0);
+			}
+			else
+			{
+				reply_size = encode_reply(socks_reply_success, asio::ip::address_v4::any(), 0, reply);
+				initialise_endpoint = udp::endpoint(udp::v4(), 0);
+			}
+
+			if (!tcp_endpoint.has_value())
+			{
+				dns_cache::address_list addresses = co_await current_shard->dns.resolve(hostname, ec);
+				if (ec || addresses == nullptr || addresses->empty())
+				{
+					if (ec)
+						reply[1] = convert_error_code(ec);
+					else
+						reply[1] = socks_reply_network_unreachable;
+					metric_reply(reply[1]);
+					access.set_reply(reply[1]);
+					co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
+					break;
+				}
+				trace.mark(trace_stage::dns);
+			}
+
+			udp_socket listen_udp_socket(client_socket.get_executor(), initialise_endpoint);
+			udp::endpoint binding_endpoint = listen_udp_socket.local_endpoint(ec);
+			if (ec)
+			{
+				reply[1] = convert_error_code(ec);
+				// 5. Send Reply
+				metric_reply(reply[1]);
+				access.set_reply(reply[1]);
+				co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
+				break;
+			}
+
+			reply_size = encode_reply(socks_reply_success, local_address, binding_endpoint.port(), reply);
+
+			// 5. Send Reply
+			metric_reply(reply[1]);
+			access.set_reply(reply[1]);
+			co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
+			trace.mark(trace_stage::reply);
+
+			// 6. Forward Traffic
+			make_pooled<udp_session>(std::move(client_socket), std::move(listen_udp_socket), std::move(access), user_limiter)->start();
+			break;
+		}
+		default:
+		{
+			std::cerr << "Unsupported command: " << static_cast<int>(command) << std::endl;
+			reply_size = encode_reply(socks_reply_command_not_supported, asio::ip::address_v4::any(), 0, reply);
+			metric_reply(reply[1]);
+			access.set_reply(reply[1]);
+			co_await asio::async_write(client_socket, asio::buffer(reply, reply_size));
+			co_return;
+		}
+		}
+	}
+	catch (std::exception &e)
+	{
+		std::printf("socks5_access Exception: %s\n", e.what());
+	}
+}
+
+tcp_acceptor open_acceptor(const asio::any_io_executor &executor, const tcp::endpoint &endpoint, bool reuse_port)
+{
+	tcp_acceptor acceptor(executor);
+	acceptor.open(endpoint.protocol());
+	acceptor.set_option(tcp::acceptor::reuse_address(true));
+#ifdef __linux__
+	if (endpoint.protocol() == tcp::v6())
+		acceptor.set_option(asio::ip::v6_only(false));
+#endif
+	if constexpr (reuse_port_supported)
+	{
+		if (reuse_port)
+			acceptor.set_option(reuse_port_option(true));
+	}
+
+#ifdef TCP_FASTOPEN
+	if (settings.tcp_fast_open)
+	{
+		asio::error_code ec;
+		acceptor.set_option(fast_open_option(tcp_fast_open_queue), ec);
+		if (ec)
+			std::printf("TCP Fast Open is not available: %s\n", ec.message().c_str());
+	}
+#endif
+#ifdef TCP_DEFER_ACCEPT
+	// The connection is only accepted once the client has sent its greeting.
+	if (settings.tcp_defer_accept.count() > 0)
+	{
+		asio::error_code ec;
+		acceptor.set_option(defer_accept_option((int)settings.tcp_defer_accept.count()), ec);
+		if (ec)
+			std::printf("TCP_DEFER_ACCEPT is not available: %s\n", ec.message().c_str());
+	}
+#endif
+	acceptor.bind(endpoint);
+	acceptor.listen();
+	return acceptor;
+}
+
+// Without SO_REUSEPORT only the first shard listens and hands each
+// accepted connection to the shards in turn.
+asio::io_context& accept_context(server_shard &shard, bool reuse_port)
+{
+	if (reuse_port || shards.size() < 2)
+		return shard.io_context;
+	server_shard &target = *shards[shard.next_dispatch];
+	shard.next_dispatch = (shard.next_dispatch + 1) % shards.size();
+	return target.io_context;
+}
+
+// Pauses the listener while a handshake, session or memory limit is reached.
+awaitable<void> wait_for_admission()
+{
+	if (admission.accepting())
+		co_return;
+
+	metric_add<uint64_t>(local_metrics().accept_pauses);
+	asio::steady_timer timer(co_await this_coro::executor);
+	while (!admission.accepting())
+	{
+		asio::error_code ec;
+		timer.expires_after(admission_retry_interval);
+		co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+	}
+}
+
+// Closes connections from a source address that exceeds its connection rate.
+bool admit_source(tcp_socket &socket)
+{
+	asio::error_code ec;
+	tcp::endpoint remote_endpoint = socket.remote_endpoint(ec);
+	if (!ec && admission.allow_source(remote_endpoint.address()))
+		return true;
+
+	metric_add<uint64_t>(local_metrics().rate_limited_connections);
+	socket.close(ec);
+	return false;
+}
+
+// Accepts until the acceptor is closed, which happens when the process is draining.
+awaitable<void> accept_connections(server_shard &shard, tcp_acceptor &acceptor, bool reuse_port)
+{
+	tcp_acceptor::native_handle_type handle = acceptor.native_handle();
+	shard.acceptors.push_back(&acceptor);
+	{
+		std::scoped_lock lock(listener_mutex);
+		listener_handles.push_back(handle);
+	}
+
+	asio::steady_timer retry(acceptor.get_executor());
+	while (!draining)
+	{
+		asio::error_code ec;
+		co_await wait_for_admission();
+		tcp_socket socket = co_await acceptor.async_accept(accept_context(shard, reuse_port), asio::redirect_error(asio::use_awaitable, ec));
+		if (ec == asio::error::operation_aborted || !acceptor.is_open())
+			break;
+
+		// EMFILE, ENFILE, ENOBUFS and the like pass once sessions end, so the listener waits
+		// instead of giving up. A connection reset before it was accepted only costs that one.
+		if (ec)
+		{
+			metric_add<uint64_t>(local_metrics().accept_errors);
+			if (ec == asio::error::connection_aborted)
+				continue;
+			retry.expires_after(accept_error_retry_interval);
+			co_await retry.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+			continue;
+		}
+		metric_add<uint64_t>(local_metrics().accepted_connections);
+		if (!admit_source(socket))
+			continue;
+		asio::any_io_executor socket_executor = socket.get_executor();
+		co_spawn(socket_executor, socks5_access(std::move(socket)), pooled_detached);
+	}
+
+	std::erase(shard.acceptors, &acceptor);
+	{
+		std::scoped_lock lock(listener_mutex);
+		std::erase(listener_handles, handle);
+	}
+}
+
+awaitable<void> listener_ipv4(server_shard &shard, uint16_t port = 1080, bool reuse_port = false)
+{
+	asio::any_io_executor executor = co_await this_coro::executor;
+	try
+	{
+		tcp_acceptor acceptor = open_acceptor(executor, { tcp::v4(), port }, reuse_port);
+		co_await accept_connections(shard, acceptor, reuse_port);
+	}
+	catch (std::exception &e)
+	{
+		std::printf("IPv4 socks5_listen Exception: %s\n", e.what());
+	}
+}
+
+awaitable<void> listener_ipv6(server_shard &shard, uint16_t port = 1080, bool reuse_port = false)
+{
+	asio::any_io_executor executor = co_await this_coro::executor;
+	try
+	{
+		tcp_acceptor acceptor = open_acceptor(executor, { tcp::v6(), port }, reuse_port);
+		co_await accept_connections(shard, acceptor, reuse_port);
+	}
+	catch (std::exception &e)
+	{
+		std::printf("IPv6 socks5_listen Exception: %s\n", e.what());
+		if constexpr (linux_system)
+		{
+			std::printf("Fallback to IPv4\n");
+			co_spawn(executor, listener_ipv4(shard, port, reuse_port), detached);
+		}
+	}
+}
+
+#ifdef __linux__
+// Listens on a socket that was opened by someone else: --listen-fd, or the previous process.
+awaitable<void> listener_inherited(server_shard &shard, int handle, bool reuse_port)
+{
+	asio::any_io_executor executor = co_await this_coro::executor;
+	try
+	{
+		sockaddr_storage address = {};
+		socklen_t address_size = sizeof(address);
+		if (getsockname(handle, (sockaddr *)&address, &address_size) < 0)
+			throw asio::system_error(asio::error_code(errno, asio::system_category()));
+		tcp_acceptor acceptor(executor, address.ss_family == AF_INET6 ? tcp::v6() : tcp::v4(), handle);
+		co_await accept_connections(shard, acceptor, reuse_port);
+	}
+	catch (std::exception &e)
+	{
+		std::printf("Listener on fd %d Exception: %s\n", handle, e.what());
+	}
+}
+
+// Runs on the first shard once a new process has taken over the listening sockets.
+// This process closes its copies, then gives its sessions up to --drain-timeout to finish.
+awaitable<void> drain_sessions()
+{
+	draining = true;
+	stop_metrics_listeners();
+	for (auto &shard : shards)
+	{
+		asio::post(shard->io_context, [&shard = *shard]
+			{
+				for (tcp_acceptor *acceptor : shard.acceptors)
+				{
+					asio::error_code ec;
+					acceptor->close(ec);
+				}
+			});
+	}
+
+	auto remaining = [] { return admission.handshakes.load(std::memory_order_relaxed) + admission.sessions.load(std::memory_order_relaxed); };
+	std::printf("Listeners handed over, draining %zu sessions\n", remaining());
+	auto deadline = std::chrono::steady_clock::now() + settings.drain_timeout;
+	asio::steady_timer timer(co_await this_coro::executor);
+	while (remaining() > 0 && std::chrono::steady_clock::now() < deadline)
+	{
+		asio::error_code ec;
+		timer.expires_after(drain_poll_interval);
+		co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+	}
+
+	std::printf("Drained, closing %zu sessions\n", remaining());
+	for (auto &shard : shards)
+		shard->io_context.stop();
+}
+
+// Gives the listening sockets to each new process that connects to --handoff-socket,
+// until one of them confirms that it accepts on them.
+awaitable<void> serve_handoff(asio::local::stream_protocol::acceptor acceptor)
+{
+	while (true)
+	{
+		asio::error_code ec;
+		asio::local::stream_protocol::socket connection = co_await acceptor.async_accept(asio::redirect_error(asio::use_awaitable, ec));
+		if (ec)
+			co_return;
+
+		std::vector<int> handles;
+		std::string kinds;
+		{
+			std::scoped_lock lock(listener_mutex);
+			handles.assign(listener_handles.begin(), listener_handles.end());
+			kinds.assign(handles.size(), handoff_socks_listener);
+		}
+		for (int handle : metrics_listener_handles())
+		{
+			handles.push_back(handle);
+			kinds.push_back(handoff_metrics_listener);
+		}
+
+		std::string error;
+		if (!send_listeners(connection.native_handle(), handles, kinds, error))
+		{
+			std::printf("Listener handoff failed: %s\n", error.c_str());
+			continue;
+		}
+
+		std::array<uint8_t, 1> taken_over = {};
+		co_await asio::async_read(connection, asio::buffer(taken_over), asio::transfer_all(), asio::redirect_error(asio::use_awaitable, ec));
+		if (ec)
+		{
+			std::printf("The new process exited before taking over the listeners\n");
+			continue;
+		}
+
+		// The path now belongs to the new process, so it is not removed.
+		acceptor.close(ec);
+		co_await drain_sessions();
+		co_return;
+	}
+}
+
+// Replaces whatever is at `path`: a stale socket, or that of the process being replaced.
+asio::local::stream_protocol::acceptor open_handoff_acceptor(const asio::any_io_executor &executor, const char *path)
+{
+	unlink(path);
+	return asio::local::stream_protocol::acceptor(executor, asio::local::stream_protocol::endpoint(path));
+}
+#endif
+
+void pin_thread_to_cpu(size_t index)
+{
+	size_t cpu_count = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+#ifdef __linux__
+	cpu_set_t cpu_set;
+	CPU_ZERO(&cpu_set);
+	CPU_SET(index % cpu_count, &cpu_set);
+	if (int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set); err != 0)
+		std::printf("Failed to pin shard %zu to CPU %zu: %s\n", index, index % cpu_count, std::strerror(err));
+#elif defined(_WIN32)
+	if (SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << (index % std::min<size_t>(cpu_count, sizeof(DWORD_PTR) * 8))) == 0)
+		std::printf("Failed to pin shard %zu to CPU %zu\n", index, index % cpu_count);
+#else
+	std::printf("CPU affinity is not supported on this system\n");
+#endif
+}
+
+void run_shard(server_shard &shard, bool cpu_affinity)
+{
+	current_shard = &shard;
+	if (cpu_affinity)
+		pin_thread_to_cpu(shard.index);
+
+	auto work_guard = asio::make_work_guard(shard.io_context);
+	try
+	{
+		shard.io_context.run();
+	}
+	catch (std::exception &e)
+	{
+		std::printf("Shard %zu Exception: %s\n", shard.index, e.what());
+	}
+}
+
+// Parses "UP:DOWN" in KiB/s, where 0 means unlimited.
+bool parse_rate_limits(std::string_view value, rate_limits &limits)
+{
+	size_t separator = value.find(':');
+	if (separator == std::string_view::npos)
+		return false;
+
+	try
+	{
+		long long upload = std::stoll(std::string(value.substr(0, separator)));
+		long long download = std::stoll(std::string(value.substr(separator + 1)));
+		if (upload < 0 || download < 0)
+			return false;
+		limits.upload = (size_t)upload * 1024;
+		limits.download = (size_t)download * 1024;
+		return true;
+	}
+	catch (std::exception &)
+	{
+		return false;
+	}
+}
+
+// Options come first, followed by the original positional arguments:
+// socks5demo [--threads N] [--cpu-affinity] [--relay copy|splice|uring] [--relay-buffer-max BYTES] [--uring-buffers N]
+//            [--dns-ttl SECONDS] [--dns-negative-ttl SECONDS] [--connect-attempt-delay MILLISECONDS]
+//            [--udp-batch N] [--udp-offload] [--udp-connected-sockets N] [--handshake-timeout SECONDS]
+//            [--tcp-idle-timeout SECONDS] [--udp-idle-timeout SECONDS] [--metrics-port PORT]
+//            [--max-handshakes N] [--max-sessions N] [--per-ip-rate N] [--relay-memory-budget MIB]
+//            [--session-rate UP:DOWN] [--global-rate UP:DOWN] [--user-rate USERNAME:UP:DOWN]...
+//            [--upstream HOST:PORT] [--upstream-auth USERNAME:PASSWORD] [--upstream-pool N]
+//            [--tcp-fast-open] [--tcp-defer-accept SECONDS] [--tcp-nodelay]
+//            [--credentials FILE] [--acl FILE] [--handoff-socket PATH] [--listen-fd FD]... [--drain-timeout SECONDS]
+//            [--access-log FILE] [--access-log-buffer RECORDS] [--trace-sample N]
+//            [port] [username password]
+bool parse_arguments(int argc, char *argv[], server_settings &settings)
+{
+	std::vector<const char *> positional;
+	std::optional<std::pair<std::string, std::string>> upstream_credentials;
+	std::optional<size_t> upstream_pool_size;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view arg = argv[i];
+		if (arg == "--threads")
+		{
+			if (i + 1 >= argc)
+			{
+				std::printf("Missing value of --threads\n");
+				return false;
+			}
+			int threads = std::stoi(argv[++i]);
+			if (threads < 0)
+			{
+				std::printf("Incorrect thread count: %d\n", threads);
+				return false;
+			}
+			settings.threads = threads == 0 ? std::max<size_t>(std::thread::hardware_concurrency(), 1) : (size_t)threads;
+		}
+		else if (arg == "--cpu-affinity")
+		{
+			settings.cpu_affinity = true;
+		}
+		else if (arg == "--tcp-fast-open")
+		{
+			settings.tcp_fast_open = true;
+		}
+		else if (arg == "--tcp-nodelay")
+		{
+			settings.tcp_nodelay = true;
+		}
+		else if (arg == "--tcp-defer-accept")
+		{
+			if (i + 1 >= argc)
+			{
+				std::printf("Missing value of --tcp-defer-accept\n");
+				return false;
+			}
+			int seconds = std::stoi(argv[++i]);
+			if (seconds < 0)
+			{
+				std::printf("Incorrect --tcp-defer-accept value: %d\n", seconds);
+				return false;
+			}
+			settings.tcp_defer_accept = std::chrono::seconds(seconds);
+		}
+		else if (arg == "--dns-ttl" || arg == "--dns-negative-ttl")
+		{
+			if (i + 1 >= argc)
+			{
+				std::printf("Missing value of %s\n", argv[i]);
+				return false;
+			}
+			int seconds = std::stoi(argv[i + 1]);
+			if (seconds < 0)
+			{
+				std::printf("Incorrect %s value: %d\n", argv[i], seconds);
+				return false;
+			}
+			(arg == "--dns-ttl" ? settings.dns_ttl : settings.dns_negative_ttl) = std::chrono::seconds(seconds);
+			i++;
+		}
+		else if (arg == "--connect-attempt-delay")
+		{
+			if (i + 1 >= argc)
+			{
+				std::printf("Missing value of --connect-attempt-delay\n");
+				return false;
+			}
+			int milliseconds = std::stoi(argv[++i]);
+			if (milliseconds < 10)
+			{
+				std::printf("Incorrect connection attempt delay: %d\n", milliseconds);
+				return false;
+			}
+			settings.connect_attempt_delay = std::chrono::milliseconds(milliseconds);
+		}
+		else if (arg == "--udp-batch")
+		{
+			if (i + 1 >= argc)
+			{
+				std::printf("Missing value of --udp-batch\n");
+				return false;
+			}
+			int batch = std::stoi(argv[++i]);
+			if (batch < 1 || batch > 1024)
+			{
+				std::printf("Incorrect UDP batch size: %d\n", batch);
+				return false;
+			}
+			settings.udp_batch = (size_t)batch;
+		}
+		else if (arg == "--udp-offload")
+		{
+			settings.udp_offload = true;
+		}
+		else if (arg == "--udp-connected-sockets")
+		{
+			if (i + 1 >= argc)
+			{
+				std::printf("Missing value of --udp-connected-sockets\n");
+				return false;
+			}
+			int count = std::stoi(argv[++i]);
+			if (count < 0 || count > (int)udp_destination_table_size)
+			{
+				std::printf("Incorrect number of connected UDP sockets: %d\n", count);
+				return false;
+			}
+			settings.udp_connected_sockets = (size_t)count;
+		}
+		else if (arg == "--handshake-timeout" || arg == "--tcp-idle-timeout" || arg == "--udp-idle-timeout")
+		{
+			if (i + 1 >= argc)
+			{
+				std::printf("Missing value of %s\n", argv[i]);
+				return false;
+			}
+			int seconds = std::stoi(argv[i + 1]);
+			if (seconds < 0)
+			{
+				std::printf("Incorrect %s value: %d\n", argv[i], seconds);
+				return false;
+			}
+			if (arg == "--handshake-timeout")
+				settings.handshake_timeout = std::chrono::seconds(seconds);
+			else if (arg == "--tcp-idle-timeout")
+				settings.tcp_idle_timeout = std::chrono::seconds(seconds);
+			else
+				settings.udp_idle_timeout = std::chrono::seconds(seconds);
+			i++;
+		}
+		else if (arg == "--handoff-socket")
+		{
+			if (i + 1 >= argc)
 			{
-				std::cerr << "Invalid SOCKS version or message length incorrect." << std::endl;
-				co_return;
+				std::printf("Missing value of --handoff-socket\n");
+				return false;
 			}
-			
-			// Length of Username
-			bytes_read = co_await asio::async_read(client_socket, asio::buffer(data, 1), asio::transfer_exactly(1), asio::use_awaitable);
-			if (bytes_read != 1)
-				co_return;
-			uint8_t username_length = data[0];
-			bytes_read = co_await asio::async_read(client_socket, asio::buffer(data, username_length), asio::transfer_exactly(username_length), asio::use_awaitable);
-			if (bytes_read != username_length)
-				co_return;
-			recv_username = std::string(data.data(), data.data() + username_length);
-
-			// Length of Password
-			bytes_read = co_await asio::async_read(client_socket, asio::buffer(data, 1), asio::transfer_exactly(1), asio::use_awaitable);
-			if (bytes_read != 1)
-				co_return;
-			uint8_t password_length = data[0];
-			bytes_read = co_await asio::async_read(client_socket, asio::buffer(data, password_length), asio::transfer_exactly(password_length), asio::use_awaitable);
-			if (bytes_read != password_length)
-				co_return;
-			recv_password = std::string(data.data(), data.data() + password_length);
-
-			data[0] = 1;
-			if (recv_username == username && recv_password == password)
+			settings.handoff_socket = argv[++i];
+		}
+		else if (arg == "--listen-fd")
+		{
+			if (i + 1 >= argc)
 			{
-				data[1] = 0;
-				co_await asio::async_write(client_socket, asio::buffer(data, 2));
+				std::printf("Missing value of --listen-fd\n");
+				return false;
 			}
-			else
+			int fd = std::stoi(argv[++i]);
+			if (fd < 0)
 			{
-				data[1] = 1;
-				co_await asio::async_write(client_socket, asio::buffer(data, 2));
-				co_return;
+				std::printf("Incorrect --listen-fd value: %d\n", fd);
+				return false;
 			}
+			settings.listen_fds.push_back(fd);
 		}
-
-		// 3. Request
-		bytes_read = co_await asio::async_read(client_socket, asio::buffer(data, 4), asio::transfer_exactly(4), asio::use_awaitable);
-		if (bytes_read != 4 || data[0] != socks_version)
+		else if (arg == "--drain-timeout")
 		{
-			std::cerr << "Invalid SOCKS version or message too short." << std::endl;
-			co_return;
+			if (i + 1 >= argc)
+			{
+				std::printf("Missing value of --drain-timeout\n");
+				return false;
+			}
+			int seconds = std::stoi(argv[++i]);
+			if (seconds < 0)
+			{
+				std::printf("Incorrect --drain-timeout value: %d\n", seconds);
+				return false;
+			}
+			settings.drain_timeout = std::chrono::seconds(seconds);
 		}
-
-		std::array<uint8_t, 32> reply = {};
-		unsigned int reply_size = 0;
-		uint8_t command = data[1];
-		uint8_t address_type = data[3];
-		std::unique_ptr<tcp::endpoint> tcp_endpoint;
-		std::string hostname;
-		uint16_t port = 0;
-
-		reply[0] = socks_version;
-
-		switch (address_type)
+		else if (arg == "--max-handshakes" || arg == "--max-sessions" || arg == "--per-ip-rate" || arg == "--relay-memory-budget")
 		{
-		case socks_atyp_ipv4:
+			if (i + 1 >= argc)
+			{
+				std::printf("Missing value of %s\n", argv[i]);
+				return false;
+			}
+			int value = std::stoi(argv[i + 1]);
+			if (value < 0)
+			{
+				std::printf("Incorrect %s value: %d\n", argv[i], value);
+				return false;
+			}
+			if (arg == "--max-handshakes")
+				settings.admission_limits.max_handshakes = (size_t)value;
+			else if (arg == "--max-sessions")
+				settings.admission_limits.max_sessions = (size_t)value;
+			else if (arg == "--per-ip-rate")
+				settings.admission_limits.per_ip_rate = (size_t)value;
+			else
+				settings.admission_limits.relay_memory_budget = (size_t)value * 1024 * 1024;
+			i++;
+		}
+		else if (arg == "--session-rate" || arg == "--global-rate")
 		{
-			bytes_read = co_await asio::async_read(client_socket, asio::buffer(data, 4), asio::transfer_exactly(4), asio::use_awaitable);
-			if (bytes_read != 4)
+			if (i + 1 >= argc)
 			{
-				std::cerr << "Error reading IPv4 address." << std::endl;
-				co_return;
+				std::printf("Missing value of %s\n", argv[i]);
+				return false;
 			}
-			asio::ip::address_v4::bytes_type address_bytes;
-			*(uint32_t *)address_bytes.data() = *(uint32_t *)data.data();
-			asio::ip::address_v4 address(address_bytes);
-			tcp_endpoint = std::make_unique<tcp::endpoint>(address, 0);
-			break;
+			if (!parse_rate_limits(argv[i + 1], arg == "--session-rate" ? settings.session_rate : settings.global_rate))
+			{
+				std::printf("Incorrect %s value: %s\n", argv[i], argv[i + 1]);
+				return false;
+			}
+			i++;
 		}
-		case socks_atyp_domain:
+		else if (arg == "--user-rate")
 		{
-			bytes_read = co_await asio::async_read(client_socket, asio::buffer(data, 1), asio::transfer_exactly(1), asio::use_awaitable);
-			if (bytes_read != 1)
+			if (i + 1 >= argc)
 			{
-				std::cerr << "Error reading domain length." << std::endl;
-				co_return;
+				std::printf("Missing value of --user-rate\n");
+				return false;
 			}
-			size_t domain_length = data[0];
-			bytes_read = co_await asio::async_read(client_socket, asio::buffer(data, domain_length), asio::transfer_exactly(domain_length), asio::use_awaitable);
-			if (bytes_read != domain_length)
+			// USERNAME:UP:DOWN, the username may contain ':' itself.
+			std::string_view value = argv[++i];
+			size_t separator = value.rfind(':');
+			separator = separator == std::string_view::npos || separator == 0 ? std::string_view::npos : value.rfind(':', separator - 1);
+			rate_limits limits;
+			if (separator == std::string_view::npos || separator == 0 || !parse_rate_limits(value.substr(separator + 1), limits))
 			{
-				std::cerr << "Error reading domain name." << std::endl;
-				co_return;
+				std::printf("Incorrect --user-rate value: %s\n", argv[i]);
+				return false;
 			}
-			hostname = std::string(data.begin(), data.begin() + domain_length);
-			break;
+			settings.user_rates.emplace_back(std::string(value.substr(0, separator)), limits);
 		}
-		case socks_atyp_ipv6:
+		else if (arg == "--upstream")
 		{
-			bytes_read = co_await asio::async_read(client_socket, asio::buffer(data, 16), asio::transfer_exactly(16), asio::use_awaitable);
-			if (bytes_read != 16)
+			if (i + 1 >= argc)
 			{
-				std::cerr << "Error reading IPv6 address." << std::endl;
-				co_return;
+				std::printf("Missing value of --upstream\n");
+				return false;
 			}
-			asio::ip::address_v6::bytes_type address_bytes;
-			std::copy_n(data.begin(), 16, address_bytes.begin());
-			asio::ip::address_v6 address(address_bytes);
-			tcp_endpoint = std::make_unique<tcp::endpoint>(address, 0);
-			break;
+			// HOST:PORT, with IPv6 addresses in brackets: [2001:db8::1]:1080
+			std::string_view value = argv[++i];
+			size_t separator = value.rfind(':');
+			std::string_view host = separator == std::string_view::npos ? "" : value.substr(0, separator);
+			if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+				host = host.substr(1, host.size() - 2);
+			int port = separator == std::string_view::npos ? 0 : std::stoi(std::string(value.substr(separator + 1)));
+			if (host.empty() || port < 1 || port > 65535)
+			{
+				std::printf("Incorrect upstream: %s\n", argv[i]);
+				return false;
+			}
+			if (!settings.upstream.has_value())
+				settings.upstream.emplace();
+			settings.upstream->host = host;
+			settings.upstream->port = (uint16_t)port;
 		}
-		default:
-			// Send "Address type not supported" reply
-			std::cerr << "Unsupported address type: " << static_cast<uint16_t>(address_type) << std::endl;
-			reply_size = socks_header_ipv4_size;
-			reply[1] = socks_reply_address_type_not_supported;
-			reply[3] = socks_atyp_ipv4;
-			co_await asio::async_write(client_socket, asio::buffer(reply, reply_size));
-			co_return;
+		else if (arg == "--acl")
+		{
+			if (i + 1 >= argc)
+			{
+				std::printf("Missing value of --acl\n");
+				return false;
+			}
+			settings.acl_file = argv[++i];
 		}
-
-		// Read port number
-		bytes_read = co_await asio::async_read(client_socket, asio::buffer(data, 2), asio::transfer_exactly(2), asio::use_awaitable);
-		if (bytes_read != 2)
+		else if (arg == "--access-log")
 		{
-			std::cerr << "Error reading port number." << std::endl;
-			co_return;
+			if (i + 1 >= argc)
+			{
+				std::printf("Missing value of --access-log\n");
+				return false;
+			}
+			settings.access_log_file = argv[++i];
 		}
-		port = ntohs(*((uint16_t *)data.data()));
-		if (tcp_endpoint != nullptr)
-			tcp_endpoint->port(port);
-
-		// 4. Establish Connection
-		switch (command)
+		else if (arg == "--access-log-buffer")
 		{
-		case socks_cmd_connect:
+			if (i + 1 >= argc)
+			{
+				std::printf("Missing value of --access-log-buffer\n");
+				return false;
+			}
+			int records = std::stoi(argv[++i]);
+			if (records <= 0)
+			{
+				std::printf("Incorrect --access-log-buffer value: %d\n", records);
+				return false;
+			}
+			settings.access_log_buffer = records;
+		}
+		else if (arg == "--trace-sample")
 		{
-			asio::error_code ec;
-			reply[1] = socks_reply_success;
-			if (address_type == socks_atyp_ipv6)
+			if (i + 1 >= argc)
 			{
-				reply_size = socks_header_ipv6_size;
-				reply[3] = socks_atyp_ipv6;
+				std::printf("Missing value of --trace-sample\n");
+				return false;
 			}
-			else
+			int sample = std::stoi(argv[++i]);
+			if (sample < 0)
 			{
-				reply_size = socks_header_ipv4_size;
-				reply[3] = socks_atyp_ipv4;
+				std::printf("Incorrect --trace-sample value: %d\n", sample);
+				return false;
 			}
-			
-			tcp_socket remote_socket(client_socket.get_executor());
-			if (tcp_endpoint == nullptr)
+			settings.trace_sample = sample;
+		}
+		else if (arg == "--credentials")
+		{
+			if (i + 1 >= argc)
 			{
-				tcp::resolver resolver(client_socket.get_executor());
-				tcp::resolver::results_type endpoints = co_await resolver.async_resolve(hostname, std::to_string(port), asio::redirect_error(asio::use_awaitable, ec));
-				if (endpoints.empty() || ec)
-				{
-					if (ec)
-						reply[1] = convert_error_code(ec);
-					if (endpoints.empty())
-						reply[1] = socks_reply_network_unreachable;
-					// 4. Send Reply
-					co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
-					break;
-				}
-
-				// starting from ASIO 1.31, the endpoints can be connected directly:
-				// tcp::endpoint connected_endpoint = co_await asio::async_connect(remote_socket, endpoints, asio::redirect_error(asio::use_awaitable, ec));
-				for (auto &&endpoint : endpoints)
-				{
-					co_await remote_socket.async_connect(endpoint, asio::redirect_error(asio::use_awaitable, ec));
-					if (!ec)
-					{
-						tcp_endpoint = std::make_unique<tcp::endpoint>(endpoint.endpoint());
-						break;
-					}
-				}
+				std::printf("Missing value of --credentials\n");
+				return false;
 			}
-
-			if (ec || tcp_endpoint == nullptr)
+			settings.credentials_file = argv[++i];
+		}
+		else if (arg == "--upstream-auth")
+		{
+			if (i + 1 >= argc)
 			{
-				if (ec)
-					reply[1] = convert_error_code(ec);
-				else
-					reply[1] = socks_reply_network_unreachable;
-				// 5. Send Reply
-				co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
-				break;
+				std::printf("Missing value of --upstream-auth\n");
+				return false;
 			}
-			else if (reply[3] != socks_atyp_ipv6 && tcp_endpoint->address().is_v6())
+			std::string_view value = argv[++i];
+			size_t separator = value.find(':');
+			if (separator == std::string_view::npos || separator == 0 || separator > 255 || value.size() - separator - 1 > 255)
 			{
-				reply_size = socks_header_ipv6_size;
-				reply[3] = socks_atyp_ipv6;
+				std::printf("Incorrect --upstream-auth value\n");
+				return false;
 			}
-
-			tcp_local_address = std::make_shared<asio::ip::address>(remote_socket.local_endpoint().address());
-
-			// 5. Send Reply
-			co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
-
-			// 6. Forward Traffic
-			std::make_shared<tcp_session>(std::move(client_socket), std::move(remote_socket))->start();
-			break;
+			upstream_credentials = { std::string(value.substr(0, separator)), std::string(value.substr(separator + 1)) };
 		}
-		case socks_cmd_bind:
+		else if (arg == "--upstream-pool")
 		{
-			if (tcp_local_address == nullptr)
+			if (i + 1 >= argc)
 			{
-				reply_size = socks_header_ipv4_size;
-				reply[0] = socks_version;
-				reply[1] = socks_reply_command_not_supported;
-				reply[3] = socks_atyp_ipv4;
-				co_await asio::async_write(client_socket, asio::buffer(reply, reply_size));
-				break;
+				std::printf("Missing value of --upstream-pool\n");
+				return false;
 			}
-
-			asio::error_code ec;
-			tcp_acceptor acceptor(client_socket.get_executor());
-			acceptor.set_option(asio::detail::socket_option::integer<SOL_SOCKET, SO_RCVTIMEO>{ 60000 });
-			uint16_t listener_port = acceptor.local_endpoint().port();
-			reply[1] = socks_reply_success;
-			if (tcp_local_address->is_v6())
+			int size = std::stoi(argv[++i]);
+			if (size < 0 || size > 1024)
 			{
-				reply_size = socks_header_ipv6_size;
-				reply[3] = socks_atyp_ipv6;
-				asio::ip::address_v6::bytes_type v6_bytes = tcp_local_address->to_v6().to_bytes();
-				std::copy(v6_bytes.begin(), v6_bytes.end(), reply.begin() + 4);
-				*(uint16_t *)(reply.data() + 20) = htons(listener_port);
-
+				std::printf("Incorrect upstream pool size: %d\n", size);
+				return false;
 			}
-			else
+			upstream_pool_size = (size_t)size;
+		}
+		else if (arg == "--metrics-port")
+		{
+			if (i + 1 >= argc)
 			{
-				reply_size = socks_header_ipv4_size;
-				reply[3] = socks_atyp_ipv4;
-				asio::ip::address_v4::bytes_type v4_bytes = tcp_local_address->to_v4().to_bytes();
-				*(uint32_t *)(reply.data() + 4)  = *(uint32_t *)v4_bytes.data();
-				*(uint16_t *)(reply.data() + 8) = htons(listener_port);
+				std::printf("Missing value of --metrics-port\n");
+				return false;
 			}
-
-			// BIND: First Reply
-			asio::async_write(client_socket, asio::buffer(reply, reply_size), [](const asio::error_code &e, size_t n) {});
-			std::make_shared<tcp_binding>(std::move(client_socket), std::move(acceptor))->start(reply);
-			break;
+			int port = std::stoi(argv[++i]);
+			if (port < 1 || port > 65535)
+			{
+				std::printf("Incorrect metrics port number: %d\n", port);
+				return false;
+			}
+			settings.metrics_port = (uint16_t)port;
 		}
-		case socks_cmd_udp_associate:
+		else if (arg == "--uring-buffers")
 		{
-			asio::error_code ec;
-			udp::endpoint initialise_endpoint;
-			asio::ip::address local_address = client_socket.local_endpoint().address();
-			if (local_address.is_v6())
+			if (i + 1 >= argc)
 			{
-				reply_size = socks_header_ipv6_size;
-				reply[3] = socks_atyp_ipv6;
-				initialise_endpoint = udp::endpoint(udp::v6(), 0);
+				std::printf("Missing value of --uring-buffers\n");
+				return false;
 			}
-			else
+			int buffers = std::stoi(argv[++i]);
+			if (buffers < 2 || buffers > 65535)
 			{
-				reply_size = socks_header_ipv4_size;
-				reply[3] = socks_atyp_ipv4;
-				initialise_endpoint = udp::endpoint(udp::v4(), 0);
+				std::printf("Incorrect number of io_uring buffers: %d\n", buffers);
+				return false;
 			}
-
-			if (tcp_endpoint == nullptr)
+			settings.uring_buffers = (size_t)buffers;
+		}
+		else if (arg == "--relay-buffer-max")
+		{
+			if (i + 1 >= argc)
 			{
-				udp::resolver resolver(client_socket.get_executor());
-				udp::resolver::results_type endpoints = co_await resolver.async_resolve(hostname, std::to_string(port), asio::redirect_error(asio::use_awaitable, ec));
-				if (ec || endpoints.empty())
-				{
-					if (ec)
-						reply[1] = convert_error_code(ec);
-					else if (endpoints.empty())
-						reply[1] = socks_reply_network_unreachable;
-					co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
-					break;
-				}
+				std::printf("Missing value of --relay-buffer-max\n");
+				return false;
 			}
-
-			udp_socket listen_udp_socket(client_socket.get_executor(), initialise_endpoint);
-			udp::endpoint binding_endpoint = listen_udp_socket.local_endpoint(ec);
-			if (ec)
+			int buffer_max = std::stoi(argv[++i]);
+			if (buffer_max < 512)
 			{
-				reply[1] = convert_error_code(ec);
-				// 5. Send Reply
-				co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
-				break;
+				std::printf("Incorrect relay buffer size: %d\n", buffer_max);
+				return false;
 			}
-
-			if (local_address.is_v6())
+			settings.relay_buffer_max = (size_t)buffer_max;
+		}
+		else if (arg == "--relay")
+		{
+			std::string_view mode = i + 1 < argc ? argv[++i] : "";
+			if (mode == "copy")
+				settings.relay = relay_mode::copy;
+			else if (mode == "splice")
+				settings.relay = linux_system ? relay_mode::splice : relay_mode::copy;
+			else if (mode == "uring" && io_uring_supported)
+				settings.relay = relay_mode::uring;
+			else if (mode == "uring")
 			{
-				asio::ip::address_v6::bytes_type v6_bytes = local_address.to_v6().to_bytes();
-				std::copy(v6_bytes.begin(), v6_bytes.end(), reply.begin() + 4);
-				*(uint16_t *)(reply.data() + 20) = htons(binding_endpoint.port());
+				std::printf("The uring relay mode needs a build with -DSOCKS5DEMO_IO_URING=ON\n");
+				return false;
 			}
 			else
 			{
-				asio::ip::address_v4::bytes_type v4_bytes = local_address.to_v4().to_bytes();
-				*(uint32_t *)(reply.data() + 4) = *(uint32_t *)v4_bytes.data();
-				*(uint16_t *)(reply.data() + 8) = htons(binding_endpoint.port());
+				std::printf("Incorrect relay mode: %s\n", mode.data());
+				return false;
 			}
-
-			// 5. Send Reply
-			co_await client_socket.async_write_some(asio::buffer(reply, reply_size));
-
-			// 6. Forward Traffic
-			std::make_shared<udp_session>(std::move(client_socket), std::move(listen_udp_socket))->start();
-			break;
 		}
-		default:
+		else if (arg.starts_with("--"))
 		{
-			std::cerr << "Unsupported command: " << static_cast<int>(command) << std::endl;
-			reply_size = socks_header_ipv4_size;
-			reply[0] = socks_version;
-			reply[1] = socks_reply_command_not_supported;
-			reply[3] = socks_atyp_ipv4;
-			co_await asio::async_write(client_socket, asio::buffer(reply, reply_size));
-			co_return;
+			std::printf("Unknown option: %s\n", argv[i]);
+			return false;
 		}
+		else
+		{
+			positional.push_back(argv[i]);
 		}
 	}
-	catch (std::exception &e)
-	{
-		std::printf("socks5_access Exception: %s\n", e.what());
-	}
-}
 
-awaitable<void> listener_ipv4(const char *username, const char *password, uint16_t port = 1080)
-{
-	asio::any_io_executor executor = co_await this_coro::executor;
-	try
+	if (positional.size() == 1 || positional.size() == 3)
 	{
-		tcp_acceptor acceptor(executor, { tcp::v4(), port });
-		while (true)
+		int port = std::stoi(positional[0]);
+		if (port < 1 || port > 65535)
 		{
-			tcp_socket socket = co_await acceptor.async_accept();
-			co_spawn(executor, socks5_access(std::move(socket), username, password), detached);
+			std::printf("Incorrect port number: %d\n", port);
+			return false;
 		}
+		settings.port = (uint16_t)port;
 	}
-	catch (std::exception &e)
+
+	if (positional.size() == 2)
 	{
-		std::printf("IPv4 socks5_listen Exception: %s\n", e.what());
+		settings.username = positional[0];
+		settings.password = positional[1];
+	}
+	else if (positional.size() == 3)
+	{
+		settings.username = positional[1];
+		settings.password = positional[2];
+	}
+	else if (positional.size() > 3)
+	{
+		std::printf("Incorrect arguments\n");
+		return false;
 	}
-}
 
-awaitable<void> listener_ipv6(const char *username, const char *password, uint16_t port = 1080)
-{
-	asio::any_io_executor executor = co_await this_coro::executor;
-	try
+	if (!linux_system && (settings.handoff_socket != nullptr || !settings.listen_fds.empty()))
 	{
-		tcp_acceptor acceptor(executor, { tcp::v6(), port });
-		while (true)
-		{
-			tcp_socket socket = co_await acceptor.async_accept();
-			co_spawn(executor, socks5_access(std::move(socket), username, password), detached);
-		}
+		std::printf("--handoff-socket and --listen-fd are only available on Linux\n");
+		return false;
 	}
-	catch (std::exception &e)
+
+	if (settings.upstream.has_value())
 	{
-		std::printf("IPv6 socks5_listen Exception: %s\n", e.what());
-		if constexpr (linux_system)
+		if (upstream_credentials.has_value())
+			std::tie(settings.upstream->username, settings.upstream->password) = *upstream_credentials;
+		if (upstream_pool_size.has_value())
+			settings.upstream->size = *upstream_pool_size;
+		settings.upstream->connect_attempt_delay = settings.connect_attempt_delay;
+		settings.upstream->timeout = settings.handshake_timeout;
+	}
+	else if (upstream_credentials.has_value() || upstream_pool_size.has_value())
+	{
+		std::printf("--upstream-auth and --upstream-pool need --upstream\n");
+		return false;
+	}
+
+	return true;
+}
+
+// The username and password on the command line, and the entries of --credentials FILE.
+// Runs on its own thread when reloading, so that a large file does not hold up a shard.
+bool load_credentials()
+{
+	auto table = std::make_shared<credential_table>();
+	if (settings.username != nullptr && settings.password != nullptr)
+		table->add(settings.username, settings.password);
+
+	if (settings.credentials_file != nullptr)
+	{
+		std::string error;
+		if (!table->load(settings.credentials_file, error))
 		{
-			std::printf("Fallback to IPv4\n");
-			co_spawn(executor, listener_ipv4(nullptr, nullptr), detached);
+			std::printf("Credentials not loaded: %s\n", error.c_str());
+			return false;
 		}
+		std::printf("Loaded %zu credentials\n", table->size());
 	}
+
+	if (settings.credentials_file != nullptr || table->size() > 0)
+		credentials.publish(std::move(table));
+	return true;
 }
 
 int main(int argc, char *argv[])
 {
 	try
 	{
-		asio::io_context io_context;
-
-		asio::signal_set signals(io_context, SIGINT, SIGTERM);
-		signals.async_wait([&](auto, auto) { io_context.stop(); });
-
-		if (argc == 1)
+		if (!parse_arguments(argc, argv, settings))
+			return 1;
+		admission.configure(settings.admission_limits);
+		bandwidth.configure(settings.session_rate, settings.global_rate, settings.user_rates);
+		configure_tracing(settings.trace_sample);
+		if (!load_credentials())
+			return 1;
+		if (settings.acl_file != nullptr)
 		{
-			co_spawn(io_context, listener_ipv6(nullptr, nullptr), detached);
-			if constexpr (!linux_system)
-				co_spawn(io_context, listener_ipv4(nullptr, nullptr), detached);
+			std::string error;
+			if (!acl.load(settings.acl_file, error))
+			{
+				std::printf("ACL not loaded: %s\n", error.c_str());
+				return 1;
+			}
+			std::printf("Loaded %zu ACL rules\n", acl.rule_count());
 		}
-		else if (argc == 2)
+		if (settings.access_log_file != nullptr)
 		{
-			int port = std::stoi(argv[1]);
-			if (port < 1 || port > 65535)
+			std::string error;
+			if (!access_log.open(settings.access_log_file, settings.access_log_buffer, error))
 			{
-				std::printf("Incorrect port number: %d\n", port);
+				std::printf("Access log not opened: %s\n", error.c_str());
 				return 1;
 			}
-			co_spawn(io_context, listener_ipv6(nullptr, nullptr, (uint16_t)port), detached);
-			if constexpr (!linux_system)
-				co_spawn(io_context, listener_ipv4(nullptr, nullptr, (uint16_t)port), detached);
 		}
-		else if (argc == 3)
+#ifdef SOCKS5DEMO_IO_URING
+		// Writes through the ring cannot pass MSG_NOSIGNAL, so a peer that has gone away raises SIGPIPE.
+		if (settings.relay == relay_mode::uring)
+			std::signal(SIGPIPE, SIG_IGN);
+#endif
+
+		for (size_t i = 0; i < settings.threads; i++)
+			shards.emplace_back(std::make_unique<server_shard>(i));
+
+		bool reuse_port = reuse_port_supported && shards.size() > 1;
+		std::vector<int> metrics_fds;
+#ifdef __linux__
+		int handoff_connection = -1;
+		if (settings.handoff_socket != nullptr)
 		{
-			co_spawn(io_context, listener_ipv6(argv[1], argv[2]), detached);
-			if constexpr (!linux_system)
-				co_spawn(io_context, listener_ipv4(argv[1], argv[2]), detached);
+			std::string error;
+			handoff_connection = connect_handoff(settings.handoff_socket, error);
+			if (handoff_connection < 0 && !error.empty())
+			{
+				std::printf("Listener handoff failed: %s\n", error.c_str());
+				return 1;
+			}
+
+			std::vector<int> handles;
+			std::string kinds;
+			if (handoff_connection >= 0 && !receive_listeners(handoff_connection, handles, kinds, error))
+			{
+				std::printf("Listener handoff failed: %s\n", error.c_str());
+				return 1;
+			}
+			for (size_t i = 0; i < handles.size(); i++)
+				(kinds[i] == handoff_metrics_listener ? metrics_fds : settings.listen_fds).push_back(handles[i]);
+			if (handoff_connection >= 0)
+				std::printf("Took over %zu listening sockets from %s\n", handles.size(), settings.handoff_socket);
 		}
-		else if (argc == 4)
+
+		if (!settings.listen_fds.empty())
 		{
-			int port = std::stoi(argv[1]);
-			if (port < 1 || port > 65535)
+			// With one socket per shard, as a previous process started with the same --threads has,
+			// each shard keeps accepting on its own SO_REUSEPORT socket. Otherwise the first shard
+			// accepts on all of them and hands the connections out.
+			bool spread = reuse_port && settings.listen_fds.size() >= shards.size();
+			for (size_t i = 0; i < settings.listen_fds.size(); i++)
 			{
-				std::printf("Incorrect port number: %d\n", (uint16_t)port);
-				return 1;
+				server_shard &shard = spread ? *shards[i % shards.size()] : *shards.front();
+				co_spawn(shard.io_context, listener_inherited(shard, settings.listen_fds[i], spread), detached);
 			}
-			co_spawn(io_context, listener_ipv6(argv[2], argv[3], port), detached);
-			if constexpr (!linux_system)
-				co_spawn(io_context, listener_ipv4(argv[2], argv[3], port), detached);
 		}
 		else
+#endif
+		for (auto &shard : shards)
 		{
-			std::printf("Incorrect arguments\n");
-			return 1;
+			if (!reuse_port && shard->index > 0)
+				break;
+			co_spawn(shard->io_context, listener_ipv6(*shard, settings.port, reuse_port), detached);
+			if constexpr (!linux_system)
+				co_spawn(shard->io_context, listener_ipv4(*shard, settings.port, reuse_port), detached);
+		}
+
+		if (settings.metrics_port != 0 || !metrics_fds.empty())
+			co_spawn(shards.front()->io_context, metrics_listener(settings.metrics_port, std::move(metrics_fds)), detached);
+
+#ifdef __linux__
+		if (settings.handoff_socket != nullptr)
+		{
+			co_spawn(shards.front()->io_context, serve_handoff(open_handoff_acceptor(shards.front()->io_context.get_executor(), settings.handoff_socket)), detached);
+			if (handoff_connection >= 0)
+			{
+				// Tells the previous process that it can stop accepting.
+				uint8_t taken_over = 1;
+				if (send(handoff_connection, &taken_over, sizeof(taken_over), MSG_NOSIGNAL) != sizeof(taken_over))
+					std::printf("Could not confirm the handoff, the previous process keeps accepting\n");
+				close(handoff_connection);
+			}
 		}
+#endif
+
+		asio::signal_set signals(shards.front()->io_context, SIGINT, SIGTERM);
+		signals.async_wait([&](auto, auto)
+			{
+				for (auto &shard : shards)
+					shard->io_context.stop();
+			});
+
+#ifdef SIGHUP
+		// SIGHUP reloads --credentials FILE and reopens --access-log FILE. Handshakes keep going
+		// with the old table until the new one is complete, and it stays in use if the file is broken.
+		asio::thread_pool credential_loader(1);
+		asio::signal_set reload_signals(shards.front()->io_context, SIGHUP);
+		std::function<void(const asio::error_code &, int)> reload = [&](const asio::error_code &ec, int)
+		{
+			if (ec)
+				return;
+			if (settings.credentials_file != nullptr)
+				asio::post(credential_loader, load_credentials);
+			access_log.reopen();
+			reload_signals.async_wait(reload);
+		};
+		reload_signals.async_wait(reload);
+#endif
 
-		io_context.run();
+#ifdef SIGUSR1
+		// SIGUSR1 prints the stage latencies of the sampled connections.
+		asio::signal_set dump_signals(shards.front()->io_context, SIGUSR1);
+		std::function<void(const asio::error_code &, int)> dump = [&](const asio::error_code &ec, int)
+		{
+			if (ec)
+				return;
+			std::printf("%s", render_trace_table().c_str());
+			std::fflush(stdout);
+			dump_signals.async_wait(dump);
+		};
+		dump_signals.async_wait(dump);
+#endif
+
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < shards.size(); i++)
+			threads.emplace_back(run_shard, std::ref(*shards[i]), settings.cpu_affinity);
+
+		run_shard(*shards.front(), settings.cpu_affinity);
+
+		for (auto &thread : threads)
+			thread.join();
+
+		// Destroying the shards ends the sessions that are still open, and each of them
+		// leaves its access log record on this thread. The writer takes them in its last pass.
+		shards.clear();
+		access_log.stop();
 	}
 	catch (std::exception &e)
 	{
 		std::printf("Exception: %s\n", e.what());
 	}
 	return 0;
-}
\ No newline at end of file
+}
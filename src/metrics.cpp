@@ -0,0 +1,295 @@
+﻿#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "socks5_defines.hpp"
+#include "metrics.hpp"
+#include "admission.hpp"
+#include "latency_trace.hpp"
+
+namespace
+{
+	thread_registry<thread_metrics> registry;
+
+	constexpr const char *command_names[] = { "connect", "bind", "udp_associate", "other" };
+	constexpr const char *address_names[] = { "ipv4", "domain", "ipv6", "other" };
+	constexpr const char *reply_names[] =
+	{
+		"succeeded", "general_failure", "connection_not_allowed", "network_unreachable", "host_unreachable",
+		"connection_refused", "ttl_expired", "command_not_supported", "address_type_not_supported", "other"
+	};
+	constexpr const char *reassembly_names[] = { "complete", "dropped", "expired" };
+	constexpr const char *session_names[] = { "handshake", "tcp", "tcp_bind", "udp" };
+	constexpr const char *direction_names[] = { "upload", "download" };
+
+	constexpr auto request_timeout = std::chrono::seconds(10);
+	constexpr auto accept_error_retry_interval = std::chrono::milliseconds(100);
+}
+
+thread_metrics& local_metrics()
+{
+	thread_local thread_metrics &metrics = registry.add();
+	return metrics;
+}
+
+void metric_handshake(uint8_t command, uint8_t address_type)
+{
+	size_t command_slot = command >= socks_cmd_connect && command <= socks_cmd_udp_associate ? command - socks_cmd_connect : 3;
+	size_t address_slot = 3;
+	switch (address_type)
+	{
+	case socks_atyp_ipv4:
+		address_slot = 0;
+		break;
+	case socks_atyp_domain:
+		address_slot = 1;
+		break;
+	case socks_atyp_ipv6:
+		address_slot = 2;
+		break;
+	}
+	metric_add<uint64_t>(local_metrics().handshakes[command_slot][address_slot]);
+}
+
+void metric_reply(uint8_t reply_code)
+{
+	metric_add<uint64_t>(local_metrics().replies[std::min<size_t>(reply_code, thread_metrics::reply_slots - 1)]);
+}
+
+std::string render_metrics()
+{
+	uint64_t accepted_connections = 0, auth_failures = 0, rate_limited_connections = 0, accept_pauses = 0, accept_errors = 0;
+	uint64_t upstream_pooled = 0, upstream_dialled = 0, acl_denied_datagrams = 0, access_log_dropped = 0;
+	uint64_t handshakes[thread_metrics::command_slots][thread_metrics::address_slots] = {};
+	uint64_t replies[thread_metrics::reply_slots] = {};
+	uint64_t tcp_bytes[2] = {}, udp_bytes[2] = {};
+	uint64_t udp_reassembly[3] = {};
+	int64_t active_sessions[(size_t)metric_session::count] = {};
+	for (thread_metrics *metrics : registry.snapshot())
+	{
+		accepted_connections += metrics->accepted_connections.load(std::memory_order_relaxed);
+		auth_failures += metrics->auth_failures.load(std::memory_order_relaxed);
+		rate_limited_connections += metrics->rate_limited_connections.load(std::memory_order_relaxed);
+		accept_pauses += metrics->accept_pauses.load(std::memory_order_relaxed);
+		accept_errors += metrics->accept_errors.load(std::memory_order_relaxed);
+		upstream_pooled += metrics->upstream_pooled.load(std::memory_order_relaxed);
+		upstream_dialled += metrics->upstream_dialled.load(std::memory_order_relaxed);
+		acl_denied_datagrams += metrics->acl_denied_datagrams.load(std::memory_order_relaxed);
+		access_log_dropped += metrics->access_log_dropped.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < 3; i++)
+			udp_reassembly[i] += metrics->udp_reassembly[i].load(std::memory_order_relaxed);
+		for (size_t i = 0; i < thread_metrics::command_slots; i++)
+			for (size_t j = 0; j < thread_metrics::address_slots; j++)
+				handshakes[i][j] += metrics->handshakes[i][j].load(std::memory_order_relaxed);
+		for (size_t i = 0; i < thread_metrics::reply_slots; i++)
+			replies[i] += metrics->replies[i].load(std::memory_order_relaxed);
+		for (size_t i = 0; i < 2; i++)
+		{
+			tcp_bytes[i] += metrics->tcp_bytes[i].load(std::memory_order_relaxed);
+			udp_bytes[i] += metrics->udp_bytes[i].load(std::memory_order_relaxed);
+		}
+		for (size_t i = 0; i < (size_t)metric_session::count; i++)
+			active_sessions[i] += metrics->active_sessions[i].load(std::memory_order_relaxed);
+	}
+
+	std::string output;
+	output.reserve(4096);
+	auto line = [&output](const std::string &name, const std::string &labels, auto value)
+		{
+			output += name;
+			if (!labels.empty())
+				output += "{" + labels + "}";
+			output += " " + std::to_string(value) + "\n";
+		};
+
+	output += "# HELP socks5demo_accepted_connections_total TCP connections accepted by the listeners.\n";
+	output += "# TYPE socks5demo_accepted_connections_total counter\n";
+	line("socks5demo_accepted_connections_total", "", accepted_connections);
+
+	output += "# HELP socks5demo_rate_limited_connections_total Connections closed because their source address exceeded --per-ip-rate.\n";
+	output += "# TYPE socks5demo_rate_limited_connections_total counter\n";
+	line("socks5demo_rate_limited_connections_total", "", rate_limited_connections);
+
+	output += "# HELP socks5demo_accept_pauses_total Times a listener stopped accepting because an admission limit was reached.\n";
+	output += "# TYPE socks5demo_accept_pauses_total counter\n";
+	line("socks5demo_accept_pauses_total", "", accept_pauses);
+
+	output += "# HELP socks5demo_accept_errors_total Failed accepts, such as running out of file descriptors. The listener keeps going.\n";
+	output += "# TYPE socks5demo_accept_errors_total counter\n";
+	line("socks5demo_accept_errors_total", "", accept_errors);
+
+	output += "# HELP socks5demo_handshakes_total SOCKS5 requests by command and address type.\n";
+	output += "# TYPE socks5demo_handshakes_total counter\n";
+	for (size_t i = 0; i < thread_metrics::command_slots; i++)
+		for (size_t j = 0; j < thread_metrics::address_slots; j++)
+			line("socks5demo_handshakes_total", std::string("command=\"") + command_names[i] + "\",address_type=\"" + address_names[j] + "\"", handshakes[i][j]);
+
+	output += "# HELP socks5demo_auth_failures_total Rejected username / password authentications.\n";
+	output += "# TYPE socks5demo_auth_failures_total counter\n";
+	line("socks5demo_auth_failures_total", "", auth_failures);
+
+	output += "# HELP socks5demo_replies_total SOCKS5 replies sent, by reply code.\n";
+	output += "# TYPE socks5demo_replies_total counter\n";
+	for (size_t i = 0; i < thread_metrics::reply_slots; i++)
+		line("socks5demo_replies_total", std::string("code=\"") + reply_names[i] + "\"", replies[i]);
+
+	output += "# HELP socks5demo_upstream_connections_total CONNECT requests chained to the upstream proxy, by whether the connection came from the pool.\n";
+	output += "# TYPE socks5demo_upstream_connections_total counter\n";
+	line("socks5demo_upstream_connections_total", "source=\"pool\"", upstream_pooled);
+	line("socks5demo_upstream_connections_total", "source=\"dial\"", upstream_dialled);
+
+	output += "# HELP socks5demo_acl_denied_datagrams_total UDP datagrams dropped because --acl denies their destination.\n";
+	output += "# TYPE socks5demo_acl_denied_datagrams_total counter\n";
+	line("socks5demo_acl_denied_datagrams_total", "", acl_denied_datagrams);
+
+	output += "# HELP socks5demo_access_log_dropped_total Access log records dropped because the ring of their thread was full.\n";
+	output += "# TYPE socks5demo_access_log_dropped_total counter\n";
+	line("socks5demo_access_log_dropped_total", "", access_log_dropped);
+
+	output += "# HELP socks5demo_udp_reassembly_total Fragmented UDP datagrams, by whether they were reassembled, dropped out of order or expired.\n";
+	output += "# TYPE socks5demo_udp_reassembly_total counter\n";
+	for (size_t i = 0; i < 3; i++)
+		line("socks5demo_udp_reassembly_total", std::string("result=\"") + reassembly_names[i] + "\"", udp_reassembly[i]);
+
+	output += "# HELP socks5demo_relayed_bytes_total Payload bytes relayed, by protocol and direction.\n";
+	output += "# TYPE socks5demo_relayed_bytes_total counter\n";
+	for (size_t i = 0; i < 2; i++)
+	{
+		line("socks5demo_relayed_bytes_total", std::string("protocol=\"tcp\",direction=\"") + direction_names[i] + "\"", tcp_bytes[i]);
+		line("socks5demo_relayed_bytes_total", std::string("protocol=\"udp\",direction=\"") + direction_names[i] + "\"", udp_bytes[i]);
+	}
+
+	output += "# HELP socks5demo_active_sessions Sessions currently open, by type.\n";
+	output += "# TYPE socks5demo_active_sessions gauge\n";
+	for (size_t i = 0; i < (size_t)metric_session::count; i++)
+		line("socks5demo_active_sessions", std::string("type=\"") + session_names[i] + "\"", active_sessions[i]);
+
+	output += "# HELP socks5demo_relay_memory_bytes Relay buffer and pipe memory currently reserved.\n";
+	output += "# TYPE socks5demo_relay_memory_bytes gauge\n";
+	line("socks5demo_relay_memory_bytes", "", admission.relay_memory_used());
+
+	render_trace_metrics(output);
+	return output;
+}
+
+namespace
+{
+	asio::awaitable<void> serve_metrics(asio::ip::tcp::socket socket)
+	{
+		// A client that sends nothing, or stops reading, is cut off.
+		asio::steady_timer deadline(socket.get_executor());
+		deadline.expires_after(request_timeout);
+		deadline.async_wait([&socket](const asio::error_code &ec)
+			{
+				if (ec)
+					return;
+				asio::error_code close_ec;
+				socket.close(close_ec);
+			});
+
+		try
+		{
+			std::string request;
+			co_await asio::async_read_until(socket, asio::dynamic_buffer(request, 8192), "\r\n\r\n", asio::use_awaitable);
+
+			std::string body;
+			std::string status = "200 OK";
+			if (request.starts_with("GET /metrics ") || request.starts_with("GET / "))
+				body = render_metrics();
+			else if (request.starts_with("GET /trace "))
+				body = render_trace_table();
+			else
+				status = "404 Not Found";
+
+			std::string response = "HTTP/1.1 " + status + "\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: " + std::to_string(body.size()) + "\r\n"
+				"Connection: close\r\n\r\n" + body;
+			co_await asio::async_write(socket, asio::buffer(response), asio::use_awaitable);
+		}
+		catch (std::exception &)
+		{
+		}
+	}
+
+	// The acceptors of accept_metrics(), all on the thread that runs metrics_listener().
+	std::vector<asio::ip::tcp::acceptor *> metric_acceptors;
+
+	asio::awaitable<void> accept_metrics(asio::ip::tcp::acceptor acceptor)
+	{
+		asio::any_io_executor executor = co_await asio::this_coro::executor;
+		metric_acceptors.push_back(&acceptor);
+		asio::steady_timer retry(executor);
+		while (acceptor.is_open())
+		{
+			asio::error_code ec;
+			asio::ip::tcp::socket socket = co_await acceptor.async_accept(asio::redirect_error(asio::use_awaitable, ec));
+			if (ec == asio::error::operation_aborted)
+				break;
+			if (!ec)
+			{
+				asio::co_spawn(executor, serve_metrics(std::move(socket)), asio::detached);
+				continue;
+			}
+
+			// EMFILE and the like would fail again at once. Shard 0 also runs sessions, so it must not spin.
+			retry.expires_after(accept_error_retry_interval);
+			co_await retry.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+		}
+		std::erase(metric_acceptors, &acceptor);
+	}
+}
+
+asio::awaitable<void> metrics_listener(uint16_t port, std::vector<int> inherited)
+{
+	asio::any_io_executor executor = co_await asio::this_coro::executor;
+#ifdef __linux__
+	if (!inherited.empty())
+	{
+		for (int handle : inherited)
+		{
+			sockaddr_storage address = {};
+			socklen_t address_size = sizeof(address);
+			getsockname(handle, (sockaddr *)&address, &address_size);
+			asio::ip::tcp protocol = address.ss_family == AF_INET6 ? asio::ip::tcp::v6() : asio::ip::tcp::v4();
+			asio::co_spawn(executor, accept_metrics(asio::ip::tcp::acceptor(executor, protocol, handle)), asio::detached);
+		}
+		co_return;
+	}
+#endif
+
+	size_t listening = 0;
+	for (asio::ip::address address : { asio::ip::address(asio::ip::address_v4::loopback()), asio::ip::address(asio::ip::address_v6::loopback()) })
+	{
+		try
+		{
+			asio::ip::tcp::acceptor acceptor(executor, { address, port });
+			asio::co_spawn(executor, accept_metrics(std::move(acceptor)), asio::detached);
+			listening++;
+		}
+		catch (std::exception &e)
+		{
+			std::printf("Metrics listener on %s Exception: %s\n", address.to_string().c_str(), e.what());
+		}
+	}
+
+	if (listening == 0)
+		std::printf("Metrics endpoint is not available\n");
+}
+
+std::vector<int> metrics_listener_handles()
+{
+	std::vector<int> handles;
+	for (asio::ip::tcp::acceptor *acceptor : metric_acceptors)
+		handles.push_back((int)acceptor->native_handle());
+	return handles;
+}
+
+void stop_metrics_listeners()
+{
+	for (asio::ip::tcp::acceptor *acceptor : metric_acceptors)
+	{
+		asio::error_code ec;
+		acceptor->close(ec);
+	}
+}
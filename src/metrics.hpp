@@ -0,0 +1,109 @@
+﻿#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <asio.hpp>
+
+// Per-thread blocks that other threads read. Each thread adds its block once and keeps a
+// thread_local reference to it. Blocks stay registered after their thread exits, so
+// totals never go backwards and nothing written to them is lost.
+template<typename T>
+class thread_registry
+{
+public:
+	template<typename... Args>
+	T& add(Args&&... args)
+	{
+		std::scoped_lock lock(mutex);
+		return *blocks.emplace_back(std::make_unique<T>(std::forward<Args>(args)...));
+	}
+
+	// Every block so far. A block is never removed, so the pointers stay valid.
+	std::vector<T *> snapshot()
+	{
+		std::vector<T *> result;
+		std::scoped_lock lock(mutex);
+		result.reserve(blocks.size());
+		for (auto &block : blocks)
+			result.push_back(block.get());
+		return result;
+	}
+
+private:
+	std::mutex mutex;
+	std::vector<std::unique_ptr<T>> blocks;
+};
+
+enum class metric_session : uint8_t { handshake, tcp, tcp_binding, udp, count };
+enum class metric_direction : uint8_t { upload, download, count };
+
+// Counters of one thread. Only the owning thread writes them, so an update is a
+// relaxed load and store on a cache line that no other thread writes to.
+// The metrics endpoint sums the blocks of all threads when it is scraped.
+struct alignas(64) thread_metrics
+{
+	static constexpr size_t command_slots = 4;	// connect, bind, udp associate, other
+	static constexpr size_t address_slots = 4;	// ipv4, domain, ipv6, other
+	static constexpr size_t reply_slots = 10;	// reply codes 0x00 - 0x08, other
+
+	std::atomic<uint64_t> accepted_connections{};
+	std::array<std::array<std::atomic<uint64_t>, address_slots>, command_slots> handshakes{};
+	std::atomic<uint64_t> auth_failures{};
+	std::atomic<uint64_t> rate_limited_connections{};
+	std::atomic<uint64_t> accept_pauses{};
+	std::atomic<uint64_t> accept_errors{};
+	std::atomic<uint64_t> upstream_pooled{};
+	std::atomic<uint64_t> upstream_dialled{};
+	std::atomic<uint64_t> acl_denied_datagrams{};
+	std::atomic<uint64_t> access_log_dropped{};
+	std::array<std::atomic<uint64_t>, 3> udp_reassembly{};	// complete, dropped, expired
+	std::array<std::atomic<uint64_t>, reply_slots> replies{};
+	std::array<std::atomic<uint64_t>, (size_t)metric_direction::count> tcp_bytes{};
+	std::array<std::atomic<uint64_t>, (size_t)metric_direction::count> udp_bytes{};
+	std::array<std::atomic<int64_t>, (size_t)metric_session::count> active_sessions{};
+};
+
+thread_metrics& local_metrics();
+
+template<typename T>
+inline void metric_add(std::atomic<T> &counter, T value = 1)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void metric_handshake(uint8_t command, uint8_t address_type);
+void metric_reply(uint8_t reply_code);
+inline void metric_bytes(bool udp, metric_direction direction, size_t bytes)
+{
+	thread_metrics &metrics = local_metrics();
+	metric_add<uint64_t>((udp ? metrics.udp_bytes : metrics.tcp_bytes)[(size_t)direction], bytes);
+}
+
+// Counts one active session of the given type for as long as it lives.
+class metric_gauge
+{
+public:
+	explicit metric_gauge(metric_session type) : type(type) { metric_add<int64_t>(local_metrics().active_sessions[(size_t)type], 1); }
+	~metric_gauge() { metric_add<int64_t>(local_metrics().active_sessions[(size_t)type], -1); }
+	metric_gauge(const metric_gauge &) = delete;
+	metric_gauge& operator=(const metric_gauge &) = delete;
+
+private:
+	metric_session type;
+};
+
+// Sum of all threads in Prometheus text exposition format.
+std::string render_metrics();
+
+// Serves render_metrics() over HTTP on 127.0.0.1:port and [::1]:port, and the
+// latency table of render_trace_table() at /trace. Listens there, or on the
+// listening sockets a previous process handed over (see listener_handoff.hpp).
+asio::awaitable<void> metrics_listener(uint16_t port, std::vector<int> inherited = {});
+
+// For a handoff. Only to be called on the thread that runs metrics_listener().
+std::vector<int> metrics_listener_handles();
+void stop_metrics_listeners();
@@ -0,0 +1,59 @@
+﻿#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+// An immutable value that any thread may replace while the shards keep reading it.
+//
+// - store() swaps in a new value under a mutex and bumps the generation.
+// - Readers go through a cache of their own, usually a thread_local one. It only
+//   reads the generation, and takes the mutex for a new reference when the
+//   generation has moved on, so a read almost never waits.
+// - A value is freed when the last reader has moved on to a newer one.
+template<typename T>
+class published
+{
+public:
+	void store(std::shared_ptr<const T> value)
+	{
+		std::unique_lock lock(mutex);
+		current.swap(value);
+		generation.fetch_add(1, std::memory_order_release);
+		lock.unlock();	// the old value, in `value` now, is freed outside the lock
+	}
+
+	std::shared_ptr<const T> load() const
+	{
+		std::scoped_lock lock(mutex);
+		return current;
+	}
+
+	// 0 until the first store().
+	uint64_t version() const { return generation.load(std::memory_order_acquire); }
+
+	class cache
+	{
+	public:
+		// Valid until the next get() of this cache.
+		const std::shared_ptr<const T>& get(const published &source)
+		{
+			uint64_t latest = source.version();
+			if (cached_version != latest)
+			{
+				cached = source.load();
+				cached_version = latest;
+			}
+			return cached;
+		}
+
+	private:
+		std::shared_ptr<const T> cached;
+		uint64_t cached_version = 0;
+	};
+
+private:
+	mutable std::mutex mutex;
+	std::shared_ptr<const T> current;
+	std::atomic<uint64_t> generation{};
+};
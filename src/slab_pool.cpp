@@ -0,0 +1,99 @@
+﻿#include <new>
+#include "slab_pool.hpp"
+
+// Sits in front of every block. owner is nullptr for blocks from operator new.
+struct alignas(std::max_align_t) slab_pool::block_header
+{
+	slab_pool *owner;
+	block_header *next;
+	size_t size_class;
+};
+
+slab_pool& slab_pool::local()
+{
+	// Never destroyed: blocks may still be freed by other threads after this one exits.
+	thread_local slab_pool *pool = new slab_pool;
+	return *pool;
+}
+
+void* slab_pool::allocate(size_t size)
+{
+	size_t size_class = 0;
+	while (size_class < size_classes && (smallest_block << size_class) < size)
+		size_class++;
+
+	if (size_class == size_classes)
+	{
+		block_header *block = static_cast<block_header *>(::operator new(sizeof(block_header) + size));
+		block->owner = nullptr;
+		return block + 1;
+	}
+
+	return local().allocate_block(size_class);
+}
+
+void slab_pool::deallocate(void *pointer) noexcept
+{
+	if (pointer == nullptr)
+		return;
+
+	block_header *block = static_cast<block_header *>(pointer) - 1;
+	if (block->owner == nullptr)
+	{
+		::operator delete(block);
+		return;
+	}
+
+	slab_pool &pool = local();
+	if (block->owner == &pool)
+		pool.free_local(block);
+	else
+		block->owner->free_remote(block);
+}
+
+void* slab_pool::allocate_block(size_t size_class)
+{
+	if (free_lists[size_class] == nullptr)
+		collect_remote();
+
+	if (free_lists[size_class] == nullptr)
+	{
+		size_t block_size = sizeof(block_header) + (smallest_block << size_class);
+		std::byte *slab = slabs.emplace_back(std::make_unique<std::byte[]>(slab_size)).get();
+		for (size_t offset = 0; offset + block_size <= slab_size; offset += block_size)
+		{
+			block_header *block = new (slab + offset) block_header{ this, nullptr, size_class };
+			free_local(block);
+		}
+	}
+
+	block_header *block = free_lists[size_class];
+	free_lists[size_class] = block->next;
+	return block + 1;
+}
+
+void slab_pool::free_local(block_header *block) noexcept
+{
+	block->next = free_lists[block->size_class];
+	free_lists[block->size_class] = block;
+}
+
+void slab_pool::free_remote(block_header *block) noexcept
+{
+	block_header *head = remote_free.load(std::memory_order_relaxed);
+	do
+	{
+		block->next = head;
+	} while (!remote_free.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void slab_pool::collect_remote() noexcept
+{
+	block_header *block = remote_free.exchange(nullptr, std::memory_order_acquire);
+	while (block != nullptr)
+	{
+		block_header *next = block->next;
+		free_local(block);
+		block = next;
+	}
+}
@@ -0,0 +1,75 @@
+﻿#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Per-thread pool of fixed-size blocks for objects that are created and destroyed
+// once per connection. Each thread carves blocks of 64, 128, ... 8192 bytes out of
+// 64 KiB slabs and keeps freed blocks on a list of their size, so the steady state
+// of accepting and closing connections never reaches malloc.
+//
+// A block may be freed by any thread. A block freed by a thread other than its
+// owner is queued to the owner and reused the next time the owner allocates.
+// Larger requests go to operator new.
+class slab_pool
+{
+public:
+	static void* allocate(size_t size);
+	static void deallocate(void *pointer) noexcept;
+
+private:
+	struct block_header;
+	static constexpr size_t size_classes = 8;
+	static constexpr size_t smallest_block = 64;
+	static constexpr size_t slab_size = 64 * 1024;
+
+	static slab_pool& local();
+	void* allocate_block(size_t size_class);
+	void free_local(block_header *block) noexcept;
+	void free_remote(block_header *block) noexcept;
+	void collect_remote() noexcept;
+
+	std::array<block_header *, size_classes> free_lists = {};
+	std::atomic<block_header *> remote_free{ nullptr };
+	std::vector<std::unique_ptr<std::byte[]>> slabs;
+};
+
+template<typename T>
+struct slab_allocator
+{
+	static_assert(alignof(T) <= alignof(std::max_align_t), "slab blocks are aligned to max_align_t");
+	using value_type = T;
+
+	slab_allocator() noexcept = default;
+	template<typename U>
+	slab_allocator(const slab_allocator<U> &) noexcept {}
+
+	T* allocate(size_t n) { return static_cast<T *>(slab_pool::allocate(n * sizeof(T))); }
+	void deallocate(T *pointer, size_t) noexcept { slab_pool::deallocate(pointer); }
+
+	template<typename U>
+	bool operator==(const slab_allocator<U> &) const noexcept { return true; }
+};
+
+template<>
+struct slab_allocator<void>
+{
+	using value_type = void;
+
+	slab_allocator() noexcept = default;
+	template<typename U>
+	slab_allocator(const slab_allocator<U> &) noexcept {}
+
+	template<typename U>
+	bool operator==(const slab_allocator<U> &) const noexcept { return true; }
+};
+
+// std::make_shared with the object and its control block in one slab block.
+template<typename T, typename... Args>
+std::shared_ptr<T> make_pooled(Args&&... args)
+{
+	return std::allocate_shared<T>(slab_allocator<T>(), std::forward<Args>(args)...);
+}
@@ -0,0 +1,218 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <asio.hpp>
+#include "socks5_defines.hpp"
+
+// Encoding and decoding of the address part that SOCKS5 requests, replies and
+// UDP datagrams share. Every field is copied with memcpy or assembled byte by
+// byte, so nothing depends on alignment or host byte order, and no function
+// reads or writes outside the span it is given.
+
+constexpr size_t socks5_max_address_size = 1 + 1 + 255 + 2;	// ATYP | LEN | DOMAIN | PORT
+constexpr size_t socks5_udp_fixed_size = 3;					// RSV | FRAG
+
+// ATYP | DST.ADDR | DST.PORT, as it appears on the wire.
+// hostname points into the decoded input and is only set for socks_atyp_domain.
+struct socks5_address
+{
+	uint8_t address_type = 0;
+	std::array<uint8_t, 16> address = {};
+	std::string_view hostname;
+	uint16_t port = 0;
+};
+
+// RSV | FRAG | ATYP | DST.ADDR | DST.PORT in front of every UDP datagram.
+struct socks5_udp_header
+{
+	uint8_t frag = 0;
+	socks5_address destination;
+	size_t header_size = 0;
+};
+
+enum class socks5_decode_status : uint8_t { complete, need_more, unsupported };
+
+inline uint16_t read_port(const uint8_t *input)
+{
+	return (uint16_t)((input[0] << 8) | input[1]);
+}
+
+inline void write_port(uint8_t *output, uint16_t port)
+{
+	output[0] = (uint8_t)(port >> 8);
+	output[1] = (uint8_t)(port & 0xFF);
+}
+
+// Decodes ATYP | ADDR | PORT from the start of input. `consumed` is set when complete.
+inline socks5_decode_status decode_address(std::span<const uint8_t> input, socks5_address &result, size_t &consumed)
+{
+	if (input.empty())
+		return socks5_decode_status::need_more;
+
+	result.address_type = input[0];
+	size_t address_offset = 1;
+	size_t address_length = 0;
+	switch (result.address_type)
+	{
+	case socks_atyp_ipv4:
+		address_length = 4;
+		break;
+	case socks_atyp_ipv6:
+		address_length = 16;
+		break;
+	case socks_atyp_domain:
+		if (input.size() < 2)
+			return socks5_decode_status::need_more;
+		address_length = input[1];
+		address_offset = 2;
+		break;
+	default:
+		return socks5_decode_status::unsupported;
+	}
+
+	size_t total_size = address_offset + address_length + 2;
+	if (input.size() < total_size)
+		return socks5_decode_status::need_more;
+
+	if (result.address_type == socks_atyp_domain)
+		result.hostname = std::string_view((const char *)input.data() + address_offset, address_length);
+	else
+		std::memcpy(result.address.data(), input.data() + address_offset, address_length);
+
+	result.port = read_port(input.data() + address_offset + address_length);
+	consumed = total_size;
+	return socks5_decode_status::complete;
+}
+
+// Decodes the header of one client datagram. The payload starts at header.header_size,
+// which is never beyond datagram.size() when complete is returned.
+inline socks5_decode_status decode_udp_header(std::span<const uint8_t> datagram, socks5_udp_header &header)
+{
+	if (datagram.size() < socks5_udp_fixed_size)
+		return socks5_decode_status::need_more;
+
+	header.frag = datagram[2];
+	size_t address_size = 0;
+	socks5_decode_status status = decode_address(datagram.subspan(socks5_udp_fixed_size), header.destination, address_size);
+	if (status == socks5_decode_status::complete)
+		header.header_size = socks5_udp_fixed_size + address_size;
+	return status;
+}
+
+inline std::optional<asio::ip::address> to_ip_address(const socks5_address &address)
+{
+	if (address.address_type == socks_atyp_ipv4)
+	{
+		asio::ip::address_v4::bytes_type bytes;
+		std::memcpy(bytes.data(), address.address.data(), bytes.size());
+		return asio::ip::address_v4(bytes);
+	}
+
+	if (address.address_type == socks_atyp_ipv6)
+	{
+		asio::ip::address_v6::bytes_type bytes;
+		std::memcpy(bytes.data(), address.address.data(), bytes.size());
+		return asio::ip::address_v6(bytes);
+	}
+
+	return std::nullopt;
+}
+
+// Writes ATYP | ADDR | PORT. Returns the size written, or 0 if output is too small.
+inline size_t encode_address(const asio::ip::address &address, uint16_t port, std::span<uint8_t> output)
+{
+	if (address.is_v4())
+	{
+		if (output.size() < 1 + 4 + 2)
+			return 0;
+		asio::ip::address_v4::bytes_type bytes = address.to_v4().to_bytes();
+		output[0] = socks_atyp_ipv4;
+		std::memcpy(output.data() + 1, bytes.data(), bytes.size());
+		write_port(output.data() + 5, port);
+		return 1 + 4 + 2;
+	}
+
+	if (output.size() < 1 + 16 + 2)
+		return 0;
+	asio::ip::address_v6::bytes_type bytes = address.to_v6().to_bytes();
+	output[0] = socks_atyp_ipv6;
+	std::memcpy(output.data() + 1, bytes.data(), bytes.size());
+	write_port(output.data() + 17, port);
+	return 1 + 16 + 2;
+}
+
+// Size of ATYP | ADDR | PORT, known from its first two bytes. Returns 0 for an unknown ATYP.
+inline size_t encoded_address_size(uint8_t address_type, uint8_t second_byte)
+{
+	switch (address_type)
+	{
+	case socks_atyp_ipv4:
+		return 1 + 4 + 2;
+	case socks_atyp_ipv6:
+		return 1 + 16 + 2;
+	case socks_atyp_domain:
+		return 1 + 1 + (size_t)second_byte + 2;
+	default:
+		return 0;
+	}
+}
+
+// Writes a decoded address back in wire format. Returns the size written, or 0 if output is too small.
+inline size_t encode_address(const socks5_address &address, std::span<uint8_t> output)
+{
+	if (address.address_type != socks_atyp_domain)
+	{
+		std::optional<asio::ip::address> ip_address = to_ip_address(address);
+		return ip_address.has_value() ? encode_address(*ip_address, address.port, output) : 0;
+	}
+
+	size_t size = 1 + 1 + address.hostname.size() + 2;
+	if (address.hostname.size() > 255 || output.size() < size)
+		return 0;
+	output[0] = socks_atyp_domain;
+	output[1] = (uint8_t)address.hostname.size();
+	std::memcpy(output.data() + 2, address.hostname.data(), address.hostname.size());
+	write_port(output.data() + 2 + address.hostname.size(), address.port);
+	return size;
+}
+
+// Writes VER | CMD | RSV | ATYP | DST.ADDR | DST.PORT. Returns the size written, or 0 if output is too small.
+inline size_t encode_request(uint8_t command, const socks5_address &destination, std::span<uint8_t> output)
+{
+	if (output.size() < 3)
+		return 0;
+	output[0] = socks_version;
+	output[1] = command;
+	output[2] = 0;
+	size_t address_size = encode_address(destination, output.subspan(3));
+	return address_size == 0 ? 0 : 3 + address_size;
+}
+
+// Writes RSV | FRAG | ATYP | ADDR | PORT for a datagram from `address`.
+// Returns socks_header_ipv4_size or socks_header_ipv6_size, or 0 if output is too small.
+inline size_t encode_udp_header(const asio::ip::address &address, uint16_t port, std::span<uint8_t> output)
+{
+	if (output.size() < socks5_udp_fixed_size)
+		return 0;
+	output[0] = 0;
+	output[1] = 0;
+	output[2] = 0;
+	size_t address_size = encode_address(address, port, output.subspan(socks5_udp_fixed_size));
+	return address_size == 0 ? 0 : socks5_udp_fixed_size + address_size;
+}
+
+// Writes VER | REP | RSV | ATYP | BND.ADDR | BND.PORT. Returns the size written, or 0 if output is too small.
+inline size_t encode_reply(uint8_t reply_code, const asio::ip::address &address, uint16_t port, std::span<uint8_t> output)
+{
+	if (output.size() < 3)
+		return 0;
+	output[0] = socks_version;
+	output[1] = reply_code;
+	output[2] = 0;
+	size_t address_size = encode_address(address, port, output.subspan(3));
+	return address_size == 0 ? 0 : 3 + address_size;
+}
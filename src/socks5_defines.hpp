@@ -0,0 +1,39 @@
+﻿#pragma once
+#include <cstdint>
+
+constexpr uint8_t socks_version = 0x05;
+
+// SOCKS5 Method Codes
+constexpr uint8_t socks_method_no_auth = 0;
+constexpr uint8_t socks_method_gssapi = 0x01;
+constexpr uint8_t socks_method_user_pwd = 0x02;
+constexpr uint8_t socks_method_unacceptable = 0xFF;
+
+// Username / Password Authentication (RFC 1929)
+constexpr uint8_t socks_auth_version = 0x01;
+constexpr uint8_t socks_auth_success = 0x00;
+constexpr uint8_t socks_auth_failure = 0x01;
+
+// SOCKS5 Command Codes
+constexpr uint8_t socks_cmd_connect = 0x01;
+constexpr uint8_t socks_cmd_bind = 0x02;
+constexpr uint8_t socks_cmd_udp_associate = 0x03;
+
+// Address Types
+constexpr uint8_t socks_atyp_ipv4 = 0x01;
+constexpr uint8_t socks_atyp_domain = 0x03;
+constexpr uint8_t socks_atyp_ipv6 = 0x04;
+
+// SOCKS5 Reply Codes
+constexpr uint8_t socks_reply_success = 0x00;
+constexpr uint8_t socks_reply_general_failure = 0x01;
+constexpr uint8_t socks_reply_connection_not_allowed = 0x02;
+constexpr uint8_t socks_reply_network_unreachable = 0x03;
+constexpr uint8_t socks_reply_host_unreachable = 0x04;
+constexpr uint8_t socks_reply_connection_refused = 0x05;
+constexpr uint8_t socks_reply_ttl_expired = 0x06;
+constexpr uint8_t socks_reply_command_not_supported = 0x07;
+constexpr uint8_t socks_reply_address_type_not_supported = 0x08;
+
+constexpr unsigned int socks_header_ipv4_size = 10;
+constexpr unsigned int socks_header_ipv6_size = 22;
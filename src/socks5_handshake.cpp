@@ -0,0 +1,119 @@
+﻿#include <cstring>
+#include "socks5_defines.hpp"
+#include "socks5_codec.hpp"
+#include "socks5_handshake.hpp"
+
+std::span<uint8_t> socks5_handshake::prepare()
+{
+	if (buffer_begin > 0)
+	{
+		std::memmove(buffer.data(), buffer.data() + buffer_begin, buffer_end - buffer_begin);
+		buffer_end -= buffer_begin;
+		buffer_begin = 0;
+	}
+	return { buffer.data() + buffer_end, buffer.size() - buffer_end };
+}
+
+socks5_handshake::status socks5_handshake::parse()
+{
+	std::span<const uint8_t> input(buffer.data() + buffer_begin, buffer_end - buffer_begin);
+	size_t consumed = 0;
+	status result = status::malformed;
+	switch (current)
+	{
+	case stage::greeting:
+		result = parse_greeting(input, consumed);
+		break;
+	case stage::authentication:
+		result = parse_authentication(input, consumed);
+		break;
+	case stage::request:
+		result = parse_request(input, consumed);
+		break;
+	default:
+		break;
+	}
+
+	if (result == status::complete)
+		buffer_begin += consumed;
+	return result;
+}
+
+void socks5_handshake::select_method(uint8_t method)
+{
+	current = method == socks_method_user_pwd ? stage::authentication : stage::request;
+}
+
+// VER | NMETHODS | METHODS
+socks5_handshake::status socks5_handshake::parse_greeting(std::span<const uint8_t> input, size_t &consumed)
+{
+	if (input.size() < 2)
+		return status::need_more;
+	if (input[0] != socks_version)
+		return status::malformed;
+
+	size_t num_methods = input[1];
+	if (input.size() < 2 + num_methods)
+		return status::need_more;
+
+	methods_view = input.subspan(2, num_methods);
+	consumed = 2 + num_methods;
+	current = stage::request;
+	return status::complete;
+}
+
+// VER | ULEN | UNAME | PLEN | PASSWD
+socks5_handshake::status socks5_handshake::parse_authentication(std::span<const uint8_t> input, size_t &consumed)
+{
+	if (input.size() < 2)
+		return status::need_more;
+	if (input[0] != socks_auth_version)
+		return status::malformed;
+
+	size_t username_length = input[1];
+	if (input.size() < 2 + username_length + 1)
+		return status::need_more;
+
+	size_t password_length = input[2 + username_length];
+	if (input.size() < 2 + username_length + 1 + password_length)
+		return status::need_more;
+
+	username_view = std::string_view((const char *)input.data() + 2, username_length);
+	password_view = std::string_view((const char *)input.data() + 3 + username_length, password_length);
+	consumed = 3 + username_length + password_length;
+	current = stage::request;
+	return status::complete;
+}
+
+// VER | CMD | RSV | ATYP | DST.ADDR | DST.PORT
+// An unknown ATYP completes after 4 bytes, so the caller can reply with an error.
+socks5_handshake::status socks5_handshake::parse_request(std::span<const uint8_t> input, size_t &consumed)
+{
+	if (input.size() < 4)
+		return status::need_more;
+	if (input[0] != socks_version)
+		return status::malformed;
+
+	request_command = input[1];
+	request_address_type = input[3];
+	socks5_address destination;
+	size_t address_size = 0;
+	switch (decode_address(input.subspan(3), destination, address_size))
+	{
+	case socks5_decode_status::need_more:
+		return status::need_more;
+	case socks5_decode_status::unsupported:
+		consumed = 4;
+		current = stage::finished;
+		return status::complete;
+	default:
+		break;
+	}
+
+	address_bytes = destination.address;
+	hostname_view = destination.hostname;
+	request_port = destination.port;
+	consumed = 3 + address_size;
+	current = stage::finished;
+	return status::complete;
+}
@@ -0,0 +1,66 @@
+﻿#pragma once
+#include <array>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+// Incremental parser for the client side of a SOCKS5 handshake:
+// greeting, optional username / password sub-negotiation, then the request.
+//
+// All input goes into one buffer. parse() consumes whatever complete message
+// of the current stage is buffered, so a client that pipelines several messages
+// in one segment is served without reading again. The caller only needs to read
+// when parse() returns need_more.
+//
+// Views returned by the accessors point into the buffer and stay valid until
+// the next call of prepare().
+class socks5_handshake
+{
+public:
+	enum class stage : uint8_t { greeting, authentication, request, finished };
+	enum class status : uint8_t { need_more, complete, malformed };
+
+	// Free space for the next read. Compacts the consumed bytes away first.
+	std::span<uint8_t> prepare();
+	void commit(size_t bytes_read) { buffer_end += bytes_read; }
+
+	status parse();
+
+	// Called after the greeting; user / password selects the authentication stage.
+	void select_method(uint8_t method);
+
+	stage current_stage() const { return current; }
+
+	std::span<const uint8_t> methods() const { return methods_view; }
+	std::string_view username() const { return username_view; }
+	std::string_view password() const { return password_view; }
+
+	uint8_t command() const { return request_command; }
+	uint8_t address_type() const { return request_address_type; }
+	const std::array<uint8_t, 16>& address() const { return address_bytes; }
+	std::string_view hostname() const { return hostname_view; }
+	uint16_t port() const { return request_port; }
+
+	// Bytes the client sent behind the request, before receiving the reply.
+	std::span<const uint8_t> remaining() const { return { buffer.data() + buffer_begin, buffer_end - buffer_begin }; }
+
+private:
+	status parse_greeting(std::span<const uint8_t> input, size_t &consumed);
+	status parse_authentication(std::span<const uint8_t> input, size_t &consumed);
+	status parse_request(std::span<const uint8_t> input, size_t &consumed);
+
+	// Large enough for greeting, authentication and request sent back to back.
+	std::array<uint8_t, 1536> buffer = {};
+	size_t buffer_begin = 0;
+	size_t buffer_end = 0;
+	stage current = stage::greeting;
+
+	std::span<const uint8_t> methods_view;
+	std::string_view username_view;
+	std::string_view password_view;
+	uint8_t request_command = 0;
+	uint8_t request_address_type = 0;
+	std::array<uint8_t, 16> address_bytes = {};
+	std::string_view hostname_view;
+	uint16_t request_port = 0;
+};
@@ -0,0 +1,105 @@
+﻿#include "timer_wheel.hpp"
+
+void timer_wheel::start()
+{
+	asio::co_spawn(ticker.get_executor(), run(), asio::detached);
+}
+
+timer_wheel::timeout timer_wheel::add(std::chrono::steady_clock::duration duration, std::function<void()> on_expire)
+{
+	timeout result;
+	if (duration <= std::chrono::steady_clock::duration::zero())
+		return result;
+
+	uint64_t ticks = (uint64_t)((duration + tick - std::chrono::nanoseconds(1)) / tick);
+	auto item = std::make_shared<entry>();
+	item->on_expire = std::move(on_expire);
+	item->clock = &current_tick;
+	item->duration = std::max<uint64_t>(ticks, 1);
+	item->last_active = current_tick;
+	item->expire_tick = current_tick + item->duration;
+	insert(item);
+
+	result.item = std::move(item);
+	return result;
+}
+
+asio::awaitable<void> timer_wheel::run()
+{
+	auto next_tick = std::chrono::steady_clock::now() + tick;
+	while (true)
+	{
+		ticker.expires_at(next_tick);
+		asio::error_code ec;
+		co_await ticker.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+		if (ec)
+			co_return;
+
+		// Catch up if the thread was busy for longer than one tick.
+		auto now = std::chrono::steady_clock::now();
+		while (next_tick <= now)
+		{
+			advance();
+			next_tick += tick;
+		}
+	}
+}
+
+void timer_wheel::insert(std::shared_ptr<entry> item)
+{
+	uint64_t delay = item->expire_tick > current_tick ? item->expire_tick - current_tick : 1;
+	if (delay > max_delay)
+	{
+		delay = max_delay;
+		item->expire_tick = current_tick + max_delay;
+	}
+
+	size_t level = 0;
+	while (level + 1 < levels && delay >= (uint64_t(1) << (slot_bits * (level + 1))))
+		level++;
+
+	size_t slot = (item->expire_tick >> (slot_bits * level)) & (slots_per_level - 1);
+	wheel[level][slot].push_back(std::move(item));
+}
+
+void timer_wheel::advance()
+{
+	current_tick++;
+
+	// Move the entries of the next higher slot down when a lower level wraps around.
+	for (size_t level = 1; level < levels; level++)
+	{
+		if ((current_tick & ((uint64_t(1) << (slot_bits * level)) - 1)) != 0)
+			break;
+
+		size_t slot = (current_tick >> (slot_bits * level)) & (slots_per_level - 1);
+		std::vector<std::shared_ptr<entry>> cascading;
+		cascading.swap(wheel[level][slot]);
+		for (auto &item : cascading)
+		{
+			if (!item->cancelled)
+				insert(std::move(item));
+		}
+	}
+
+	std::vector<std::shared_ptr<entry>> due;
+	due.swap(wheel[0][current_tick & (slots_per_level - 1)]);
+	for (auto &item : due)
+	{
+		if (item->cancelled)
+			continue;
+
+		uint64_t deadline = item->last_active + item->duration;
+		if (deadline > current_tick)
+		{
+			item->expire_tick = deadline;
+			insert(std::move(item));
+			continue;
+		}
+
+		item->cancelled = true;
+		std::function<void()> on_expire = std::move(item->on_expire);
+		if (on_expire)
+			on_expire();
+	}
+}
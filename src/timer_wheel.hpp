@@ -0,0 +1,86 @@
+﻿#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <asio.hpp>
+
+// Hierarchical timer wheel shared by every session of one io_context.
+// One steady_timer ticks for the whole shard instead of one timer per session.
+//
+// A timeout fires once its duration has passed since the last touch(), give or
+// take one tick, so sessions only store the current tick on activity and never
+// re-arm anything.
+// An entry that comes due while it was touched recently is moved forward.
+//
+// Cancelled entries are dropped lazily when their slot comes up, so a timeout
+// can be destroyed at any time, even after the wheel itself is gone.
+class timer_wheel
+{
+	struct entry
+	{
+		std::function<void()> on_expire;
+		const uint64_t *clock = nullptr;
+		uint64_t duration = 0;
+		uint64_t last_active = 0;
+		uint64_t expire_tick = 0;
+		bool cancelled = false;
+	};
+
+public:
+	class timeout
+	{
+	public:
+		timeout() = default;
+		timeout(timeout &&other) noexcept = default;
+		timeout& operator=(timeout &&other) noexcept
+		{
+			cancel();
+			item = std::move(other.item);
+			return *this;
+		}
+		~timeout() { cancel(); }
+
+		void touch() { if (item != nullptr) item->last_active = *item->clock; }
+		void cancel()
+		{
+			if (item == nullptr)
+				return;
+			item->cancelled = true;
+			item->on_expire = nullptr;
+			item.reset();
+		}
+		explicit operator bool() const { return item != nullptr; }
+
+	private:
+		friend class timer_wheel;
+		std::shared_ptr<entry> item;
+	};
+
+	timer_wheel(const asio::any_io_executor &executor, std::chrono::milliseconds tick = std::chrono::seconds(1)) :
+		ticker(executor), tick(tick) {}
+
+	// Starts ticking. Must be called once, before the first add().
+	void start();
+
+	// on_expire is called on the io_context thread when `duration` has passed without touch().
+	// A zero duration returns an empty timeout that never fires.
+	timeout add(std::chrono::steady_clock::duration duration, std::function<void()> on_expire);
+
+private:
+	static constexpr unsigned slot_bits = 6;
+	static constexpr uint64_t slots_per_level = uint64_t(1) << slot_bits;
+	static constexpr size_t levels = 4;
+	static constexpr uint64_t max_delay = (uint64_t(1) << (slot_bits * levels)) - 1;
+
+	asio::awaitable<void> run();
+	void advance();
+	void insert(std::shared_ptr<entry> item);
+
+	asio::steady_timer ticker;
+	std::chrono::milliseconds tick;
+	uint64_t current_tick = 0;
+	std::array<std::array<std::vector<std::shared_ptr<entry>>, slots_per_level>, levels> wheel;
+};
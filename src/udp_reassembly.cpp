@@ -0,0 +1,108 @@
+﻿#include <algorithm>
+#include <cstring>
+#include "udp_reassembly.hpp"
+
+std::span<uint8_t> udp_reassembly::receive_space(size_t size)
+{
+	if (!active() || buffer.size() - used < size)
+		return {};
+	return std::span<uint8_t>(buffer.data() + used, size);
+}
+
+udp_reassembly::status udp_reassembly::add(std::span<uint8_t> datagram, const socks5_udp_header &header)
+{
+	uint8_t position = header.frag & ~last_fragment_flag;
+	if (active() && position <= last_position)
+		clear();
+
+	if (!active())
+	{
+		if (position != 1 || !start(datagram, header))
+			return status::dropped;
+	}
+	else if (position != last_position + 1 || header.header_size != first_header_size ||
+		!std::equal(datagram.begin() + socks5_udp_fixed_size, datagram.begin() + header.header_size, first_header_bytes.begin() + socks5_udp_fixed_size))
+	{
+		clear();
+		return status::dropped;
+	}
+
+	std::span<uint8_t> payload = datagram.subspan(header.header_size);
+	if (total_size + payload.size() > max_payload_size)
+	{
+		clear();
+		return status::dropped;
+	}
+
+	// A datagram from receive_space() is already where it belongs.
+	if (payload.data() < buffer.data() || payload.data() >= buffer.data() + buffer.size())
+	{
+		if (buffer.size() - used < payload.size())
+		{
+			clear();
+			return status::dropped;
+		}
+		std::copy(payload.begin(), payload.end(), buffer.begin() + used);
+		payload = std::span<uint8_t>(buffer.data() + used, payload.size());
+	}
+	used = payload.data() + payload.size() - buffer.data();
+	total_size += payload.size();
+	buffers.emplace_back(payload.data(), payload.size());
+	last_position = position;
+
+	if ((header.frag & last_fragment_flag) == 0)
+		return status::pending;
+
+	// Too many pieces for one sendmsg(): move the payloads together, front to back.
+	if (buffers.size() > max_gather_buffers)
+	{
+		size_t offset = 0;
+		for (const asio::const_buffer &piece : buffers)
+		{
+			std::memmove(buffer.data() + offset, piece.data(), piece.size());
+			offset += piece.size();
+		}
+		buffers.assign(1, asio::const_buffer(buffer.data(), offset));
+	}
+	last_position = 0;
+	return status::complete;
+}
+
+bool udp_reassembly::start(const std::span<uint8_t> datagram, const socks5_udp_header &header)
+{
+	// The buffer of an earlier sequence is reused. The datagram may lie in it.
+	clear();
+	if (buffer.empty())
+	{
+		if (!memory.try_reserve(buffer_size))
+			return false;
+		buffer.resize(buffer_size);
+	}
+
+	first_header_size = header.header_size;
+	std::copy_n(datagram.begin(), first_header_size, first_header_bytes.begin());
+	decode_udp_header(std::span<const uint8_t>(first_header_bytes.data(), first_header_size), first_header);
+	return true;
+}
+
+void udp_reassembly::abandon()
+{
+	if (active())
+		clear();
+}
+
+void udp_reassembly::release()
+{
+	clear();
+	if (!buffer.empty())
+		memory.release(buffer_size);
+	buffer = std::vector<uint8_t>();
+}
+
+void udp_reassembly::clear()
+{
+	buffers.clear();
+	used = 0;
+	total_size = 0;
+	last_position = 0;
+}
@@ -0,0 +1,77 @@
+﻿#pragma once
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+#include <asio.hpp>
+#include "socks5_codec.hpp"
+#include "admission.hpp"
+
+// Reassembly queue of one UDP association (RFC 1928, section 7).
+//
+// FRAG 1 to 127 is the position of a fragment, and its high bit marks the last
+// one. Fragments have to arrive in order: one whose position is not above the
+// last one abandons the sequence, and starts a new one if it is the first. A
+// gap, a different destination or a payload larger than an IPv4 datagram can
+// carry also abandons it. The reassembly timer is kept by the caller, which
+// calls release() when it expires.
+//
+// The fragments of a sequence are kept in one buffer, which only exists while
+// the sequence is under way and is charged to the relay memory budget. Later
+// fragments can be received straight into it (receive_space()), and the
+// payloads are handed out where they lie, as scatter/gather buffers, so the
+// reassembled datagram is never copied together.
+class udp_reassembly
+{
+public:
+	static constexpr uint8_t last_fragment_flag = 0x80;
+	static constexpr size_t max_payload_size = 65507;
+	static constexpr size_t buffer_size = 72 * 1024;
+
+	// asio hands at most 64 buffers to one sendmsg() and ignores the rest.
+	static constexpr size_t max_gather_buffers = 64;
+
+	enum class status : uint8_t { pending, complete, dropped };
+
+	explicit udp_reassembly(admission_control &admission) : memory(admission) {}
+
+	bool active() const { return last_position != 0; }
+
+	// Room for receiving the next datagram while a sequence is under way, or an empty span.
+	// Only valid until release() or the start of a new sequence, so nothing may wait on it.
+	std::span<uint8_t> receive_space(size_t size);
+
+	// `datagram` is a whole client datagram with a non-zero FRAG, and `header` its decoded header.
+	// The buffer is kept in every case, since the datagram may lie in it; release() it after
+	// anything but pending.
+	status add(std::span<uint8_t> datagram, const socks5_udp_header &header);
+
+	// Once add() has returned complete, and until release().
+	const socks5_udp_header& header() const { return first_header; }
+	const std::vector<asio::const_buffer>& payload() const { return buffers; }
+	size_t payload_size() const { return total_size; }
+
+	// Drops the sequence under way, if any. The buffer is kept, since the datagram
+	// that ended the sequence may lie in it; release() it once that is handled.
+	// A complete datagram is not affected.
+	void abandon();
+
+	// Drops the sequence under way, if any, and gives the buffer back.
+	void release();
+
+private:
+	bool start(const std::span<uint8_t> datagram, const socks5_udp_header &header);
+	void clear();
+
+	std::vector<uint8_t> buffer;
+	admission_control::relay_reservation memory;
+	size_t used = 0;
+	size_t total_size = 0;
+	uint8_t last_position = 0;
+	std::vector<asio::const_buffer> buffers;
+
+	// The first fragment decides the destination, and the others must repeat it.
+	std::array<uint8_t, socks5_udp_fixed_size + socks5_max_address_size> first_header_bytes = {};
+	size_t first_header_size = 0;
+	socks5_udp_header first_header;
+};
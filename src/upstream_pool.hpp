@@ -0,0 +1,346 @@
+﻿#pragma once
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <asio.hpp>
+#include "dns_cache.hpp"
+#include "happy_eyeballs.hpp"
+#include "socks5_codec.hpp"
+#include "socks5_defines.hpp"
+
+// Per-shard pool of connections to an upstream SOCKS5 proxy, used to chain
+// CONNECT requests. Like dns_cache, it belongs to one io_context and is only
+// used by the thread that runs it.
+//
+// Pooled connections have already finished the greeting and, if configured,
+// the username / password sub-negotiation, so a CONNECT through the upstream
+// costs one round trip: the request and its reply.
+//
+// - The pool keeps `size` idle connections, dialling new ones in the background.
+// - An idle connection that the upstream closes is dropped at once. One older
+//   than `idle_lifetime` is replaced before the upstream's handshake timeout.
+// - acquire() dials directly when the pool is empty.
+// - Dialling, and each request on a connection, fail with timed_out after
+//   `timeout`, so an upstream that accepts but never answers ties nothing up.
+template<typename Socket>
+class upstream_pool
+{
+public:
+	struct config
+	{
+		std::string host;
+		uint16_t port = 1080;
+		std::string username;
+		std::string password;
+		size_t size = 4;
+		std::chrono::milliseconds connect_attempt_delay{ 250 };
+		std::chrono::seconds idle_lifetime{ 20 };
+		std::chrono::seconds timeout{ 30 };
+	};
+
+	upstream_pool(const asio::any_io_executor &executor, dns_cache &dns, const config &settings) :
+		executor(executor), dns(dns), settings(settings), wakeup(executor) {}
+
+	void start()
+	{
+		asio::co_spawn(executor, filler(), asio::detached);
+	}
+
+	// Sends a request for `destination` through the upstream.
+	// reply_code is the upstream's reply; ec is set when the upstream itself could not be used.
+	// A pooled connection that turns out to be closed is retried once on a new connection.
+	// Nothing waits on the upstream past `expiry`, the handshake deadline of the client.
+	asio::awaitable<Socket> connect(uint8_t command, const socks5_address &destination, std::chrono::steady_clock::time_point expiry,
+		uint8_t &reply_code, asio::error_code &ec, bool &pooled)
+	{
+		std::array<uint8_t, 3 + socks5_max_address_size> request = {};
+		size_t request_size = encode_request(command, destination, request);
+		if (request_size == 0)
+		{
+			ec = asio::error::invalid_argument;
+			co_return Socket(executor);
+		}
+
+		for (int attempt = 0; attempt < 2; attempt++)
+		{
+			Socket socket = co_await acquire(expiry, ec, pooled);
+			if (ec)
+				co_return socket;
+
+			expiry = std::min(expiry, std::chrono::steady_clock::now() + settings.timeout);
+		deadline guard(executor, expiry);
+			guard.watch(socket);
+			co_await asio::async_write(socket, asio::buffer(request.data(), request_size), asio::redirect_error(asio::use_awaitable, ec));
+			if (!ec)
+				reply_code = co_await read_reply(socket, ec);
+			if (ec && guard.expired())
+			{
+				ec = asio::error::timed_out;
+				co_return socket;
+			}
+			if (!ec || !pooled)
+				co_return socket;
+		}
+		co_return Socket(executor);
+	}
+
+private:
+	struct idle_connection
+	{
+		explicit idle_connection(Socket socket) : socket(std::move(socket)), created(std::chrono::steady_clock::now()) {}
+		Socket socket;
+		std::chrono::steady_clock::time_point created;
+		bool taken = false;
+	};
+
+	static constexpr auto retry_delay = std::chrono::seconds(1);
+
+	// Closes the sockets it watches if `expiry` comes before it is destroyed, which fails
+	// whatever is waiting on them. The sockets must stay where they are while watched.
+	class deadline
+	{
+	public:
+		deadline(const asio::any_io_executor &executor, std::chrono::steady_clock::time_point expiry) :
+			state(std::make_shared<timer_state>(executor))
+		{
+			state->timer.expires_at(expiry);
+			state->timer.async_wait([state = state](const asio::error_code &ec)
+				{
+					if (ec || state->finished)
+						return;
+					state->expired = true;
+					for (Socket *socket : state->sockets)
+					{
+						asio::error_code close_ec;
+						socket->close(close_ec);
+					}
+				});
+		}
+
+		~deadline()
+		{
+			state->finished = true;
+			state->timer.cancel();
+		}
+
+		// A socket watched after the expiry, at the end of a slow DNS lookup for instance, is closed at once.
+		void watch(Socket &socket)
+		{
+			state->sockets.push_back(&socket);
+			if (state->expired)
+			{
+				asio::error_code ec;
+				socket.close(ec);
+			}
+		}
+
+		bool expired() const { return state->expired; }
+
+	private:
+		// Outlives the deadline until the timer handler has run.
+		struct timer_state
+		{
+			explicit timer_state(const asio::any_io_executor &executor) : timer(executor) {}
+			asio::steady_timer timer;
+			std::vector<Socket *> sockets;
+			bool finished = false;
+			bool expired = false;
+		};
+
+		std::shared_ptr<timer_state> state;
+	};
+
+	asio::awaitable<Socket> acquire(std::chrono::steady_clock::time_point expiry, asio::error_code &ec, bool &pooled)
+	{
+		auto now = std::chrono::steady_clock::now();
+		while (!idle.empty())
+		{
+			// The newest connection is the least likely to have been closed by the upstream.
+			std::shared_ptr<idle_connection> connection = std::move(idle.back());
+			idle.pop_back();
+			connection->taken = true;
+			asio::error_code cancel_ec;
+			connection->socket.cancel(cancel_ec);
+			if (now - connection->created >= settings.idle_lifetime)
+			{
+				connection->socket.close(cancel_ec);
+				continue;
+			}
+
+			wakeup.cancel();
+			ec.clear();
+			pooled = true;
+			co_return std::move(connection->socket);
+		}
+
+		wakeup.cancel();
+		pooled = false;
+		co_return co_await dial(expiry, ec);
+	}
+
+	// Keeps the pool filled, and retires connections at the end of their lifetime.
+	asio::awaitable<void> filler()
+	{
+		while (true)
+		{
+			auto now = std::chrono::steady_clock::now();
+			while (!idle.empty() && now - idle.front()->created >= settings.idle_lifetime)
+			{
+				asio::error_code ec;
+				idle.front()->taken = true;
+				idle.front()->socket.close(ec);
+				idle.pop_front();
+			}
+
+			if (now >= retry_time)
+			{
+				for (; idle.size() + dialling < settings.size; dialling++)
+					asio::co_spawn(executor, add_connection(), asio::detached);
+			}
+
+			auto next_wakeup = asio::steady_timer::time_point::max();
+			if (!idle.empty())
+				next_wakeup = idle.front()->created + settings.idle_lifetime;
+			if (now < retry_time)
+				next_wakeup = std::min(next_wakeup, retry_time);
+
+			asio::error_code ec;
+			wakeup.expires_at(next_wakeup);
+			co_await wakeup.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+		}
+	}
+
+	asio::awaitable<void> add_connection()
+	{
+		asio::error_code ec;
+		Socket socket = co_await dial(std::chrono::steady_clock::time_point::max(), ec);
+		dialling--;
+		if (ec)
+		{
+			retry_time = std::chrono::steady_clock::now() + retry_delay;
+			wakeup.cancel();
+			co_return;
+		}
+
+		auto connection = std::make_shared<idle_connection>(std::move(socket));
+		idle.push_back(connection);
+		co_await watch(connection);
+	}
+
+	// An idle connection becomes readable only when the upstream closes it.
+	asio::awaitable<void> watch(std::shared_ptr<idle_connection> connection)
+	{
+		asio::error_code ec;
+		co_await connection->socket.async_wait(Socket::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+		if (connection->taken)
+			co_return;
+
+		connection->socket.close(ec);
+		std::erase(idle, connection);
+		wakeup.cancel();
+	}
+
+	// Connects and finishes the greeting and authentication, within settings.timeout and before `expiry`.
+	asio::awaitable<Socket> dial(std::chrono::steady_clock::time_point expiry, asio::error_code &ec)
+	{
+		expiry = std::min(expiry, std::chrono::steady_clock::now() + settings.timeout);
+		deadline guard(executor, expiry);
+		std::vector<typename Socket::endpoint_type> candidates;
+		asio::ip::address address = asio::ip::make_address(settings.host, ec);
+		if (!ec)
+		{
+			candidates.emplace_back(address, settings.port);
+		}
+		else
+		{
+			dns_cache::address_list addresses = co_await dns.resolve(settings.host, ec);
+			if (ec || addresses == nullptr || addresses->empty())
+			{
+				if (!ec)
+					ec = asio::error::host_not_found;
+				co_return Socket(executor);
+			}
+			for (auto &&resolved : *addresses)
+				candidates.emplace_back(resolved, settings.port);
+		}
+
+		typename Socket::endpoint_type connected_endpoint;
+		Socket socket = co_await happy_eyeballs_connect<Socket>(candidates, settings.connect_attempt_delay, expiry, connected_endpoint, ec);
+		guard.watch(socket);
+		if (!ec)
+			co_await greet(socket, ec);
+		if (ec && guard.expired())
+			ec = asio::error::timed_out;
+		co_return socket;
+	}
+
+	// The greeting and, if configured, the username / password sub-negotiation.
+	asio::awaitable<void> greet(Socket &socket, asio::error_code &ec)
+	{
+		socket.set_option(asio::ip::tcp::no_delay(true), ec);
+
+		bool authenticate = !settings.username.empty();
+		std::array<uint8_t, 3> greeting = { socks_version, 1, authenticate ? socks_method_user_pwd : socks_method_no_auth };
+		std::array<uint8_t, 2> selection = {};
+		co_await asio::async_write(socket, asio::buffer(greeting), asio::redirect_error(asio::use_awaitable, ec));
+		if (!ec)
+			co_await asio::async_read(socket, asio::buffer(selection), asio::transfer_all(), asio::redirect_error(asio::use_awaitable, ec));
+		if (ec)
+			co_return;
+		if (selection[0] != socks_version || selection[1] != greeting[2])
+		{
+			ec = asio::error::access_denied;
+			co_return;
+		}
+
+		if (authenticate)
+		{
+			// VER | ULEN | UNAME | PLEN | PASSWD, lengths were checked when the options were parsed.
+			std::vector<uint8_t> message;
+			message.reserve(3 + settings.username.size() + settings.password.size());
+			message.push_back(socks_auth_version);
+			message.push_back((uint8_t)settings.username.size());
+			message.insert(message.end(), settings.username.begin(), settings.username.end());
+			message.push_back((uint8_t)settings.password.size());
+			message.insert(message.end(), settings.password.begin(), settings.password.end());
+
+			std::array<uint8_t, 2> auth_reply = {};
+			co_await asio::async_write(socket, asio::buffer(message), asio::redirect_error(asio::use_awaitable, ec));
+			if (!ec)
+				co_await asio::async_read(socket, asio::buffer(auth_reply), asio::transfer_all(), asio::redirect_error(asio::use_awaitable, ec));
+			if (!ec && auth_reply[1] != socks_auth_success)
+				ec = asio::error::access_denied;
+		}
+	}
+
+	// Reads exactly one reply, so that data the destination sends right away stays in the socket.
+	asio::awaitable<uint8_t> read_reply(Socket &socket, asio::error_code &ec)
+	{
+		std::array<uint8_t, 3 + socks5_max_address_size> reply = {};
+		co_await asio::async_read(socket, asio::buffer(reply.data(), 5), asio::transfer_all(), asio::redirect_error(asio::use_awaitable, ec));
+		if (ec)
+			co_return socks_reply_general_failure;
+
+		size_t address_size = encoded_address_size(reply[3], reply[4]);
+		if (reply[0] != socks_version || address_size == 0)
+		{
+			ec = asio::error::invalid_argument;
+			co_return socks_reply_general_failure;
+		}
+
+		co_await asio::async_read(socket, asio::buffer(reply.data() + 5, address_size - 2), asio::transfer_all(), asio::redirect_error(asio::use_awaitable, ec));
+		co_return reply[1];
+	}
+
+	asio::any_io_executor executor;
+	dns_cache &dns;
+	config settings;
+	asio::steady_timer wakeup;
+	std::deque<std::shared_ptr<idle_connection>> idle;
+	size_t dialling = 0;
+	std::chrono::steady_clock::time_point retry_time;
+};
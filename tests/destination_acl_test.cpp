@@ -0,0 +1,126 @@
+﻿#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include "destination_acl.hpp"
+#include "test_check.hpp"
+
+using verdict = destination_acl::verdict;
+
+destination_acl load_rules(const std::string &rules)
+{
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "socks5demo_acl_test.txt";
+	std::ofstream(path) << rules;
+	destination_acl result;
+	std::string error;
+	bool loaded = result.load(path.string(), error);
+	std::filesystem::remove(path);
+	if (!loaded)
+		std::printf("load failed: %s\n", error.c_str());
+	CHECK(loaded);
+	return result;
+}
+
+verdict match_address(const destination_acl &rules, const char *address)
+{
+	return rules.match(asio::ip::make_address(address));
+}
+
+void longest_prefix_wins()
+{
+	destination_acl rules = load_rules(
+		"deny 10.0.0.0/8\n"
+		"allow 10.1.0.0/16\n"
+		"deny 10.1.2.3\n"
+		"allow 2001:db8::/32\n"
+		"deny 2001:db8:bad::/48\n"
+		"default deny\n");
+	CHECK(match_address(rules, "10.9.9.9") == verdict::deny);
+	CHECK(match_address(rules, "10.1.9.9") == verdict::allow);
+	CHECK(match_address(rules, "10.1.2.3") == verdict::deny);
+	CHECK(match_address(rules, "10.1.2.4") == verdict::allow);
+	CHECK(match_address(rules, "192.0.2.1") == verdict::deny);
+	CHECK(match_address(rules, "2001:db8:1::1") == verdict::allow);
+	CHECK(match_address(rules, "2001:db8:bad::1") == verdict::deny);
+	CHECK(match_address(rules, "2001:db9::1") == verdict::deny);
+}
+
+void zero_length_prefix()
+{
+	destination_acl rules = load_rules("deny 0.0.0.0/0\nallow 192.0.2.0/24\n");
+	CHECK(match_address(rules, "198.51.100.1") == verdict::deny);
+	CHECK(match_address(rules, "192.0.2.77") == verdict::allow);
+	CHECK(match_address(rules, "::1") == verdict::allow);
+}
+
+void v4_mapped_addresses()
+{
+	destination_acl rules = load_rules("deny 127.0.0.0/8\nallow ::ffff:127.0.0.2\n");
+	CHECK(match_address(rules, "::ffff:127.0.0.1") == verdict::deny);
+	CHECK(match_address(rules, "127.0.0.2") == verdict::allow);
+	CHECK(match_address(rules, "::ffff:127.0.0.2") == verdict::allow);
+	CHECK(match_address(rules, "::ffff:10.0.0.1") == verdict::allow);
+}
+
+void domain_suffixes()
+{
+	destination_acl rules = load_rules(
+		"deny example.com\n"
+		"allow *.good.example.com\n"
+		"deny .bad.org\n");
+	CHECK(rules.match("example.com") == verdict::deny);
+	CHECK(rules.match("WWW.Example.COM.") == verdict::deny);
+	CHECK(rules.match("good.example.com") == verdict::allow);
+	CHECK(rules.match("a.b.good.example.com") == verdict::allow);
+	CHECK(rules.match("notexample.com") == verdict::none);
+	CHECK(rules.match("example.com.evil.net") == verdict::none);
+	CHECK(rules.match("x.bad.org") == verdict::deny);
+	CHECK(rules.match("org") == verdict::none);
+	CHECK(rules.match("") == verdict::none);
+}
+
+void address_literals_as_names()
+{
+	destination_acl rules = load_rules(
+		"deny 10.0.0.0/8\n"
+		"deny ::1\n"
+		"deny 10.example\n"
+		"default allow\n");
+	CHECK(rules.match("10.0.0.5") == verdict::deny);
+	CHECK(rules.match("10.0.0.5.") == verdict::deny);
+	CHECK(rules.match("::1") == verdict::deny);
+	CHECK(rules.match("::ffff:10.0.0.5") == verdict::deny);
+	CHECK(rules.match("192.0.2.1") == verdict::allow);
+	CHECK(rules.match("10.5") == verdict::deny);
+	CHECK(rules.match("167772165") == verdict::deny);
+	CHECK(rules.match("0x0a000005") == verdict::deny);
+	CHECK(rules.match("012.0.0.5") == verdict::deny);
+	CHECK(rules.match("10.0.0.256") == verdict::none);
+	CHECK(rules.match("1.2.3.4.5") == verdict::none);
+	CHECK(rules.match("10.example") == verdict::deny);
+}
+
+void malformed_rules()
+{
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "socks5demo_acl_test.txt";
+	for (const char *line : { "allow 10.0.0.0/33\n", "deny ::/129\n", "permit example.com\n", "default maybe\n", "allow 10.0.0.0/x\n" })
+	{
+		std::ofstream(path) << line;
+		destination_acl rules;
+		std::string error;
+		CHECK(!rules.load(path.string(), error));
+		CHECK(!error.empty());
+	}
+	std::filesystem::remove(path);
+}
+
+int main()
+{
+	longest_prefix_wins();
+	zero_length_prefix();
+	v4_mapped_addresses();
+	domain_suffixes();
+	address_literals_as_names();
+	malformed_rules();
+	return test_result();
+}
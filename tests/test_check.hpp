@@ -0,0 +1,24 @@
+﻿#pragma once
+#include <cstdio>
+
+// Minimal checks for the unit tests: a failed check prints where it is and the
+// test carries on, and main() returns test_result() so ctest sees the failures.
+
+inline int test_failures = 0;
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+			test_failures++; \
+		} \
+	} while (false)
+
+inline int test_result()
+{
+	if (test_failures != 0)
+		std::printf("%d check(s) failed\n", test_failures);
+	return test_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,211 @@
+﻿#include <algorithm>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "udp_reassembly.hpp"
+#include "test_check.hpp"
+
+// Writes RSV | FRAG | ATYP=domain | DST.ADDR | DST.PORT | payload into `output`
+// and returns the datagram's size.
+size_t write_datagram(std::span<uint8_t> output, uint8_t frag, std::string_view hostname, std::string_view payload)
+{
+	size_t size = 0;
+	output[size++] = 0;
+	output[size++] = 0;
+	output[size++] = frag;
+	output[size++] = socks_atyp_domain;
+	output[size++] = (uint8_t)hostname.size();
+	std::memcpy(output.data() + size, hostname.data(), hostname.size());
+	size += hostname.size();
+	write_port(output.data() + size, 53);
+	size += 2;
+	std::memcpy(output.data() + size, payload.data(), payload.size());
+	return size + payload.size();
+}
+
+std::vector<uint8_t> make_datagram(uint8_t frag, std::string_view hostname, std::string_view payload)
+{
+	std::vector<uint8_t> datagram(7 + hostname.size() + payload.size());
+	write_datagram(datagram, frag, hostname, payload);
+	return datagram;
+}
+
+udp_reassembly::status add(udp_reassembly &fragments, std::span<uint8_t> datagram)
+{
+	socks5_udp_header header;
+	CHECK(decode_udp_header(datagram, header) == socks5_decode_status::complete);
+	return fragments.add(datagram, header);
+}
+
+std::string joined_payload(const udp_reassembly &fragments)
+{
+	std::string result;
+	for (const asio::const_buffer &piece : fragments.payload())
+		result.append((const char *)piece.data(), piece.size());
+	return result;
+}
+
+void in_order_fragments()
+{
+	admission_control budget;
+	udp_reassembly fragments(budget);
+	std::vector<uint8_t> first = make_datagram(1, "example.com", "abc");
+	std::vector<uint8_t> second = make_datagram(2, "example.com", "def");
+	std::vector<uint8_t> last = make_datagram(3 | udp_reassembly::last_fragment_flag, "example.com", "gh");
+	CHECK(add(fragments, first) == udp_reassembly::status::pending);
+	CHECK(fragments.active());
+	CHECK(add(fragments, second) == udp_reassembly::status::pending);
+	CHECK(add(fragments, last) == udp_reassembly::status::complete);
+	CHECK(!fragments.active());
+	CHECK(fragments.payload_size() == 8);
+	CHECK(joined_payload(fragments) == "abcdefgh");
+	CHECK(fragments.header().destination.hostname == "example.com");
+	CHECK(fragments.header().destination.port == 53);
+	fragments.release();
+	CHECK(budget.relay_memory_used() == 0);
+}
+
+void fragment_received_in_place()
+{
+	admission_control budget;
+	udp_reassembly fragments(budget);
+	std::vector<uint8_t> first = make_datagram(1, "example.com", "abc");
+	CHECK(add(fragments, first) == udp_reassembly::status::pending);
+
+	std::span<uint8_t> space = fragments.receive_space(512);
+	CHECK(space.size() == 512);
+	size_t size = write_datagram(space, 2 | udp_reassembly::last_fragment_flag, "example.com", "def");
+	CHECK(add(fragments, space.first(size)) == udp_reassembly::status::complete);
+	CHECK(joined_payload(fragments) == "abcdef");
+	fragments.release();
+}
+
+// A datagram that is not a fragment ends the sequence. It may have been received into the
+// reassembly buffer, and its header and payload must stay readable until release().
+void fragment_then_whole_datagram()
+{
+	admission_control budget;
+	udp_reassembly fragments(budget);
+	std::vector<uint8_t> first = make_datagram(1, "example.com", "abc");
+	CHECK(add(fragments, first) == udp_reassembly::status::pending);
+	size_t reserved = budget.relay_memory_used();
+	CHECK(reserved == udp_reassembly::buffer_size);
+
+	std::span<uint8_t> space = fragments.receive_space(512);
+	CHECK(!space.empty());
+	size_t size = write_datagram(space, 0, "whole.example.org", "payload");
+	socks5_udp_header header;
+	CHECK(decode_udp_header(space.first(size), header) == socks5_decode_status::complete);
+	CHECK(header.frag == 0);
+
+	fragments.abandon();
+	CHECK(!fragments.active());
+	CHECK(fragments.receive_space(512).empty());
+	CHECK(budget.relay_memory_used() == reserved);
+	CHECK(header.destination.hostname == "whole.example.org");
+	CHECK(std::string_view((const char *)space.data() + header.header_size, size - header.header_size) == "payload");
+
+	fragments.release();
+	CHECK(budget.relay_memory_used() == 0);
+
+	// The next sequence starts from scratch.
+	std::vector<uint8_t> again = make_datagram(1 | udp_reassembly::last_fragment_flag, "example.com", "xyz");
+	CHECK(add(fragments, again) == udp_reassembly::status::complete);
+	CHECK(joined_payload(fragments) == "xyz");
+	fragments.release();
+}
+
+// The reassembly timer releases a sequence that is still under way.
+void expired_sequence()
+{
+	admission_control budget;
+	udp_reassembly fragments(budget);
+	std::vector<uint8_t> first = make_datagram(1, "example.com", "abc");
+	std::vector<uint8_t> second = make_datagram(2, "example.com", "def");
+	std::vector<uint8_t> last = make_datagram(3 | udp_reassembly::last_fragment_flag, "example.com", "gh");
+	CHECK(add(fragments, first) == udp_reassembly::status::pending);
+	CHECK(add(fragments, second) == udp_reassembly::status::pending);
+
+	fragments.release();
+	CHECK(!fragments.active());
+	CHECK(fragments.receive_space(512).empty());
+	CHECK(budget.relay_memory_used() == 0);
+
+	// The rest of the expired sequence is dropped, and a new one can start.
+	CHECK(add(fragments, last) == udp_reassembly::status::dropped);
+	CHECK(budget.relay_memory_used() == 0);
+	CHECK(add(fragments, first) == udp_reassembly::status::pending);
+	CHECK(budget.relay_memory_used() == udp_reassembly::buffer_size);
+	fragments.release();
+	CHECK(budget.relay_memory_used() == 0);
+}
+
+void broken_sequences()
+{
+	admission_control budget;
+	udp_reassembly fragments(budget);
+	std::vector<uint8_t> first = make_datagram(1, "example.com", "abc");
+	std::vector<uint8_t> third = make_datagram(3, "example.com", "ghi");
+	std::vector<uint8_t> elsewhere = make_datagram(2, "example.net", "def");
+
+	// A gap abandons the sequence.
+	CHECK(add(fragments, first) == udp_reassembly::status::pending);
+	CHECK(add(fragments, third) == udp_reassembly::status::dropped);
+	CHECK(!fragments.active());
+
+	// So does a fragment for another destination.
+	CHECK(add(fragments, first) == udp_reassembly::status::pending);
+	CHECK(add(fragments, elsewhere) == udp_reassembly::status::dropped);
+	CHECK(!fragments.active());
+
+	// A repeated first fragment starts over.
+	CHECK(add(fragments, first) == udp_reassembly::status::pending);
+	CHECK(add(fragments, first) == udp_reassembly::status::pending);
+	std::vector<uint8_t> last = make_datagram(2 | udp_reassembly::last_fragment_flag, "example.com", "def");
+	CHECK(add(fragments, last) == udp_reassembly::status::complete);
+	CHECK(joined_payload(fragments) == "abcdef");
+
+	// A sequence cannot begin in the middle.
+	CHECK(add(fragments, third) == udp_reassembly::status::dropped);
+	fragments.release();
+	CHECK(budget.relay_memory_used() == 0);
+}
+
+void oversized_payload()
+{
+	admission_control budget;
+	udp_reassembly fragments(budget);
+	std::string chunk(30000, 'x');
+	std::vector<uint8_t> first = make_datagram(1, "example.com", chunk);
+	std::vector<uint8_t> second = make_datagram(2, "example.com", chunk);
+	std::vector<uint8_t> third = make_datagram(3, "example.com", chunk);
+	CHECK(add(fragments, first) == udp_reassembly::status::pending);
+	CHECK(add(fragments, second) == udp_reassembly::status::pending);
+	CHECK(add(fragments, third) == udp_reassembly::status::dropped);
+	CHECK(!fragments.active());
+	fragments.release();
+}
+
+void memory_budget()
+{
+	admission_control budget;
+	budget.configure({ .relay_memory_budget = udp_reassembly::buffer_size / 2 });
+	udp_reassembly fragments(budget);
+	std::vector<uint8_t> first = make_datagram(1, "example.com", "abc");
+	CHECK(add(fragments, first) == udp_reassembly::status::dropped);
+	CHECK(budget.relay_memory_used() == 0);
+}
+
+int main()
+{
+	in_order_fragments();
+	fragment_received_in_place();
+	fragment_then_whole_datagram();
+	expired_sequence();
+	broken_sequences();
+	oversized_payload();
+	memory_budget();
+	return test_result();
+}